@@ -0,0 +1,237 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * dbbench.c - time the prefs DB backends
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * A development tool; it is not installed. It runs the same
+ *   sequence of operations against a dbopen(3) btree and the log
+ *   store (db_log.c) in DIR and prints the time each one took:
+ *
+ *     put    N inserts, then one sync (write-behind, as db.c does)
+ *     sync   up to 1000 updates, each followed by a sync
+ *     get    N lookups of random keys
+ *     walk   one R_NEXT pass over all keys
+ *     open   close and reopen; the log store rebuilds its index
+ *
+ * * Values are about the size of an encoded AP record by default.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdarg.h>
+#include <getopt.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+
+static int64_t
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void
+report(const char *be, const char *op, size_t n, int64_t us)
+{
+    double ops = us > 0 ? (double)n * 1e6 / (double)us : 0.0;
+
+    printf("%-6s %-5s %8zu %10.3f ms %12.0f ops/s\n", be, op, n, us / 1000.0, ops);
+}
+
+
+static DB *
+open_db(const char *fn, int log)
+{
+    BTREEINFO bt;
+
+    if (log) return dblog_open(fn, O_RDWR|O_CREAT, 0600);
+
+    memset(&bt, 0, sizeof bt);
+    bt.cachesize = IFSCAND_DB_CACHE;
+    return dbopen(fn, O_RDWR|O_CREAT, 0600, DB_BTREE, &bt);
+}
+
+
+static void
+put(DB *d, size_t i, uint8_t *val, size_t vsz)
+{
+    char key[32];
+    DBT  k, v;
+
+    snprintf(key, sizeof key, "ap.bench%08zu", i);
+
+    k.data = key;
+    k.size = strlen(key);
+    v.data = val;
+    v.size = vsz;
+    if (d->put(d, &k, &v, 0) < 0) error(1, errno, "can't put %s", key);
+}
+
+
+static void
+bench(const char *dir, int log, size_t n, size_t vsz)
+{
+    const char *be = log ? "log" : "btree";
+    char fn[PATH_MAX];
+    uint8_t *val = malloc(vsz);
+    size_t i, nsync = n < 1000 ? n : 1000;
+    int64_t t;
+    DB *d;
+    DBT k, v;
+
+    if (!val) error(1, ENOMEM, "can't allocate %zu bytes", vsz);
+    memset(val, 0xa5, vsz);
+
+    snprintf(fn, sizeof fn, "%s/dbbench.%s", dir, be);
+    unlink(fn);
+
+    if (!(d = open_db(fn, log))) error(1, errno, "can't open %s", fn);
+
+    t = now_us();
+    for (i = 0; i < n; i++) put(d, i, val, vsz);
+    d->sync(d, 0);
+    report(be, "put", n, now_us() - t);
+
+    t = now_us();
+    for (i = 0; i < nsync; i++) {
+        put(d, i, val, vsz);
+        d->sync(d, 0);
+    }
+    report(be, "sync", nsync, now_us() - t);
+
+    srandom(1);
+    t = now_us();
+    for (i = 0; i < n; i++) {
+        char key[32];
+
+        snprintf(key, sizeof key, "ap.bench%08zu", (size_t)random() % n);
+        k.data = key;
+        k.size = strlen(key);
+        if (d->get(d, &k, &v, 0) != 0) error(1, 0, "%s: missing %s", be, key);
+    }
+    report(be, "get", n, now_us() - t);
+
+    t = now_us();
+    for (i = 0; d->seq(d, &k, &v, i ? R_NEXT : R_FIRST) == 0; i++)
+        ;
+    report(be, "walk", i, now_us() - t);
+
+    t = now_us();
+    d->close(d);
+    if (!(d = open_db(fn, log))) error(1, errno, "can't reopen %s", fn);
+    report(be, "open", n, now_us() - t);
+
+    d->close(d);
+    unlink(fn);
+    free(val);
+}
+
+
+// db_log.c logs through these
+void
+printlog(int lev, const char *fmt, ...)
+{
+    va_list ap;
+
+    (void)lev;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+
+void
+debuglog(const char *fmt, ...)
+{
+    (void)fmt;
+}
+
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: %s [-n COUNT] [-s VALSIZE] DIR\n", program_name);
+    exit(1);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    const char *err = 0;
+    size_t n   = 10000;
+    size_t vsz = 512;
+    int c;
+
+    program_name = argv[0];
+
+    while ((c = getopt(argc, argv, "n:s:")) != -1) {
+        switch (c) {
+            case 'n':
+                n = strtonum(optarg, 1, 10000000, &err);
+                if (err) error(1, 0, "count %s is %s", optarg, err);
+                break;
+
+            case 's':
+                vsz = strtonum(optarg, 1, 65536, &err);
+                if (err) error(1, 0, "value size %s is %s", optarg, err);
+                break;
+
+            default:
+                usage();
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+    if (argc != 1) usage();
+
+    bench(argv[0], 0, n, vsz);
+    bench(argv[0], 1, n, vsz);
+    return 0;
+}
+
+/* EOF */
@@ -0,0 +1,254 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * rendbench.c - time text and json rendering of a scan
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * A development tool; it is not installed. It fills a snapshot
+ *   with COUNT synthetic nodes (5000 by default; every 10th has a
+ *   join history) and times snap_render() - the "scan" output -
+ *   as text and as json, ROUNDS times each.
+ *
+ * * The DB, event and deferred-reply calls the linked modules make
+ *   are stubbed out below; nothing is persisted.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <stdarg.h>
+#include <getopt.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+
+static int64_t
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/*
+ * Fill 's' with 'n' APs on a few channels with varied names and
+ * signal strengths.
+ */
+static void
+fill(scansnap *s, size_t n, apdb *db)
+{
+    size_t i;
+
+    VECT_RESERVE(&s->nv, n);
+    for (i = 0; i < n; i++) {
+        struct ieee80211_nodereq *nr = &VECT_GET_NEXT(&s->nv);
+        int len;
+
+        memset(nr, 0, sizeof *nr);
+        len = snprintf((char *)nr->nr_nwid, sizeof nr->nr_nwid, "bench-ap-%zu", i);
+
+        nr->nr_nwid_len = len;
+        nr->nr_flags    = IEEE80211_NODEREQ_AP;
+        nr->nr_channel  = 1 + (i % 11);
+        nr->nr_rssi     = 20 + (i % 60);
+        nr->nr_max_rssi = 100;
+        nr->nr_capinfo  = IEEE80211_CAPINFO_ESS | IEEE80211_CAPINFO_PRIVACY;
+        nr->nr_nrates   = 4;
+        nr->nr_rates[0] = 2;
+        nr->nr_rates[1] = 4;
+        nr->nr_rates[2] = 11;
+        nr->nr_rates[3] = 22;
+
+        nr->nr_bssid[0] = 0x02;
+        nr->nr_bssid[3] = i >> 16;
+        nr->nr_bssid[4] = i >> 8;
+        nr->nr_bssid[5] = i;
+
+        if (i % 10 == 0) joinhist_record(db, nr->nr_bssid, i % 20 == 0, 800, 1500);
+    }
+}
+
+
+static void
+bench(scansnap *s, int json, int rounds)
+{
+    fast_buf b;
+    int64_t  t;
+    size_t   bytes = 0;
+    int      i;
+
+    fast_buf_init(&b, IPC_DGRAMSZ);
+
+    t = now_us();
+    for (i = 0; i < rounds; i++) {
+        fast_buf_reset(&b);
+        snap_render(s, &b, json);
+        bytes = fast_buf_size(&b);
+    }
+    t = now_us() - t;
+
+    printf("%-5s %6zu nodes %9zu bytes %10.3f ms/render %8.1f MB/s\n",
+           json ? "json" : "text", VECT_SIZE(&s->nv), bytes,
+           t / 1000.0 / rounds, t > 0 ? (double)bytes * rounds / t : 0.0);
+
+    fast_buf_fini(&b);
+}
+
+
+/*
+ * Stubs for what snap.c and joinhist.c call in the daemon.
+ */
+void
+printlog(int lev, const char *fmt, ...)
+{
+    va_list ap;
+
+    (void)lev;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+
+void
+debuglog(const char *fmt, ...)
+{
+    (void)fmt;
+}
+
+
+void
+event_post(const char *type, const char *fmt, ...)
+{
+    (void)type;
+    (void)fmt;
+}
+
+
+void
+defer_complete(ifstate *ifs, int what, const char *arg, int status)
+{
+    (void)ifs;
+    (void)what;
+    (void)arg;
+    (void)status;
+}
+
+
+int
+db_get_uint(apdb *db, const char *key, unsigned int *p_res)
+{
+    (void)db;
+    (void)key;
+    (void)p_res;
+    return 0;
+}
+
+
+size_t
+db_get_blob(apdb *db, const char *key, void *buf, size_t bsiz)
+{
+    (void)db;
+    (void)key;
+    (void)buf;
+    (void)bsiz;
+    return 0;
+}
+
+
+void
+db_set_blob(apdb *db, const char *key, const void *buf, size_t n)
+{
+    (void)db;
+    (void)key;
+    (void)buf;
+    (void)n;
+}
+
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: %s [-n COUNT] [-r ROUNDS]\n", program_name);
+    exit(1);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    const char *err = 0;
+    size_t n      = 5000;
+    int    rounds = 100;
+    int    c;
+    apdb   db;
+
+    program_name = argv[0];
+
+    while ((c = getopt(argc, argv, "n:r:")) != -1) {
+        switch (c) {
+            case 'n':
+                n = strtonum(optarg, 1, 1000000, &err);
+                if (err) error(1, 0, "count %s is %s", optarg, err);
+                break;
+
+            case 'r':
+                rounds = strtonum(optarg, 1, 1000000, &err);
+                if (err) error(1, 0, "rounds %s is %s", optarg, err);
+                break;
+
+            default:
+                usage();
+        }
+    }
+
+    memset(&db, 0, sizeof db);
+
+    scansnap *s = snap_new();
+
+    fill(s, n, &db);
+    bench(s, 0, rounds);
+    bench(s, 1, rounds);
+
+    snap_put(s);
+    return 0;
+}
+
+/* EOF */
@@ -13,7 +13,9 @@
 extern "C" {
 #endif /* __cplusplus */
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <netinet/in.h>
 #include <sys/param.h>
 #include <sys/select.h>
@@ -30,6 +32,151 @@ extern "C" {
 #define IFSCAND_SOCK        "/var/run/ifscand"
 
 
+/*
+ * Control socket framing.
+ *
+ * Requests and responses are carried in one or more datagrams; each
+ * datagram starts with an ipc_hdr. The client picks 'seq' for each
+ * request and the daemon echoes it in every fragment of the reply.
+ * Fragments are numbered from zero; the last one has IPC_F_END set.
+ *
+ * Datagrams that don't start with IPC_MAGIC are treated as a
+ * complete, unframed text request (older ifscanctl); the reply to
+ * such a request is a single unframed datagram.
+ */
+#define IPC_MAGIC       0x63736669  // "ifsc"
+#define IPC_DGRAMSZ     2048        // max size of one datagram
+#define IPC_MAXREQ      (16 * 1048576) // max size of a reassembled request
+#define IPC_TIMEOUT     40          // default client timeout (seconds); > a join
+#define IPC_SOCKBUF     (64 * 1024) // socket buffers each end asks for
+
+#define IPC_F_END       (1 << 0)    // last fragment of a message
+
+struct ipc_hdr
+{
+    uint32_t magic;     // IPC_MAGIC
+    uint32_t seq;       // request# chosen by the client
+    uint16_t part;      // fragment# within this message
+    uint16_t flags;     // IPC_F_xxx
+};
+typedef struct ipc_hdr ipc_hdr;
+
+#define IPC_MAXDATA     (IPC_DGRAMSZ - sizeof(ipc_hdr))
+
+
+/*
+ * Binary control protocol.
+ *
+ * A request whose payload starts with BPROTO_MAGIC is a binary
+ * request: a bproto_hdr followed by zero or more TLVs (see tlv.h).
+ * The response has the same layout. Both ends run on the same host;
+ * so all fields are in host byte order and fixed-layout records
+ * (apdata, ieee80211_nodereq) are sent as is. 'version' guards
+ * against mismatched binaries.
+ */
+#define BPROTO_MAGIC    0x62736669  // "ifsb"
+#define BPROTO_VERSION  3
+
+struct bproto_hdr
+{
+    uint32_t magic;     // BPROTO_MAGIC
+    uint8_t  version;   // BPROTO_VERSION
+    uint8_t  cmd;       // BCMD_xxx
+    uint16_t resv;
+};
+typedef struct bproto_hdr bproto_hdr;
+
+/*
+ * Binary commands
+ */
+#define BCMD_ADD        1   // T_APDATA
+#define BCMD_DEL        2   // T_NAME
+#define BCMD_LIST       3   // -> T_APDATA*
+#define BCMD_SCAN       4   // [T_CACHED] -> ([T_JOINHIST] T_NODE)*
+#define BCMD_GET        5   // -> T_RANDMAC T_SCANINT T_RSSI_SCANINT T_APORDER* T_JOINHIST_MODE T_NODE_TTL
+#define BCMD_SET        6   // any of the settings TLVs
+#define BCMD_DOWN       7
+
+/*
+ * TLV types
+ */
+#define T_OK            1   // empty; command succeeded
+#define T_ERROR         2   // string
+#define T_APDATA        3   // struct apdata
+#define T_NODE          4   // struct ieee80211_nodereq
+#define T_NAME          5   // string
+#define T_CACHED        6   // empty
+#define T_RANDMAC       7   // uint32_t
+#define T_SCANINT       8   // uint32_t
+#define T_RSSI_SCANINT  9   // uint32_t
+#define T_APORDER       10  // string; one per AP in order
+#define T_JOINHIST      11  // bproto_joinhist; join history of the T_NODE that follows
+#define T_JOINHIST_MODE 12  // uint32_t; 1 if the join history is persisted
+#define T_NODE_TTL      13  // uint32_t
+
+/*
+ * Join history of one BSSID (T_JOINHIST); the client renders it
+ * with bproto_joinhist_sprintf().
+ */
+struct bproto_joinhist
+{
+    uint32_t attempts;
+    uint32_t ok;
+    uint32_t fail;
+    uint32_t streak;        // consecutive failures
+    uint32_t assoc_ms;      // average time to associate
+    uint32_t ip_ms;         // average time to configure addresses
+    uint32_t quarantine;    // seconds left; 0 if none
+};
+typedef struct bproto_joinhist bproto_joinhist;
+
+
+/*
+ * Read-only catalog of APs; built by "ifscanctl compile-catalog",
+ * updated by "ifscanctl apply-delta" and mapped by ifscand (see
+ * ifscand/catalog.c).
+ *
+ * A catalog_hdr is followed by 'n' catalog_ent sorted by name
+ * (byte-wise) and then the names and records they point to. Records
+ * are apdata_encode() output. Offsets are from the start of the
+ * file; all fields are in host byte order.
+ *
+ * 'hash' identifies the contents: it is the sum (mod 2^64) of the
+ * FNV-1a hash of each entry's name followed by its record. A delta
+ * names the hash it applies to; being a sum, it can be updated by
+ * looking at just the entries that change.
+ */
+#define IFSCAND_CATALOG     "/var/ifscand/catalog"
+#define CATALOG_MAGIC       0x74736669  // "ifst"
+#define CATALOG_VERSION     2
+
+struct catalog_hdr
+{
+    uint32_t magic;     // CATALOG_MAGIC
+    uint32_t version;   // CATALOG_VERSION
+    uint32_t n;         // # of entries
+    uint32_t size;      // size of the file
+    uint32_t gen;       // 1 when compiled; +1 for each delta
+    uint32_t resv;
+    uint64_t hash;      // content hash
+};
+typedef struct catalog_hdr catalog_hdr;
+
+struct catalog_ent
+{
+    uint32_t name;      // offset of the name (not NUL terminated)
+    uint32_t rec;       // offset of the encoded apdata
+    uint16_t namelen;
+    uint16_t reclen;
+};
+typedef struct catalog_ent catalog_ent;
+
+
+
+/* Handy formats for printing mac address */
+#define sMAC(x)     x[0],x[1],x[2],x[3],x[4],x[5]
+#define MACFMT      "%02x:%02x:%02x:%02x:%02x:%02x"
+
 
 #define AP_NAMELEN  128
 #define AP_KEYLEN   128
@@ -56,6 +203,21 @@ extern "C" {
 #define AP_WEPKEY   (1 << 9)
 #define AP_IN4DHCP  (1 << 10)
 
+/*
+ * PATTERN is set if 'apname' is a glob (see fnmatch(3)) that names
+ * any number of APs; such profiles are stored as "pat.NAME".
+ */
+#define AP_PATTERN  (1 << 11)
+
+/*
+ * BSSIDSET is set if BSSID pinning allows more than the one BSSID
+ * in 'apmac': a list of BSSIDs and/or OUI prefixes.
+ */
+#define AP_BSSIDSET (1 << 12)
+
+#define AP_MAXBSS   64  // pinned BSSIDs per AP
+#define AP_MAXOUI   16  // pinned OUI prefixes per AP
+
 
 
 /*
@@ -70,7 +232,7 @@ struct apdata
     char apname[AP_NAMELEN];
     char key[AP_KEYLEN];
 
-    uint8_t apmac[6];   // pinned MAC addr
+    uint8_t apmac[6];   // pinned MAC addr; the first of 'bss'
     uint8_t mymac[6];   // station MAC addr
 
     struct in_addr in4;
@@ -87,9 +249,22 @@ struct apdata
     uint8_t nr_bssid[6];
     int8_t  nr_rssi;
     int8_t  nr_max_rssi;
+
+    /*
+     * Every BSSID and OUI that pinning allows (AP_BSSID); each list
+     * is sorted. Members from here on are newer than the old,
+     * fixed-size DB records.
+     */
+    uint32_t nbss;
+    uint32_t noui;
+    uint8_t  bss[AP_MAXBSS][6];
+    uint8_t  oui[AP_MAXOUI][3];
 };
 typedef struct apdata apdata;
 
+// Size of the records stored before the compact encoding.
+#define APDATA_V0_SIZE  offsetof(apdata, nbss)
+
 
 // Array of persisted AP's
 VECT_TYPEDEF(apvect, apdata);
@@ -100,6 +275,89 @@ VECT_TYPEDEF(nodevect, struct ieee80211_nodereq);
 // Vector of strings
 VECT_TYPEDEF(strvect, char *);
 
+
+/*
+ * Copy the nwid of a scanned node as a C string.
+ */
+static inline char*
+copy_apname(char *dest, size_t n, const struct ieee80211_nodereq *nr)
+{
+    size_t m = nr->nr_nwid_len > n ? n : nr->nr_nwid_len;
+
+    memcpy(dest, nr->nr_nwid, m);
+    dest[m] = 0;
+
+    return dest;
+}
+
+
+/*
+ * Parse "add" keywords and values in 'args' into 'd'.
+ *
+ * Returns 0 on success, -EINVAL on failure with the reason in 'err'.
+ */
+int apdata_parse(apdata *d, char **args, int argc, char *err, size_t errsz);
+
+/*
+ * Verify that the settings in 'd' are consistent.
+ *
+ * Returns 0 on success, -EINVAL on failure with the reason in 'err'.
+ */
+int apdata_validate(const apdata *d, char *err, size_t errsz);
+
+/*
+ * Describe ap info in text form that can be parsed back; a buffer of
+ * APDATA_TEXT_MAX bytes holds any record.
+ */
+#define APDATA_TEXT_MAX     4096
+
+size_t apdata_sprintf(char *buf, size_t bsiz, const apdata *a);
+
+/* Printable form of a scanned node */
+ssize_t nodereq_sprintf(char *buf, size_t bsiz, const struct ieee80211_nodereq *nr);
+
+/*
+ * Printable form of the join history of a node; it follows the
+ * node's nodereq_sprintf() output in "scan".
+ */
+size_t bproto_joinhist_sprintf(char *buf, size_t bsiz, const bproto_joinhist *h);
+
+/*
+ * Compact, versioned encoding of 'd' for storage (see apdata.c).
+ * 'buf' must have room for APDATA_ENC_MAX bytes.
+ *
+ * Returns the encoded size.
+ */
+#define APDATA_ENC_MAGIC    0xa0
+#define APDATA_ENC_V1       1
+#define APDATA_ENC_MAX      (6 + 1 + AP_NAMELEN + 1 + AP_KEYLEN + 6 + 6 + 12 + 48 + \
+                             2 + 6 * AP_MAXBSS + 3 * AP_MAXOUI)
+
+ssize_t apdata_encode(uint8_t *buf, size_t bsiz, const apdata *d);
+
+/*
+ * Decode a record written by apdata_encode() - or one written
+ * before it existed, which was a copy of the struct.
+ *
+ * Returns:
+ *    0 for a current record
+ *    1 for an old fixed-size record; it should be rewritten
+ *    -errno if the record is damaged or of an unknown version
+ */
+int apdata_decode(apdata *d, const uint8_t *buf, size_t n);
+
+/*
+ * Return 1 if pinning in 'd' allows 'bssid' (or 'd' isn't pinned),
+ * 0 otherwise.
+ */
+int apdata_bssid_ok(const apdata *d, const uint8_t *bssid);
+
+/* JSON forms of the above; see jsonw.h */
+struct jsonw;
+void apdata_json(struct jsonw *w, const apdata *a);
+void nodereq_json(struct jsonw *w, const struct ieee80211_nodereq *nr);
+void nodereq_json_fields(struct jsonw *w, const struct ieee80211_nodereq *nr);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
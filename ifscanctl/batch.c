@@ -0,0 +1,423 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * batch.c - run many commands over one control session
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * Each non-blank line of the input that isn't a '#' comment is
+ *   one command, exactly as it would follow INTERFACE on the
+ *   command line. Lines are sent as text requests: the daemon's
+ *   reply ("OK" or "ERROR: ...") is the command's status.
+ *
+ * * Up to BATCH_WINDOW requests are in flight at a time; each has
+ *   its own sequence number and replies are matched by it. The
+ *   window matches the number of requests ifscand queues per
+ *   client; anything beyond that would only earn "busy" replies.
+ *
+ * * A "busy" reply is retried after a short, growing delay. Any
+ *   other error is final.
+ *
+ * * Replies with content (list, get ...) are printed as they
+ *   complete. Failures are listed, in input order, at the end.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "utils.h"
+#include "vect.h"
+#include "ifscanctl.h"
+
+#define BATCH_WINDOW    4       // max # of requests in flight
+#define BATCH_TRIES     8       // max # of attempts per command
+#define BATCH_BACKOFF   250     // ms before the first retry
+
+#define BUSY_REPLY      "ERROR: busy"
+
+
+/*
+ * One command in flight or waiting to be retried.
+ */
+struct bslot
+{
+    int      used;
+    unsigned lineno;
+    int      tries;
+    uint32_t seq;       // seq of the current attempt
+    uint16_t next;      // next fragment# we expect
+    int64_t  due;       // retry at this time; 0 if in flight
+    int64_t  deadline;  // give up waiting at this time
+
+    fast_buf req;
+    fast_buf resp;
+};
+typedef struct bslot bslot;
+
+
+/*
+ * A command that failed; reported at the end.
+ */
+struct bfail
+{
+    unsigned lineno;
+    char     cmd[64];
+    char     msg[128];
+};
+typedef struct bfail bfail;
+
+VECT_TYPEDEF(bfailvect, bfail);
+
+
+struct batch
+{
+    int       fd;
+    int64_t   tmo;      // ms to wait for each fragment
+    uint32_t  seq;      // next sequence# to use
+
+    unsigned  ncmds,
+              nok,
+              nretry;
+
+    bslot     slot[BATCH_WINDOW];
+    bfailvect fail;
+};
+typedef struct batch batch;
+
+
+static int64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void
+slot_send(batch *b, bslot *s)
+{
+    s->seq      = b->seq++;
+    s->next     = 0;
+    s->due      = 0;
+    s->deadline = now_ms() + b->tmo;
+    s->tries++;
+
+    fast_buf_reset(&s->resp);
+    send_request(b->fd, s->seq, &s->req);
+}
+
+
+static void
+add_fail(batch *b, unsigned lineno, const char *cmd, const char *msg, size_t n)
+{
+    bfail *f = &VECT_GET_NEXT(&b->fail);
+
+    f->lineno = lineno;
+    strlcpy(f->cmd, cmd, sizeof f->cmd);
+
+    if (n >= sizeof f->msg) n = sizeof f->msg - 1;
+    memcpy(f->msg, msg, n);
+    f->msg[n] = 0;
+}
+
+
+static void
+slot_fail(batch *b, bslot *s, const char *msg, size_t n)
+{
+    VECT_ENSURE(&b->fail, 1);
+
+    // the request is a NUL terminated command line
+    add_fail(b, s->lineno, (char *)fast_buf_ptr(&s->req), msg, n);
+    s->used = 0;
+}
+
+
+/*
+ * Act on the complete reply in 's'.
+ */
+static void
+slot_done(batch *b, bslot *s)
+{
+    char  *p = (char *)fast_buf_ptr(&s->resp);
+    size_t n = fast_buf_size(&s->resp);
+
+    if (n >= strlen(BUSY_REPLY) && 0 == memcmp(p, BUSY_REPLY, strlen(BUSY_REPLY))) {
+        if (s->tries < BATCH_TRIES) {
+            int64_t wait = (int64_t)BATCH_BACKOFF << (s->tries - 1);
+
+            s->due = now_ms() + wait;
+            b->nretry++;
+            return;
+        }
+    }
+
+    if (n >= 6 && 0 == memcmp(p, "ERROR:", 6)) {
+        char  *msg = p + 6;
+        size_t m   = n - 6;
+
+        while (m > 0 && *msg == ' ') msg++, m--;
+        while (m > 0 && msg[m-1] == '\n') m--;
+
+        slot_fail(b, s, msg, m);
+        return;
+    }
+
+    b->nok++;
+    s->used = 0;
+
+    if (n == 2 && 0 == memcmp(p, "OK", 2)) return;
+
+    fwrite(p, 1, n, stdout);
+    if (n > 0 && p[n-1] != '\n') fputc('\n', stdout);
+    fflush(stdout);
+}
+
+
+/*
+ * Read every datagram that is waiting and hand it to its slot.
+ */
+static int
+batch_recv(batch *b)
+{
+    uint8_t pkt[IPC_DGRAMSZ];
+    ipc_hdr h;
+    int i;
+
+    while (1) {
+        ssize_t m = recv(b->fd, pkt, sizeof pkt, MSG_DONTWAIT);
+        if (m < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+
+        if ((size_t)m < sizeof h) continue;
+
+        memcpy(&h, pkt, sizeof h);
+        if (h.magic != IPC_MAGIC) continue;
+
+        for (i = 0; i < BATCH_WINDOW; i++) {
+            bslot *s = &b->slot[i];
+
+            if (s->used && s->due == 0 && s->seq == h.seq) break;
+        }
+        if (i == BATCH_WINDOW) continue;    // stale or unknown
+
+        bslot *s = &b->slot[i];
+
+        if (h.part != s->next) {
+            const char *err = "lost part of the reply";
+
+            slot_fail(b, s, err, strlen(err));
+            continue;
+        }
+
+        s->next++;
+        s->deadline = now_ms() + b->tmo;
+        fast_buf_push(&s->resp, pkt + sizeof h, m - sizeof h);
+
+        if (h.flags & IPC_F_END) slot_done(b, s);
+    }
+}
+
+
+/*
+ * Read the next command from 'fp' into 's'.
+ *
+ * Return 1 if a command was read, 0 at end of input.
+ */
+static int
+next_cmd(batch *b, FILE *fp, unsigned *lineno, bslot *s)
+{
+    char  *line = 0;
+    size_t sz   = 0;
+    int    r    = 0;
+
+    while (getline(&line, &sz, fp) != -1) {
+        char *cmd = strtrim(line);
+
+        ++*lineno;
+        if (*cmd == 0 || *cmd == '#') continue;
+
+        size_t w = strcspn(cmd, " \t");
+
+        if ((w == 5 && 0 == strncmp(cmd, "watch", 5)) || (w == 7 && 0 == strncmp(cmd, "unwatch", 7))) {
+            const char *err = "not supported in batch mode";
+
+            b->ncmds++;
+            VECT_ENSURE(&b->fail, 1);
+            add_fail(b, *lineno, cmd, err, strlen(err));
+            continue;
+        }
+
+        fast_buf_reset(&s->req);
+        fast_buf_push(&s->req, cmd, strlen(cmd) + 1);   // keep the NUL
+        s->req.size--;
+
+        s->used   = 1;
+        s->lineno = *lineno;
+        s->tries  = 0;
+        b->ncmds++;
+        r = 1;
+        break;
+    }
+
+    free(line);
+    return r;
+}
+
+
+static void
+summary(batch *b, const char *name)
+{
+    bfail *f;
+
+    VECT_FOR_EACH(&b->fail, f) {
+        fprintf(stderr, "%s:%u: %s: %s\n", name, f->lineno, f->cmd, f->msg);
+    }
+
+    fprintf(stderr, "%s: %u commands, %u ok, %zu failed, %u retried\n",
+            name, b->ncmds, b->nok, VECT_SIZE(&b->fail), b->nretry);
+}
+
+
+static int
+fail_cmp(const void *x, const void *y)
+{
+    const bfail *a = x;
+    const bfail *c = y;
+
+    return a->lineno < c->lineno ? -1 : a->lineno > c->lineno;
+}
+
+
+/*
+ * Run the commands in 'fp' (named 'name') over the connected
+ * socket 'fd'; wait at most 'timeout' seconds for each part of a
+ * reply.
+ *
+ * Return the # of commands that failed.
+ */
+int
+batch_run(int fd, FILE *fp, const char *name, int timeout)
+{
+    unsigned lineno = 0;
+    int      eof    = 0;
+    batch    b;
+    int      i;
+
+    memset(&b, 0, sizeof b);
+    b.fd  = fd;
+    b.tmo = (int64_t)timeout * 1000;
+    b.seq = arc4random();
+
+    VECT_INIT(&b.fail, 8);
+    for (i = 0; i < BATCH_WINDOW; i++) {
+        fast_buf_init(&b.slot[i].req,  256);
+        fast_buf_init(&b.slot[i].resp, IPC_DGRAMSZ);
+    }
+
+    while (1) {
+        int busy = 0;
+
+        for (i = 0; i < BATCH_WINDOW; i++) {
+            bslot *s = &b.slot[i];
+
+            if (!s->used && !eof) {
+                if (next_cmd(&b, fp, &lineno, s)) slot_send(&b, s);
+                else                              eof = 1;
+            }
+            busy += s->used;
+        }
+
+        if (eof && !busy) break;
+
+        // Sleep until a reply arrives or the earliest retry/deadline.
+        int64_t now  = now_ms();
+        int64_t wake = now + b.tmo;
+
+        for (i = 0; i < BATCH_WINDOW; i++) {
+            bslot  *s = &b.slot[i];
+            int64_t t = s->due ? s->due : s->deadline;
+
+            if (s->used && t < wake) wake = t;
+        }
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int r = poll(&pfd, 1, wake > now ? (int)(wake - now) : 0);
+
+        if (r < 0 && errno != EINTR) error(1, errno, "poll");
+        if (r > 0) {
+            r = batch_recv(&b);
+            if (r < 0) error(1, -r, "can't read response from ifscand");
+        }
+
+        now = now_ms();
+        for (i = 0; i < BATCH_WINDOW; i++) {
+            bslot *s = &b.slot[i];
+
+            if (!s->used) continue;
+
+            if (s->due) {
+                if (s->due <= now) slot_send(&b, s);
+            } else if (s->deadline <= now) {
+                const char *err = s->tries > 1 ? "timed out (daemon busy)" : "timed out";
+
+                slot_fail(&b, s, err, strlen(err));
+            }
+        }
+    }
+
+    VECT_SORT(&b.fail, fail_cmp);
+    summary(&b, name);
+
+    for (i = 0; i < BATCH_WINDOW; i++) {
+        fast_buf_fini(&b.slot[i].req);
+        fast_buf_fini(&b.slot[i].resp);
+    }
+
+    int nfail = VECT_SIZE(&b.fail);
+
+    VECT_FINI(&b.fail);
+    return nfail;
+}
+
+/* EOF */
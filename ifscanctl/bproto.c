@@ -0,0 +1,404 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * bproto.c - binary (TLV) requests and responses for ifscanctl
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * Commands with a fixed shape (add, del, list, scan, get, set,
+ *   down) are sent as binary requests; the daemon returns records
+ *   and we render them here exactly like the text protocol does.
+ *
+ * * Everything else (json output, stats, new commands) goes as
+ *   text. So does a command we can't encode; the daemon then
+ *   reports the error.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "tlv.h"
+#include "ifscanctl.h"
+
+
+/*
+ * Names accepted by get/set and the TLV that carries them.
+ */
+struct keypair
+{
+    const char *name;
+    uint16_t    type;
+};
+
+static const struct keypair Keys[] = {
+      {"randmac",            T_RANDMAC}
+    , {"aporder",            T_APORDER}
+    , {"ap-order",           T_APORDER}
+    , {"scan-interval",      T_SCANINT}
+    , {"scanint",            T_SCANINT}
+    , {"scan-int",           T_SCANINT}
+    , {"rssi-scan-interval", T_RSSI_SCANINT}
+    , {"rssi-scanint",       T_RSSI_SCANINT}
+    , {"rssi-scan-int",      T_RSSI_SCANINT}
+    , {"join-history",       T_JOINHIST_MODE}
+    , {"node-ttl",           T_NODE_TTL}
+    , {0, 0}
+};
+
+
+static uint16_t
+find_key(const char *name)
+{
+    const struct keypair *k;
+
+    for (k = Keys; k->name; k++) {
+        if (0 == strcmp(k->name, name)) return k->type;
+    }
+    return 0;
+}
+
+
+/*
+ * Parse a boolean; return 0/1 or -1 if 'z' isn't one.
+ */
+static int
+parse_bool(const char *z)
+{
+    if (0 == strcasecmp("true", z) ||
+        0 == strcasecmp("yes", z)  ||
+        0 == strcmp("1", z))
+        return 1;
+
+    if (0 == strcasecmp("false", z) ||
+        0 == strcasecmp("no", z)    ||
+        0 == strcmp("0", z))
+        return 0;
+
+    return -1;
+}
+
+
+/*
+ * Encode 'set KEY VAL..'. Return 0 if it has to go as text.
+ */
+static int
+encode_set(fast_buf *req, int argc, char * const *argv)
+{
+    const char *err = 0;
+    long long v;
+    int i;
+
+    if (argc < 2) return 0;
+
+    uint16_t ty = find_key(argv[0]);
+    switch (ty) {
+        case T_RANDMAC:
+            if ((v = parse_bool(argv[1])) < 0) return 0;
+
+            tlv_put_u32(req, ty, v);
+            break;
+
+        case T_SCANINT:
+        case T_RSSI_SCANINT:
+        case T_NODE_TTL:
+            // range is checked by the daemon
+            v = strtonum(argv[1], 0, UINT32_MAX, &err);
+            if (err) return 0;
+
+            tlv_put_u32(req, ty, v);
+            break;
+
+        case T_APORDER:
+            for (i = 1; i < argc; i++) tlv_put_str(req, ty, argv[i]);
+            break;
+
+        default:
+            return 0;
+    }
+    return 1;
+}
+
+
+int
+bproto_encode(bproto_state *st, fast_buf *req, int argc, char * const *argv)
+{
+    const char *cmd = argv[0];
+    bproto_hdr h;
+    char err[256];
+    apdata d;
+
+    memset(st, 0, sizeof *st);
+    memset(&h, 0, sizeof h);
+
+    h.magic   = BPROTO_MAGIC;
+    h.version = BPROTO_VERSION;
+    fast_buf_push(req, &h, sizeof h);
+
+    argc--;
+    argv++;
+
+    if (0 == strcmp(cmd, "add")) {
+        if (apdata_parse(&d, (char **)argv, argc, err, sizeof err) < 0)
+            error(1, 0, "%s", err);
+
+        h.cmd = BCMD_ADD;
+        tlv_put(req, T_APDATA, &d, sizeof d);
+
+    } else if (0 == strcmp(cmd, "del")) {
+        if (argc != 1) goto text;
+
+        h.cmd = BCMD_DEL;
+        tlv_put_str(req, T_NAME, argv[0]);
+
+    } else if (0 == strcmp(cmd, "list")) {
+        if (argc > 0) goto text;
+
+        h.cmd = BCMD_LIST;
+
+    } else if (0 == strcmp(cmd, "scan")) {
+        if (argc > 1) goto text;
+        if (argc == 1) {
+            if (0 != strcmp(argv[0], "cached")) goto text;
+            tlv_put(req, T_CACHED, 0, 0);
+        }
+
+        h.cmd = BCMD_SCAN;
+
+    } else if (0 == strcmp(cmd, "get")) {
+        if (argc != 1) goto text;
+        if (0 != strcmp(argv[0], "all")) {
+            if (!(st->getkey = find_key(argv[0]))) goto text;
+        }
+
+        h.cmd = BCMD_GET;
+
+    } else if (0 == strcmp(cmd, "set")) {
+        if (!encode_set(req, argc, argv)) goto text;
+
+        h.cmd = BCMD_SET;
+
+    } else if (0 == strcmp(cmd, "down")) {
+        h.cmd = BCMD_DOWN;
+
+    } else {
+        goto text;
+    }
+
+    memcpy(fast_buf_ptr(req), &h, sizeof h);
+
+    st->cmd = h.cmd;
+    fast_buf_init(&st->pend, IPC_DGRAMSZ);
+    fast_buf_init(&st->aporder, 256);
+    return 1;
+
+text:
+    fast_buf_reset(req);
+    return 0;
+}
+
+
+static void
+render(bproto_state *st, const tlv *t)
+{
+    char buf[APDATA_TEXT_MAX];
+    char name[AP_NAMELEN];
+
+    switch (t->type) {
+        case T_OK:
+            printf("OK\n");
+            break;
+
+        case T_ERROR:
+            st->err = 1;
+            printf("ERROR: %s\n", tlv_str(t, buf, sizeof buf));
+            break;
+
+        case T_APDATA: {
+            apdata a;
+
+            if (t->len != sizeof a) break;
+
+            memcpy(&a, t->val, sizeof a);
+            a.apname[sizeof a.apname - 1] = 0;
+            a.key[sizeof a.key - 1]       = 0;
+
+            apdata_sprintf(buf, sizeof buf, &a);
+            printf("%s\n", buf);
+            break;
+        }
+
+        case T_NODE: {
+            struct ieee80211_nodereq nr;
+
+            if (t->len != sizeof nr) break;
+
+            memcpy(&nr, t->val, sizeof nr);
+            nodereq_sprintf(buf, sizeof buf, &nr);
+            if (st->hashist) {
+                size_t m = strlen(buf);
+
+                bproto_joinhist_sprintf(buf + m, sizeof buf - m, &st->nodehist);
+                st->hashist = 0;
+            }
+            printf("%s\n", buf);
+            break;
+        }
+
+        case T_JOINHIST:
+            if (t->len != sizeof st->nodehist) break;
+
+            memcpy(&st->nodehist, t->val, sizeof st->nodehist);
+            st->hashist = 1;
+            break;
+
+        case T_JOINHIST_MODE:
+            st->joinhist = tlv_u32(t);
+            break;
+
+        case T_NODE_TTL:
+            st->nodettl = tlv_u32(t);
+            break;
+
+        case T_RANDMAC:
+            st->randmac = tlv_u32(t);
+            break;
+
+        case T_SCANINT:
+            st->scanint = tlv_u32(t);
+            break;
+
+        case T_RSSI_SCANINT:
+            st->rssi_scanint = tlv_u32(t);
+            break;
+
+        case T_APORDER:
+            snprintf(buf, sizeof buf, " \"%s\"", tlv_str(t, name, sizeof name));
+            fast_buf_push(&st->aporder, buf, strlen(buf));
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+void
+bproto_sink(void *ctx, const uint8_t *buf, size_t n)
+{
+    bproto_state *st = ctx;
+
+    if (st->text) {
+        if (n > 0) st->last = buf[n-1];
+        fwrite(buf, 1, n, stdout);
+        return;
+    }
+
+    fast_buf_push(&st->pend, buf, n);
+
+    const uint8_t *p = fast_buf_ptr(&st->pend);
+    size_t         m = fast_buf_size(&st->pend);
+    tlv t;
+
+    if (st->nhdr == 0) {
+        bproto_hdr h;
+
+        if (m < sizeof h) return;
+
+        memcpy(&h, p, sizeof h);
+        if (h.magic != BPROTO_MAGIC) {
+            // An older daemon that doesn't speak binary.
+            st->text = 1;
+            fast_buf_reset(&st->pend);
+            bproto_sink(st, p, m);
+            return;
+        }
+
+        st->nhdr = sizeof h;
+        p += sizeof h;
+        m -= sizeof h;
+    }
+
+    while (tlv_get(&p, &m, &t)) render(st, &t);
+
+    // Keep the partial record for the next fragment.
+    if (m > 0) memmove(fast_buf_ptr(&st->pend), p, m);
+    st->pend.size = m;
+}
+
+
+void
+bproto_end(bproto_state *st)
+{
+    if (st->text) {
+        if (st->last != '\n') printf("\n");
+        goto end;
+    }
+
+    if (st->cmd != BCMD_GET || st->nhdr == 0 || st->err) goto end;
+
+    uint16_t k = st->getkey;
+
+    if (!k || k == T_RANDMAC)
+        printf("randmac %s\n", st->randmac ? "true" : "false");
+
+    if (!k || k == T_APORDER) {
+        if (fast_buf_size(&st->aporder) > 0) {
+            fast_buf_append(&st->aporder, 0);
+            printf("ap-order%s\n", fast_buf_ptr(&st->aporder));
+        } else {
+            printf("\n");
+        }
+    }
+
+    if (!k || k == T_SCANINT)
+        printf("scan-int %u\n", st->scanint);
+
+    if (!k || k == T_RSSI_SCANINT)
+        printf("rssi-scan-int %u\n", st->rssi_scanint);
+
+    if (!k || k == T_JOINHIST_MODE)
+        printf("join-history %s\n", st->joinhist ? "persist" : "memory");
+
+    if (!k || k == T_NODE_TTL)
+        printf("node-ttl %u\n", st->nodettl);
+
+end:
+    fast_buf_fini(&st->pend);
+    fast_buf_fini(&st->aporder);
+}
+
+/* EOF */
@@ -0,0 +1,661 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * catalog.c - compile and update the AP catalog for ifscand
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * The input to compile-catalog has the same form as "import": one
+ *   "add nwid ..." line per AP; blank lines and '#' comments are
+ *   ignored. If a name appears more than once, the last definition
+ *   wins.
+ *
+ * * A delta names the catalog it applies to and the APs that
+ *   change:
+ *
+ *       base HASH
+ *       add nwid NAME ...      # NAME must be new
+ *       mod nwid NAME ...      # NAME must be in the catalog
+ *       del NAME               # NAME must be in the catalog
+ *
+ *   HASH is the catalog's "version" as printed by compile-catalog,
+ *   apply-delta and "stats". Only the changed entries are encoded
+ *   and hashed; the rest are copied as they are.
+ *
+ * * Every bad line is reported; if there are any, nothing is
+ *   written.
+ *
+ * * The catalog is written to a temporary file in the same
+ *   directory and renamed over the old one; ifscand sees either
+ *   the old catalog or the new one, never a partial one. Writers
+ *   hold an flock(2) on the old catalog so that two of them can't
+ *   both build on the same base.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "utils.h"
+#include "vect.h"
+#include "ifscanctl.h"
+
+
+#define DELTA_ADD   1
+#define DELTA_MOD   2
+#define DELTA_DEL   3
+
+
+/*
+ * One parsed AP (or delta line); 'line' orders duplicates.
+ */
+struct catap
+{
+    apdata   d;
+    unsigned line;
+    int      op;    // DELTA_xxx for a delta
+};
+typedef struct catap catap;
+
+VECT_TYPEDEF(catvect, catap);
+
+
+/*
+ * A catalog being laid out.
+ */
+struct catout
+{
+    fast_buf ents;      // catalog_ent; offsets are into 'data'
+    fast_buf data;      // names and records
+    uint32_t n;
+};
+typedef struct catout catout;
+
+
+/*
+ * An existing catalog, mapped.
+ */
+struct catin
+{
+    const uint8_t     *base;
+    size_t             size;
+    const catalog_hdr *h;
+    const catalog_ent *ent;
+};
+typedef struct catin catin;
+
+
+static int
+catap_cmp(const void *x, const void *y)
+{
+    const catap *a = x;
+    const catap *b = y;
+    int r = strcmp(a->d.apname, b->d.apname);
+
+    if (r == 0) r = a->line < b->line ? -1 : a->line > b->line;
+    return r;
+}
+
+
+static int
+name_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int r = memcmp(a, b, alen < blen ? alen : blen);
+
+    if (r == 0) r = alen < blen ? -1 : alen > blen;
+    return r;
+}
+
+
+/*
+ * Hash of one entry; the catalog hash is the sum of these.
+ */
+static uint64_t
+ent_hash(const char *nm, size_t nlen, const uint8_t *rec, size_t rlen)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < nlen; i++) h = (h ^ (uint8_t)nm[i]) * 0x100000001b3ULL;
+    for (i = 0; i < rlen; i++) h = (h ^ rec[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+
+static size_t
+encode(uint8_t *rec, const apdata *d)
+{
+    ssize_t m = apdata_encode(rec, APDATA_ENC_MAX, d);
+
+    if (m < 0) error(1, -m, "can't encode %s", d->apname);
+    return m;
+}
+
+
+static void
+catout_init(catout *o)
+{
+    fast_buf_init(&o->ents, 4096);
+    fast_buf_init(&o->data, 4096);
+    o->n = 0;
+}
+
+
+static void
+catout_fini(catout *o)
+{
+    fast_buf_fini(&o->ents);
+    fast_buf_fini(&o->data);
+}
+
+
+static void
+catout_add(catout *o, const char *nm, size_t nlen, const uint8_t *rec, size_t rlen)
+{
+    catalog_ent e;
+
+    e.name    = fast_buf_size(&o->data);
+    e.namelen = nlen;
+    e.rec     = e.name + nlen;
+    e.reclen  = rlen;
+
+    fast_buf_push(&o->ents, &e, sizeof e);
+    fast_buf_push(&o->data, nm, nlen);
+    fast_buf_push(&o->data, rec, rlen);
+    o->n++;
+}
+
+
+/*
+ * Lay out the catalog in 'b': header, entries (with their offsets
+ * made absolute) and data.
+ */
+static void
+catout_finish(catout *o, fast_buf *b, uint32_t gen, uint64_t hash)
+{
+    catalog_hdr h;
+    uint32_t    off = sizeof h + fast_buf_size(&o->ents);
+    catalog_ent *e  = (catalog_ent *)fast_buf_ptr(&o->ents);
+    uint32_t    i;
+
+    for (i = 0; i < o->n; i++, e++) {
+        e->name += off;
+        e->rec  += off;
+    }
+
+    memset(&h, 0, sizeof h);
+    h.magic   = CATALOG_MAGIC;
+    h.version = CATALOG_VERSION;
+    h.n       = o->n;
+    h.size    = off + fast_buf_size(&o->data);
+    h.gen     = gen;
+    h.hash    = hash;
+
+    fast_buf_reset(b);
+    fast_buf_push(b, &h, sizeof h);
+    fast_buf_push(b, fast_buf_ptr(&o->ents), fast_buf_size(&o->ents));
+    fast_buf_push(b, fast_buf_ptr(&o->data), fast_buf_size(&o->data));
+}
+
+
+/*
+ * Map the catalog open on 'fd' and check its header.
+ */
+static void
+catin_open(catin *ci, int fd, const char *fn)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) error(1, errno, "can't stat %s", fn);
+    if ((size_t)st.st_size < sizeof(catalog_hdr)) error(1, 0, "%s: not a catalog", fn);
+
+    void *p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) error(1, errno, "can't map %s", fn);
+
+    ci->base = p;
+    ci->size = st.st_size;
+    ci->h    = p;
+    ci->ent  = (const catalog_ent *)(ci->h + 1);
+
+    if (ci->h->magic != CATALOG_MAGIC || ci->h->version != CATALOG_VERSION ||
+        ci->h->size != ci->size ||
+        ci->h->n > (ci->size - sizeof *ci->h) / sizeof(catalog_ent))
+        error(1, 0, "%s: not a valid catalog (or an old one; recompile it)", fn);
+}
+
+
+static void
+catin_close(catin *ci)
+{
+    munmap((void *)ci->base, ci->size);
+}
+
+
+/*
+ * Fetch the name and record of entry 'i'.
+ */
+static void
+catin_ent(const catin *ci, size_t i, const char **nm, size_t *nlen,
+          const uint8_t **rec, size_t *rlen, const char *fn)
+{
+    const catalog_ent *e = &ci->ent[i];
+
+    if (e->name > ci->size || e->namelen > (ci->size - e->name) ||
+        e->rec  > ci->size || e->reclen  > (ci->size - e->rec))
+        error(1, 0, "%s: entry %zu is damaged", fn, i);
+
+    *nm   = (const char *)ci->base + e->name;
+    *nlen = e->namelen;
+    *rec  = ci->base + e->rec;
+    *rlen = e->reclen;
+}
+
+
+/*
+ * Open and lock catalog 'fn'. The lock is on the file we opened;
+ * if a writer renamed a new catalog into place while we waited for
+ * it, start over with the new one.
+ *
+ * Return the fd, or -1 if the catalog doesn't exist.
+ */
+static int
+lock_catalog(const char *fn)
+{
+    struct stat a, b;
+    int fd;
+
+    while (1) {
+        if ((fd = open(fn, O_RDONLY)) < 0) {
+            if (errno == ENOENT) return -1;
+            error(1, errno, "can't open %s", fn);
+        }
+
+        if (flock(fd, LOCK_EX) < 0) error(1, errno, "can't lock %s", fn);
+
+        if (fstat(fd, &a) < 0) error(1, errno, "can't stat %s", fn);
+        if (stat(fn, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino) return fd;
+
+        close(fd);
+    }
+}
+
+
+/*
+ * Write 'b' to 'out' by way of a temporary file in the same
+ * directory.
+ */
+static void
+install(fast_buf *b, const char *out)
+{
+    char tmp[PATH_MAX];
+    int  fd;
+
+    if ((size_t)snprintf(tmp, sizeof tmp, "%s.XXXXXXXXXX", out) >= sizeof tmp)
+        error(1, 0, "%s: name too long", out);
+
+    if ((fd = mkstemp(tmp)) < 0) error(1, errno, "can't create %s", tmp);
+
+    const uint8_t *p = fast_buf_ptr(b);
+    size_t n = fast_buf_size(b);
+
+    while (n > 0) {
+        ssize_t m = write(fd, p, n);
+
+        if (m < 0) {
+            if (errno == EINTR) continue;
+            goto fail;
+        }
+        p += m;
+        n -= m;
+    }
+
+    if (fchmod(fd, 0644) < 0 || fsync(fd) < 0) goto fail;
+    if (close(fd) < 0) {
+        fd = -1;
+        goto fail;
+    }
+
+    if (rename(tmp, out) < 0) error(1, errno, "can't rename %s to %s", tmp, out);
+    return;
+
+fail:
+    {
+        int err = errno;
+
+        if (fd >= 0) close(fd);
+        unlink(tmp);
+        error(1, err, "can't write %s", tmp);
+    }
+}
+
+
+/*
+ * Parse the lines in 'fp' into 'cv'. A delta ('base' is non-null)
+ * has a base line and add/mod/del lines; otherwise only 'add'
+ * lines are allowed.
+ *
+ * Return the # of bad lines.
+ */
+static int
+parse_defs(catvect *cv, FILE *fp, const char *name, uint64_t *base)
+{
+    char     buf[4096];
+    unsigned lineno = 0;
+    int      nerr = 0;
+    int      nbase = 0;
+
+    while (fgets(buf, sizeof buf, fp)) {
+        char  err[256];
+        char *argv[128];
+        char *line;
+        catap a;
+        int n;
+
+        lineno++;
+        line = strtrim(buf);
+        if (*line == 0 || *line == '#') continue;
+
+        n = strsplitargs(argv, ARRAY_SIZE(argv), line);
+        if (n < 0) {
+            fprintf(stderr, "%s:%u: parse error\n", name, lineno);
+            nerr++;
+            continue;
+        }
+
+        memset(&a, 0, sizeof a);
+        a.line = lineno;
+
+        if (base && 0 == strcmp(argv[0], "base")) {
+            char *end;
+
+            errno = 0;
+            if (n == 2) *base = strtoull(argv[1], &end, 16);
+            if (n != 2 || errno || *end || end == argv[1] || nbase++ > 0) {
+                fprintf(stderr, "%s:%u: expected one 'base HASH'\n", name, lineno);
+                nerr++;
+            }
+            continue;
+        }
+
+        if (base && 0 == strcmp(argv[0], "del")) {
+            if (n != 2 || strlen(argv[1]) >= sizeof a.d.apname) {
+                fprintf(stderr, "%s:%u: usage: del AP\n", name, lineno);
+                nerr++;
+                continue;
+            }
+
+            a.op = DELTA_DEL;
+            strlcpy(a.d.apname, argv[1], sizeof a.d.apname);
+            VECT_PUSH_BACK(cv, a);
+            continue;
+        }
+
+        if (0 == strcmp(argv[0], "add"))              a.op = DELTA_ADD;
+        else if (base && 0 == strcmp(argv[0], "mod")) a.op = DELTA_MOD;
+        else {
+            fprintf(stderr, "%s:%u: expected %s, saw '%s'\n", name, lineno,
+                    base ? "'add', 'mod' or 'del'" : "'add'", argv[0]);
+            nerr++;
+            continue;
+        }
+
+        if (apdata_parse(&a.d, &argv[1], n-1, err, sizeof err) < 0) {
+            fprintf(stderr, "%s:%u: %s\n", name, lineno, err);
+            nerr++;
+            continue;
+        }
+
+        // The catalog is looked up by exact name only.
+        if (a.d.flags & AP_PATTERN) {
+            fprintf(stderr, "%s:%u: patterns can't be in the catalog\n", name, lineno);
+            nerr++;
+            continue;
+        }
+
+        VECT_PUSH_BACK(cv, a);
+    }
+
+    if (ferror(fp)) error(1, errno, "can't read %s", name);
+
+    if (base && nbase == 0) {
+        fprintf(stderr, "%s: no 'base' line\n", name);
+        nerr++;
+    }
+    return nerr;
+}
+
+
+static FILE *
+open_input(const char *in)
+{
+    FILE *fp = 0 == strcmp(in, "-") ? stdin : fopen(in, "r");
+
+    if (!fp) error(1, errno, "can't open %s", in);
+    return fp;
+}
+
+
+/*
+ * Compile the AP definitions in 'in' ('-' for stdin) into the
+ * catalog 'out'.
+ *
+ * Return 0 on success, 1 if the input had errors.
+ */
+int
+compile_catalog(const char *in, const char *out)
+{
+    FILE    *fp = open_input(in);
+    catvect  cv;
+    catout   o;
+    fast_buf b;
+    uint8_t  rec[APDATA_ENC_MAX];
+    uint64_t hash = 0;
+    size_t   i, n;
+    int      nerr, fd;
+
+    VECT_INIT(&cv, 64);
+    nerr = parse_defs(&cv, fp, in, 0);
+    if (fp != stdin) fclose(fp);
+
+    if (nerr > 0) {
+        fprintf(stderr, "%s: %d errors; %s was not changed\n", in, nerr, out);
+        VECT_FINI(&cv);
+        return 1;
+    }
+
+    // Sort by name; of several definitions, keep the last.
+    n = VECT_SIZE(&cv);
+    VECT_SORT(&cv, catap_cmp);
+
+    catout_init(&o);
+    for (i = 0; i < n; i++) {
+        const apdata *d = &VECT_ELEM(&cv, i).d;
+
+        if (i+1 < n && 0 == strcmp(d->apname, VECT_ELEM(&cv, i+1).d.apname)) continue;
+
+        size_t nlen = strlen(d->apname);
+        size_t m    = encode(rec, d);
+
+        catout_add(&o, d->apname, nlen, rec, m);
+        hash += ent_hash(d->apname, nlen, rec, m);
+    }
+
+    fast_buf_init(&b, 4096);
+    catout_finish(&o, &b, 1, hash);
+
+    fd = lock_catalog(out);
+    install(&b, out);
+    if (fd >= 0) close(fd);
+
+    printf("%s: %u access points (%zu duplicates), %zu bytes, version %016llx\n",
+           out, o.n, n - o.n, fast_buf_size(&b), (unsigned long long)hash);
+
+    fast_buf_fini(&b);
+    catout_fini(&o);
+    VECT_FINI(&cv);
+    return 0;
+}
+
+
+/*
+ * Apply the delta in 'in' ('-' for stdin) to the catalog 'out'.
+ *
+ * Return 0 on success, 1 if the delta had errors or doesn't apply.
+ */
+int
+apply_delta(const char *in, const char *out)
+{
+    FILE    *fp = open_input(in);
+    catvect  dv;
+    catin    ci;
+    catout   o;
+    fast_buf b;
+    uint8_t  rec[APDATA_ENC_MAX];
+    uint64_t base = 0;
+    int      nerr, fd;
+    size_t   i, j, n, m;
+    unsigned nadd = 0, nmod = 0, ndel = 0;
+
+    VECT_INIT(&dv, 16);
+    nerr = parse_defs(&dv, fp, in, &base);
+    if (fp != stdin) fclose(fp);
+
+    // Each AP may change only once.
+    m = VECT_SIZE(&dv);
+    VECT_SORT(&dv, catap_cmp);
+    for (j = 1; j < m; j++) {
+        const catap *a = &VECT_ELEM(&dv, j);
+
+        if (0 == strcmp(a->d.apname, VECT_ELEM(&dv, j-1).d.apname)) {
+            fprintf(stderr, "%s:%u: %s was already changed on line %u\n", in,
+                    a->line, a->d.apname, VECT_ELEM(&dv, j-1).line);
+            nerr++;
+        }
+    }
+
+    if (nerr > 0) goto fail;
+
+    if ((fd = lock_catalog(out)) < 0) error(1, ENOENT, "can't open %s", out);
+
+    catin_open(&ci, fd, out);
+    if (ci.h->hash != base) {
+        fprintf(stderr, "%s: delta is for version %016llx; %s is version %016llx\n",
+                in, (unsigned long long)base, out, (unsigned long long)ci.h->hash);
+        nerr++;
+        goto done;
+    }
+
+    // Merge the catalog and the delta; both are sorted by name.
+    uint64_t hash = ci.h->hash;
+
+    catout_init(&o);
+    n = ci.h->n;
+    for (i = j = 0; i < n || j < m; ) {
+        const catap   *a = j < m ? &VECT_ELEM(&dv, j) : 0;
+        const char    *nm = 0;
+        const uint8_t *cr = 0;
+        size_t nlen = 0, rlen = 0, k;
+        int r;
+
+        if (i < n) catin_ent(&ci, i, &nm, &nlen, &cr, &rlen, out);
+
+        if (!a)          r = -1;
+        else if (i >= n) r = 1;
+        else             r = name_cmp(nm, nlen, a->d.apname, strlen(a->d.apname));
+
+        if (r < 0) {
+            catout_add(&o, nm, nlen, cr, rlen);
+            i++;
+            continue;
+        }
+
+        if (r == 0) {
+            if (a->op == DELTA_ADD) {
+                fprintf(stderr, "%s:%u: %s is already in the catalog; use 'mod'\n",
+                        in, a->line, a->d.apname);
+                nerr++;
+                catout_add(&o, nm, nlen, cr, rlen);
+            } else {
+                hash -= ent_hash(nm, nlen, cr, rlen);
+                if (a->op == DELTA_DEL) ndel++;
+            }
+            i++;
+            if (a->op != DELTA_MOD) {
+                j++;
+                continue;
+            }
+        } else if (a->op != DELTA_ADD) {
+            fprintf(stderr, "%s:%u: %s isn't in the catalog\n", in, a->line, a->d.apname);
+            nerr++;
+            j++;
+            continue;
+        }
+
+        // A new or changed AP.
+        k = encode(rec, &a->d);
+        catout_add(&o, a->d.apname, strlen(a->d.apname), rec, k);
+        hash += ent_hash(a->d.apname, strlen(a->d.apname), rec, k);
+
+        if (a->op == DELTA_ADD) nadd++;
+        else                    nmod++;
+        j++;
+    }
+
+    if (nerr == 0) {
+        fast_buf_init(&b, 4096);
+        catout_finish(&o, &b, ci.h->gen + 1, hash);
+        install(&b, out);
+
+        printf("%s: added %u, changed %u, removed %u; %u access points, gen %u, version %016llx\n",
+               out, nadd, nmod, ndel, o.n, ci.h->gen + 1, (unsigned long long)hash);
+        fast_buf_fini(&b);
+    }
+    catout_fini(&o);
+
+done:
+    catin_close(&ci);
+    close(fd);
+
+fail:
+    if (nerr > 0) fprintf(stderr, "%s: %d errors; %s was not changed\n", in, nerr, out);
+    VECT_FINI(&dv);
+    return nerr > 0 ? 1 : 0;
+}
+
+/* EOF */
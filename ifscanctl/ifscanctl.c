@@ -44,9 +44,12 @@
 #include <sys/un.h>
 #include <sys/ioctl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <signal.h>
 
 #include "utils.h"
 #include "common.h"
+#include "ifscanctl.h"
 
 #ifndef VERSION
 #define VERSION  "unknown-debug"
@@ -56,31 +59,50 @@
  * Global vars
  */
 
-static size_t arg2str(char *buf, size_t bsiz, int argc, char * const *argv);
+static int Timeout = IPC_TIMEOUT;
+static int Textonly = 0;    // set to never use binary requests
+static const char *Batch = 0;   // file of commands to run
+static volatile sig_atomic_t Stop = 0;  // set on SIGINT/SIGTERM
+
+static void arg2str(fast_buf *b, int argc, char * const *argv);
 static int hasws(const char *s);
 static void fullwrite(int fd, void *buf, size_t n);
-static ssize_t fullread(int fd, void *buf, size_t n);
+static int  recv_response(int fd, uint32_t seq, sink_func *fp, void *ctx);
+static void text_sink(void *ctx, const uint8_t *buf, size_t n);
+static int  watch(int fd, uint32_t seq);
+static void append_file(fast_buf *b, const char *fn);
 
 /*
  * Long and short options.
  */
 static const struct option Lopt[] = {
-    {"help",        no_argument, 0, 'h'},
-    {"version",     no_argument, 0, 'v'},
+    {"help",        no_argument,       0, 'h'},
+    {"version",     no_argument,       0, 'v'},
+    {"timeout",     required_argument, 0, 't'},
+    {"text",        no_argument,       0, 'T'},
+    {"batch",       required_argument, 0, 'b'},
     {0, 0, 0, 0}
 };
-static const char Sopt[] = "hvdfN";
+static const char Sopt[] = "hvt:Tb:";
 
 static void
 usage()
 {
     printf("%s - Control the WiFi management daemon ifscand\n"
            "Usage: %s [options] INTERFACE COMMAND [args]\n"
+           "       %s [options] -b FILE INTERFACE\n"
+           "       %s compile-catalog INFILE OUTFILE\n"
+           "       %s apply-delta DELTA CATALOG\n"
            "\n"
            "Options:\n"
+           "  --timeout=N, -t N Wait at most N seconds for a response [%d]\n"
+           "  --text, -T        Send all commands as text requests\n"
+           "  --batch=F, -b F   Run the commands in file F ('-' for stdin),\n"
+           "                    one per line, over a single session\n"
            "  --version, -v     Show program version and quit\n"
            "  --help, -h        Show this help message and quit\n",
-           program_name, program_name);
+           program_name, program_name, program_name, program_name, program_name,
+           IPC_TIMEOUT);
 
     exit(0);
 }
@@ -114,12 +136,45 @@ main(int argc, char * const *argv)
             case 'v':
                 version();
                 break;
+
+            case 't': {
+                const char *err = 0;
+                Timeout = strtonum(optarg, 1, 3600, &err);
+                if (err) error(1, 0, "invalid timeout %s: %s", optarg, err);
+                break;
+            }
+
+            case 'T':
+                Textonly = 1;
+                break;
+
+            case 'b':
+                Batch = optarg;
+                break;
         }
     }
     argc -= optind;
     argv += optind;
 
-    if (argc < 2) error(1, 0, "Insufficient arguments. Try '%s --help'", program_name);
+    // Offline; no daemon involved.
+    if (argc > 0 && 0 == strcmp(argv[0], "compile-catalog")) {
+        if (argc != 3) error(1, 0, "Usage: %s compile-catalog INFILE|- OUTFILE", program_name);
+        return compile_catalog(argv[1], argv[2]);
+    }
+    if (argc > 0 && 0 == strcmp(argv[0], "apply-delta")) {
+        if (argc != 3) error(1, 0, "Usage: %s apply-delta DELTA|- CATALOG", program_name);
+        return apply_delta(argv[1], argv[2]);
+    }
+
+    if (argc < (Batch ? 1 : 2)) error(1, 0, "Insufficient arguments. Try '%s --help'", program_name);
+    if (Batch && argc > 1) error(1, 0, "Commands are read from %s in batch mode", Batch);
+
+    FILE *bfp = 0;
+
+    if (Batch) {
+        bfp = 0 == strcmp(Batch, "-") ? stdin : fopen(Batch, "r");
+        if (!bfp) error(1, errno, "can't open %s", Batch);
+    }
 
     const char* ifname = argv[0];
     char sockfile[PATH_MAX];
@@ -139,30 +194,67 @@ main(int argc, char * const *argv)
     if (bind(fd, (struct sockaddr *)&loc, sizeof loc) < 0)
         error(1, errno, "can't bind to socket %s", loc.sun_path);
 
+    // Best effort; the defaults work, just with more retries.
+    int sz = IPC_SOCKBUF;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof sz);
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sz, sizeof sz);
+
     un.sun_family = AF_UNIX;
     memcpy(un.sun_path, sockfile, n);
 
     if (connect(fd, (struct sockaddr *)&un, sizeof un) < 0) 
         error(1, errno, "can't connect to %s", sockfile);
 
-    char buf[65536];
-    n = arg2str(buf, sizeof buf, argc-1, &argv[1]);
+    if (bfp) {
+        int nfail = batch_run(fd, bfp, Batch, Timeout);
+
+        if (bfp != stdin) fclose(bfp);
+        close(fd);
+        unlink(loc.sun_path);
+        return nfail > 0 ? 1 : 0;
+    }
+
+    fast_buf req;
+    bproto_state bs;
+    int last = '\n';
+    int bin  = 0;
+    uint32_t seq = arc4random();
+
+    fast_buf_init(&req, IPC_DGRAMSZ);
+    if (0 == strcmp(argv[1], "import")) {
+        // import [replace] FILE: the file follows the command line
+        if (argc < 3) error(1, 0, "Usage: %s IFACE import [replace] FILE|-", program_name);
+
+        arg2str(&req, argc-2, &argv[1]);
+        fast_buf_append(&req, '\n');
+        append_file(&req, argv[argc-1]);
+    } else {
+        if (!Textonly) bin = bproto_encode(&bs, &req, argc-1, &argv[1]);
+        if (!bin)      arg2str(&req, argc-1, &argv[1]);
+    }
 
     /*
      * All commands are processed by the daemon.
      * ifscanctl is just a I/O frontend.
      */
-    fullwrite(fd, buf, n);
-    n = fullread(fd, buf, (sizeof buf)-1);
-    if (n > 0) {
-        buf[n] = 0;
-        fputs(buf, stdout);
-        if (buf[n-1] != '\n') fputc('\n', stdout);
+    send_request(fd, seq, &req);
+
+    int r;
+    if (0 == strcmp(argv[1], "watch")) {
+        r = watch(fd, seq);
+    } else if (bin) {
+        r = recv_response(fd, seq, bproto_sink, &bs);
+        bproto_end(&bs);
+    } else {
+        r = recv_response(fd, seq, text_sink, &last);
+        if (r == 0 && last != '\n') fputc('\n', stdout);
     }
+    fast_buf_fini(&req);
 
     close(fd);
     unlink(loc.sun_path);
 
+    if (r < 0) error(1, -r, "can't read response from ifscand on %s", ifname);
     return 0;
 }
 
@@ -181,43 +273,70 @@ hasws(const char *s)
 }
 
 
-static size_t
-arg2str(char *buf, size_t bsiz, int argc, char * const *argv)
+/*
+ * Quote and join the command line arguments into 'b'.
+ */
+static void
+arg2str(fast_buf *b, int argc, char * const *argv)
 {
     int i;
-    char *p  = buf;
-    size_t n = bsiz;
-    ssize_t m;
-    const char *s;
-
-    for (i = 0; i < argc-1; i++) {
-        s = argv[i];
-        snprintf(p, n, hasws(s) ? "\"%s\" " : "%s ", s);
-        m  = strlen(p);
-        p += m;
-        n -= m;
-    }
 
-    s = argv[i];
-    snprintf(p, n, hasws(s) ? "\"%s\"" : "%s", s);
-    m  = strlen(p);
-    p += m;
-    n -= m;
+    for (i = 0; i < argc; i++) {
+        const char *s = argv[i];
+        int q = hasws(s);
 
-    return bsiz - n;
+        if (i > 0) fast_buf_append(b, ' ');
+        if (q)     fast_buf_append(b, '"');
+        fast_buf_push(b, s, strlen(s));
+        if (q)     fast_buf_append(b, '"');
+    }
 }
 
 
 
+/*
+ * Append the contents of file 'fn' ('-' for stdin) to 'b'.
+ */
+static void
+append_file(fast_buf *b, const char *fn)
+{
+    char  buf[8192];
+    FILE *fp = 0 == strcmp(fn, "-") ? stdin : fopen(fn, "r");
+    size_t n;
+
+    if (!fp) error(1, errno, "can't open %s", fn);
+
+    while ((n = fread(buf, 1, sizeof buf, fp)) > 0) {
+        fast_buf_push(b, buf, n);
+        if (fast_buf_size(b) > IPC_MAXREQ) error(1, 0, "%s is too large to import", fn);
+    }
+
+    if (ferror(fp)) error(1, errno, "can't read %s", fn);
+    if (fp != stdin) fclose(fp);
+}
+
+
+/*
+ * Write 'buf' to the daemon. When its socket buffer is full, wait
+ * for it to drain - for up to the request timeout.
+ */
 static void
 fullwrite(int fd, void *buf, size_t n)
 {
     uint8_t *p = buf;
+    int waited = 0;
 
     while (n > 0) {
         ssize_t m = write(fd, p, n);
         if (m == -1) {
-            if (errno == EINTR || errno == EAGAIN) continue;
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == ENOBUFS) {
+                if (Timeout > 0 && waited >= Timeout * 1000) error(1, 0, "timed out sending request");
+
+                poll(0, 0, 10);
+                waited += 10;
+                continue;
+            }
             error(1, errno, "I/O error");
         }
 
@@ -227,18 +346,136 @@ fullwrite(int fd, void *buf, size_t n)
 }
 
 
-static ssize_t
-fullread(int fd, void *buf, size_t n)
+/*
+ * Send request 'req' as a sequence of fragments tagged with 'seq'.
+ */
+void
+send_request(int fd, uint32_t seq, fast_buf *req)
 {
-    struct sockaddr_un un;
-    socklen_t len = sizeof un;
+    uint8_t  pkt[IPC_DGRAMSZ];
+    uint8_t *p = fast_buf_ptr(req);
+    size_t   n = fast_buf_size(req);
+    ipc_hdr  h = { .magic = IPC_MAGIC, .seq = seq };
+
+    do {
+        size_t m = n > IPC_MAXDATA ? IPC_MAXDATA : n;
+
+        h.flags = m == n ? IPC_F_END : 0;
+        memcpy(pkt, &h, sizeof h);
+        memcpy(pkt + sizeof h, p, m);
+        fullwrite(fd, pkt, m + sizeof h);
+
+        h.part++;
+        p += m;
+        n -= m;
+    } while (n > 0);
+}
+
+
+/*
+ * Write a text response to stdout and remember its last byte in
+ * '*ctx'.
+ */
+static void
+text_sink(void *ctx, const uint8_t *buf, size_t n)
+{
+    int *last = ctx;
+
+    if (n == 0) return;
+
+    fwrite(buf, 1, n, stdout);
+    fflush(stdout);
+    *last = buf[n-1];
+}
+
+
+static void
+sigstop(int sig)
+{
+    (void)sig;
+    Stop = 1;
+}
+
+
+/*
+ * Print events from the daemon until it ends the stream or we are
+ * interrupted; then tell the daemon we are done.
+ */
+static int
+watch(int fd, uint32_t seq)
+{
+    struct sigaction sa;
+    fast_buf req;
+    int last = '\n';
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = sigstop;    // no SA_RESTART: interrupt poll(2)
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT,  &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+
+    Timeout = 0;
+    int r = recv_response(fd, seq, text_sink, &last);
+    if (r != -EINTR) return r;
+
+    fast_buf_init(&req, 16);
+    fast_buf_push(&req, "unwatch", 7);
+
+    Timeout = IPC_TIMEOUT;
+    send_request(fd, seq+1, &req);
+    recv_response(fd, seq+1, 0, 0);
+    fast_buf_fini(&req);
+    return 0;
+}
+
+
+/*
+ * Read the fragments of the response to request 'seq' and hand
+ * them to 'fp' (if non-null) as they arrive. Wait at most 'Timeout'
+ * seconds for each fragment; forever if 'Timeout' is 0.
+ *
+ * Return:
+ *    0 on success
+ *    -errno on failure
+ */
+static int
+recv_response(int fd, uint32_t seq, sink_func *fp, void *ctx)
+{
+    uint8_t  pkt[IPC_DGRAMSZ];
+    uint16_t next = 0;
+    ipc_hdr  h;
+
     while (1) {
-        ssize_t m = recvfrom(fd, buf, n, MSG_DONTWAIT, (struct sockaddr*)&un, &len);
-        if (m == -1) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        int r = poll(&pfd, 1, Timeout > 0 ? Timeout * 1000 : -1);
+        if (r == 0) return -ETIMEDOUT;
+        if (r < 0) {
+            if (errno == EINTR) {
+                if (Stop) return -EINTR;
+                continue;
+            }
+            return -errno;
+        }
+
+        ssize_t m = recv(fd, pkt, sizeof pkt, 0);
+        if (m < 0) {
             if (errno == EINTR || errno == EAGAIN) continue;
-            error(1, errno, "I/O error");
+            return -errno;
         }
-        return m;
+
+        if ((size_t)m < sizeof h) continue;
+
+        memcpy(&h, pkt, sizeof h);
+        if (h.magic != IPC_MAGIC || h.seq != seq) continue;
+        if (h.part != next) return -EPROTO;   // lost a fragment
+
+        next++;
+        m -= sizeof h;
+        if (m > 0 && fp) (*fp)(ctx, pkt + sizeof h, m);
+
+        if (h.flags & IPC_F_END) break;
     }
-}
 
+    return 0;
+}
@@ -0,0 +1,140 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * ifscanctl.h - internal interfaces of ifscanctl
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef ___IFSCANCTL_H_2214337_1483419771__
+#define ___IFSCANCTL_H_2214337_1483419771__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdio.h>
+#include <stdint.h>
+#include "fastbuf.h"
+#include "common.h"
+
+/*
+ * Consumer of response bytes as they arrive from the daemon.
+ */
+typedef void sink_func(void *ctx, const uint8_t *buf, size_t n);
+
+
+/*
+ * State for decoding and rendering one binary response.
+ */
+struct bproto_state
+{
+    uint8_t  cmd;       // BCMD_xxx we sent
+    uint16_t getkey;    // T_xxx for 'get'; 0 for all
+    int      text;      // set if the daemon replied in text
+    int      last;      // last byte of a text reply
+    int      err;       // set if the daemon returned an error
+    size_t   nhdr;      // # of header bytes seen
+
+    fast_buf pend;      // undecoded bytes carried across fragments
+    fast_buf aporder;   // rendered ap-order names
+
+    uint32_t randmac,
+             scanint,
+             rssi_scanint,
+             joinhist,
+             nodettl;
+
+    int             hashist;    // set if 'nodehist' is valid
+    bproto_joinhist nodehist;   // T_JOINHIST for the next T_NODE
+};
+typedef struct bproto_state bproto_state;
+
+
+/*
+ * Encode the command in argv[] as a binary request in 'req'.
+ *
+ * Return:
+ *    1 if the request was encoded
+ *    0 if the command must be sent as text
+ *
+ * Errors in the command line are fatal.
+ */
+int bproto_encode(bproto_state *st, fast_buf *req, int argc, char * const *argv);
+
+/*
+ * Decode response bytes and print them; use as a sink_func with
+ * 'ctx' pointing to a bproto_state.
+ */
+void bproto_sink(void *ctx, const uint8_t *buf, size_t n);
+
+/*
+ * Print what remains of the response and release 'st'.
+ */
+void bproto_end(bproto_state *st);
+
+/*
+ * Send request 'req' as a sequence of fragments tagged with 'seq'.
+ */
+void send_request(int fd, uint32_t seq, fast_buf *req);
+
+/*
+ * Run the commands, one per line, in 'fp' (named 'name') over the
+ * connected control socket 'fd'. Wait at most 'timeout' seconds
+ * for each part of a reply. Print a summary to stderr.
+ *
+ * Return the # of commands that failed.
+ */
+int batch_run(int fd, FILE *fp, const char *name, int timeout);
+
+/*
+ * Compile the AP definitions ("add ..." lines) in file 'in' into
+ * the catalog 'out' for ifscand. Bad lines are reported to stderr.
+ *
+ * Return 0 on success, 1 if nothing was written.
+ */
+int compile_catalog(const char *in, const char *out);
+
+/*
+ * Apply the delta in file 'in' to the catalog 'out', if 'out' is
+ * the version the delta names. Errors are reported to stderr.
+ *
+ * Return 0 on success, 1 if nothing was written.
+ */
+int apply_delta(const char *in, const char *out);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___IFSCANCTL_H_2214337_1483419771__ */
+
+/* EOF */
@@ -0,0 +1,299 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * admit.c - per-peer admission control and fair queueing of requests
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * Peers are identified by the path of their socket; that is all
+ *   an AF_UNIX datagram tells us about the sender. ifscanctl binds
+ *   a fresh path on every run, so a peer is one run of ifscanctl
+ *   (e.g. one batch), not one user or script.
+ *
+ * * Complete requests are queued per peer (at most ADM_QLEN) and
+ *   the event loop serves the peers round robin, a bounded number
+ *   of requests per pass. One chatty peer can't delay another
+ *   peer's request or the state machine by more than a pass.
+ *
+ * * Expensive requests (fresh scans, joins) also need a token from
+ *   the peer's bucket: ADM_BURST tokens, refilled at one token per
+ *   ADM_REFILL_MS. Since a script that runs ifscanctl in a loop is
+ *   a new peer every time, they also need a token from a bucket
+ *   shared by all peers: ADM_GBURST tokens, refilled at one token
+ *   per ADM_GREFILL_MS. A request that finds either bucket empty
+ *   or the queue full gets an immediate "busy" error.
+ *
+ * * When the peer table is full, the least recently seen idle peer
+ *   is forgotten.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+#define ADM_MAXPEERS    32
+#define ADM_QLEN        4       // max # of queued requests per peer
+#define ADM_BURST       4       // max # of tokens per peer
+#define ADM_REFILL_MS   2000    // time to earn one token
+#define ADM_GBURST      8       // max # of tokens shared by all peers
+#define ADM_GREFILL_MS  1000    // time to earn one shared token
+
+
+struct admreq
+{
+    int      framed;
+    uint32_t seq;
+    fast_buf in;
+};
+typedef struct admreq admreq;
+
+
+/*
+ * A token bucket; one unit is earned per ms and a token costs
+ * the refill time of the bucket.
+ */
+struct bucket
+{
+    int64_t  last;      // CLOCK_MONOTONIC ms of last refill
+    uint32_t tokens;    // in units of 1/refill-ms tokens
+};
+typedef struct bucket bucket;
+
+
+struct admpeer
+{
+    struct sockaddr_un from;
+
+    bucket   b;
+    int64_t  seen;      // CLOCK_MONOTONIC ms of last request
+
+    uint32_t rd, n;     // queue of requests
+    admreq   q[ADM_QLEN];
+};
+typedef struct admpeer admpeer;
+
+
+static admpeer  Peers[ADM_MAXPEERS];
+static uint32_t Npeers  = 0;
+static uint32_t Rr      = 0;    // next peer to serve
+static uint32_t Queued  = 0;    // # of requests queued across peers
+static uint64_t Busy    = 0;    // # of busy replies
+
+
+#define TOKEN       ((uint32_t)ADM_REFILL_MS)
+#define FULL_BUCKET (ADM_BURST * TOKEN)
+#define GTOKEN      ((uint32_t)ADM_GREFILL_MS)
+#define GFULL       (ADM_GBURST * GTOKEN)
+
+static bucket   Global  = { 0, GFULL };  // shared by all peers
+
+
+int64_t
+mono_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void
+refill(bucket *b, int64_t now, uint32_t full)
+{
+    int64_t add = now - b->last;    // one unit per ms
+
+    b->last = now;
+    if (add <= 0) return;
+
+    b->tokens = (b->tokens + add) > full ? full : b->tokens + add;
+}
+
+
+/*
+ * Find the peer record of 'from'; make one if needed.
+ */
+static admpeer *
+peer_find(const struct sockaddr_un *from, int64_t now)
+{
+    admpeer *p, *idle = 0;
+    uint32_t i;
+
+    for (i = 0; i < Npeers; i++) {
+        p = &Peers[i];
+        if (0 == strcmp(p->from.sun_path, from->sun_path)) return p;
+
+        if (p->n == 0 && (!idle || p->seen < idle->seen)) idle = p;
+    }
+
+    if (Npeers < ADM_MAXPEERS) {
+        p = &Peers[Npeers++];
+        for (i = 0; i < ADM_QLEN; i++) fast_buf_init(&p->q[i].in, IPC_DGRAMSZ);
+    } else if (idle) {
+        p = idle;
+    } else {
+        return 0;
+    }
+
+    p->from     = *from;
+    p->b.last   = now;
+    p->b.tokens = FULL_BUCKET;
+    p->rd     = 0;
+    p->n      = 0;
+    return p;
+}
+
+
+static void
+reply_busy(cmd_state *s)
+{
+    Busy++;
+
+    debuglog("admit: %s is over its budget; request %u is busy",
+            s->from.sun_path, s->seq);
+
+    fast_buf_reset(&s->out);
+    cmd_reply_error(s, "busy; try again later");
+    ipc_flush(s, 1);
+}
+
+
+/*
+ * Queue the request in 's' from its sender; or reply "busy" if
+ * the sender is over its budget.
+ */
+void
+admit_enqueue(cmd_state *s)
+{
+    int64_t  now = mono_ms();
+    admpeer *p   = peer_find(&s->from, now);
+
+    if (!p || p->n == ADM_QLEN) {
+        reply_busy(s);
+        return;
+    }
+
+    refill(&p->b, now, FULL_BUCKET);
+    refill(&Global, now, GFULL);
+    p->seen = now;
+
+    if (cmd_expensive_p(s)) {
+        if (p->b.tokens < TOKEN || Global.tokens < GTOKEN) {
+            reply_busy(s);
+            return;
+        }
+        p->b.tokens   -= TOKEN;
+        Global.tokens -= GTOKEN;
+    }
+
+    admreq *r = &p->q[(p->rd + p->n) % ADM_QLEN];
+
+    r->framed = s->framed;
+    r->seq    = s->seq;
+
+    fast_buf_reset(&r->in);
+    fast_buf_push(&r->in, fast_buf_ptr(&s->in), fast_buf_size(&s->in));
+
+    p->n++;
+    Queued++;
+}
+
+
+/*
+ * Load the next request into 's', serving peers round robin.
+ *
+ * Return 1 if a request was loaded, 0 if none are queued.
+ */
+int
+admit_next(cmd_state *s)
+{
+    uint32_t i;
+
+    if (Queued == 0) return 0;
+
+    for (i = 0; i < Npeers; i++) {
+        admpeer *p = &Peers[(Rr + i) % Npeers];
+
+        if (p->n == 0) continue;
+
+        admreq *r = &p->q[p->rd];
+
+        s->from    = p->from;
+        s->framed  = r->framed;
+        s->seq     = r->seq;
+        s->part    = 0;
+        s->dropped = 0;
+
+        fast_buf_reset(&s->in);
+        fast_buf_reset(&s->out);
+        fast_buf_push(&s->in, fast_buf_ptr(&r->in), fast_buf_size(&r->in));
+
+        // Commands are parsed as C strings
+        fast_buf_append(&s->in, 0);
+        s->in.size--;
+
+        p->rd = (p->rd + 1) % ADM_QLEN;
+        p->n--;
+        Queued--;
+
+        Rr = (Rr + i + 1) % Npeers;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Return true if requests are waiting to be served.
+ */
+int
+admit_pending(void)
+{
+    return Queued > 0;
+}
+
+
+void
+admit_stats(uint32_t *npeers, uint64_t *busy)
+{
+    *npeers = Npeers;
+    *busy   = Busy;
+}
+
+/* EOF */
@@ -0,0 +1,282 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * ascan.c - active scans in the background
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * ifstate_scan() only reads the driver's node cache, which can be
+ *   minutes old. An active scan (SIOCS80211SCAN) refreshes it, but
+ *   the ioctl sleeps until the scan is done. So, like the log
+ *   compactor in db_log.c, it runs in a child; the event loop polls
+ *   the read end of a pipe whose write end only the child holds -
+ *   it becomes readable when the child exits. The exit status is
+ *   the errno of the ioctl.
+ *
+ * * When the child is done, the node cache is read into a snapshot;
+ *   snapshots read within IFSCAND_FRESH_MS of a completed active
+ *   scan are marked fresh.
+ *
+ * * A scan that takes longer than IFSCAND_ASCAN_MS is abandoned;
+ *   the node cache is used as is.
+ *
+ * * Suspend and resume are noticed by comparing CLOCK_MONOTONIC,
+ *   which counts time spent suspended, with CLOCK_UPTIME, which
+ *   doesn't.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+#define RESUME_GAP_MS   5000    // min time suspended to count as a resume
+
+
+static pid_t    Pid   = 0;      // child doing the scan; 0 if none
+static int      Fd    = -1;     // read end of its pipe
+static int64_t  Start = 0;      // mono_ms the scan started
+static int64_t  Done  = 0;      // mono_ms the last scan completed
+static char     Why[32];
+
+
+/*
+ * Start an active scan unless one is running.
+ *
+ * Return 1 if a scan is running, -errno on failure.
+ */
+int
+ascan_start(ifstate *ifs, const char *why)
+{
+    int p[2];
+
+    if (Pid > 0) return 1;
+
+    if (pipe(p) < 0) return -errno;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        int r = -errno;
+
+        printlog(LOG_ERR, "%s: can't fork for active scan: %s", ifs->ifname, strerror(errno));
+        close(p[0]);
+        close(p[1]);
+        return r;
+    }
+
+    if (pid == 0) {
+        int r = 0;
+
+        close(p[0]);
+        if (ioctl(ifs->scanfd, SIOCS80211SCAN, (caddr_t)&ifs->ifr) != 0) r = errno;
+        _exit(r & 0xff);
+    }
+
+    close(p[1]);
+    fd_set_cloexec(p[0]);
+
+    Pid   = pid;
+    Fd    = p[0];
+    Start = mono_ms();
+    strlcpy(Why, why, sizeof Why);
+
+    debuglog("%s: active scan started (%s, pid %d)", ifs->ifname, why, pid);
+    event_post("scan-start", "reason=%s", why);
+    return 1;
+}
+
+
+/*
+ * Return the fd to poll for the end of the active scan; -1 if
+ * none is running.
+ */
+int
+ascan_fd(void)
+{
+    return Fd;
+}
+
+
+/*
+ * Return the # of ms before the active scan is abandoned; -1 if
+ * none is running.
+ */
+int64_t
+ascan_due(void)
+{
+    if (Pid == 0) return -1;
+
+    int64_t ms = Start + IFSCAND_ASCAN_MS - mono_ms();
+    return ms > 0 ? ms : 0;
+}
+
+
+/*
+ * Return true if the child closed its end of the pipe - i.e., it
+ * is exiting.
+ */
+static int
+exiting(void)
+{
+    struct pollfd f = { .fd = Fd, .events = POLLIN };
+
+    return poll(&f, 1, 0) > 0;
+}
+
+
+static int
+reap(int wait)
+{
+    int st = 0;
+
+    if (waitpid(Pid, &st, wait ? 0 : WNOHANG) <= 0 && !wait) return -EAGAIN;
+
+    close(Fd);
+    Pid = 0;
+    Fd  = -1;
+
+    if (WIFEXITED(st)) return -WEXITSTATUS(st);
+    return -EINTR;
+}
+
+
+/*
+ * Finish the active scan if it is done or overdue: read the node
+ * cache and complete "scan fresh" requests.
+ *
+ * Return 1 if a scan ended, 0 otherwise.
+ */
+int
+ascan_finish(ifstate *ifs)
+{
+    int64_t now = mono_ms();
+    int r;
+
+    if (Pid == 0) return 0;
+
+    // The pipe closes a little before the child can be reaped.
+    if ((r = reap(exiting())) == -EAGAIN) {
+        if (now < Start + IFSCAND_ASCAN_MS) return 0;
+
+        kill(Pid, SIGKILL);
+        reap(1);
+        r = -ETIMEDOUT;
+    }
+
+    if (r == 0) {
+        Done = now;
+        r    = ifstate_scan(ifs);
+    }
+
+    if (r < 0) {
+        printlog(LOG_WARNING, "%s: active scan (%s) failed: %s; using cached nodes",
+                 ifs->ifname, Why, strerror(-r));
+    } else {
+        debuglog("%s: active scan (%s) done in %lld ms; %d nodes", ifs->ifname, Why,
+                 (long long)(now - Start), r);
+    }
+
+    event_post("scan-done", "reason=%s ms=%lld%s", Why, (long long)(now - Start),
+               r < 0 ? " error" : "");
+    defer_complete(ifs, DEFER_FRESH, 0, r < 0 ? r : 0);
+    return 1;
+}
+
+
+/*
+ * Return true if an active scan is running.
+ */
+int
+ascan_running(void)
+{
+    return Pid > 0;
+}
+
+
+/*
+ * Return true if the node cache was refreshed by an active scan
+ * just now.
+ */
+int
+ascan_fresh(void)
+{
+    return Done > 0 && (mono_ms() - Done) <= IFSCAND_FRESH_MS;
+}
+
+
+/*
+ * Return true if the system was suspended since the last call.
+ */
+int
+ascan_resumed(void)
+{
+    static int64_t lastmono = 0,
+                   lastup   = 0;
+    struct timespec ts;
+    int64_t mono, up;
+    int r;
+
+    clock_gettime(CLOCK_UPTIME, &ts);
+    up   = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    mono = mono_ms();
+
+    r = lastmono > 0 && ((mono - lastmono) - (up - lastup)) >= RESUME_GAP_MS;
+
+    lastmono = mono;
+    lastup   = up;
+    return r;
+}
+
+
+/*
+ * Abandon a running scan (at exit).
+ */
+void
+ascan_stop(void)
+{
+    if (Pid == 0) return;
+
+    kill(Pid, SIGKILL);
+    reap(1);
+}
+
+/* EOF */
@@ -0,0 +1,461 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * bcmds.c - handle binary (TLV) commands from ifscanctl
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * See common.h for the message layout and tlv.h for the codec.
+ *
+ * * These handlers share the DB and scan code with the text
+ *   commands in cmds.c; only the parsing and the output encoding
+ *   differ. The client renders the output.
+ *
+ * * Requests come from other processes and are validated just
+ *   like text requests are.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "tlv.h"
+#include "ifscand.h"
+
+typedef int bcmd_handler_func(cmd_state *s, const uint8_t *p, size_t n);
+
+struct bcmdpair
+{
+    uint8_t cmd;
+    bcmd_handler_func *fp;
+};
+typedef struct bcmdpair bcmdpair;
+
+static int bcmd_add(cmd_state *s,  const uint8_t *p, size_t n);
+static int bcmd_del(cmd_state *s,  const uint8_t *p, size_t n);
+static int bcmd_list(cmd_state *s, const uint8_t *p, size_t n);
+static int bcmd_scan(cmd_state *s, const uint8_t *p, size_t n);
+static int bcmd_get(cmd_state *s,  const uint8_t *p, size_t n);
+static int bcmd_set(cmd_state *s,  const uint8_t *p, size_t n);
+static int bcmd_down(cmd_state *s, const uint8_t *p, size_t n);
+
+static const bcmdpair BCommands[] = {
+      {BCMD_ADD,  bcmd_add}
+    , {BCMD_DEL,  bcmd_del}
+    , {BCMD_LIST, bcmd_list}
+    , {BCMD_SCAN, bcmd_scan}
+    , {BCMD_GET,  bcmd_get}
+    , {BCMD_SET,  bcmd_set}
+    , {BCMD_DOWN, bcmd_down}
+    , {0, 0}
+};
+
+
+static int
+bcmd_error(cmd_state *s, const char *fmt, ...)
+{
+    char out[1024];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(out, sizeof out, fmt, ap);
+    va_end(ap);
+
+    tlv_put_str(&s->out, T_ERROR, out);
+    return -EINVAL;
+}
+
+
+/*
+ * Append a record; stream out every full fragment so that large
+ * replies don't accumulate in s->out.
+ */
+static void
+bcmd_push(cmd_state *s, uint16_t ty, const void *v, size_t n)
+{
+    tlv_put(&s->out, ty, v, n);
+    if (fast_buf_size(&s->out) >= IPC_MAXDATA) ipc_flush(s, 0);
+}
+
+
+static void
+bcmd_response_ok(cmd_state *s)
+{
+    tlv_put(&s->out, T_OK, 0, 0);
+}
+
+
+// T_APDATA
+static int
+bcmd_add(cmd_state *s, const uint8_t *p, size_t n)
+{
+    char err[256];
+    apdata d;
+    tlv t;
+
+    while (tlv_get(&p, &n, &t)) {
+        if (t.type != T_APDATA) continue;
+        if (t.len != sizeof d)  return bcmd_error(s, "malformed access point record");
+
+        memcpy(&d, t.val, sizeof d);
+
+        // Don't trust the peer to NUL terminate strings
+        d.apname[sizeof d.apname - 1] = 0;
+        d.key[sizeof d.key - 1]       = 0;
+
+        if (apdata_validate(&d, err, sizeof err) < 0) return bcmd_error(s, "%s", err);
+
+        db_set_apdata(s->db, &d);
+        bcmd_response_ok(s);
+        s->kick = 1;
+        return 1;
+    }
+
+    return bcmd_error(s, "insufficient arguments to 'add'");
+}
+
+
+// T_NAME
+static int
+bcmd_del(cmd_state *s, const uint8_t *p, size_t n)
+{
+    char ap[AP_NAMELEN];
+    tlv t;
+
+    while (tlv_get(&p, &n, &t)) {
+        if (t.type != T_NAME) continue;
+
+        db_del_ap(s->db, tlv_str(&t, ap, sizeof ap));
+        bcmd_response_ok(s);
+        s->kick = 1;
+        return 1;
+    }
+
+    return bcmd_error(s, "insufficient arguments to 'del'");
+}
+
+
+static int
+list_one(void *ctx, const apdata *a)
+{
+    bcmd_push(ctx, T_APDATA, a, sizeof *a);
+    return 1;
+}
+
+
+static int
+bcmd_list(cmd_state *s, const uint8_t *p, size_t n)
+{
+    int nap = db_walk_ap(s->db, 0, 0, list_one, s);
+
+    nap += db_walk_pat(s->db, 0, 0, list_one, s);
+    if (nap == 0) bcmd_error(s, "No remembered access points");
+
+    return 1;
+}
+
+
+// [T_CACHED]
+static int
+bcmd_scan(cmd_state *s, const uint8_t *p, size_t n)
+{
+    assert(s->ifs);
+
+    int cached = 0;
+    tlv t;
+
+    while (tlv_get(&p, &n, &t)) {
+        if (t.type == T_CACHED) cached = 1;
+    }
+
+    if (!cached || !s->ifs->snap) {
+        int r = ifstate_scan(s->ifs);
+        if (r < 0) return bcmd_error(s, "can't scan: %s", strerror(-r));
+    }
+
+    scansnap *snap = ifstate_snap(s->ifs);
+    struct ieee80211_nodereq *nr;
+
+    if (VECT_SIZE(&snap->nv) == 0) {
+        snap_put(snap);
+        return bcmd_error(s, "no access points visible");
+    }
+
+    VECT_FOR_EACH(&snap->nv, nr) {
+        bproto_joinhist jh;
+
+        if (joinhist_get(nr->nr_bssid, &jh)) bcmd_push(s, T_JOINHIST, &jh, sizeof jh);
+        bcmd_push(s, T_NODE, nr, sizeof *nr);
+    }
+
+    snap_put(snap);
+    return 1;
+}
+
+
+/*
+ * Return all settings; the client picks the one it wants.
+ */
+static int
+bcmd_get(cmd_state *s, const uint8_t *p, size_t n)
+{
+    unsigned int v;
+    size_t i;
+
+    tlv_put_u32(&s->out, T_RANDMAC, db_get_randmac(s->db));
+
+    v = 0;
+    db_get_uint(s->db, "scan-int", &v);
+    tlv_put_u32(&s->out, T_SCANINT, v);
+
+    v = 0;
+    db_get_uint(s->db, "rssi-scan-int", &v);
+    tlv_put_u32(&s->out, T_RSSI_SCANINT, v);
+
+    strvect sv = db_get_ap_order(s->db);
+    for (i = 0; i < VECT_SIZE(&sv); i++) {
+        bcmd_push(s, T_APORDER, VECT_ELEM(&sv, i), strlen(VECT_ELEM(&sv, i)));
+    }
+    VECT_FINI(&sv);
+
+    v = 0;
+    db_get_uint(s->db, "join-history", &v);
+    tlv_put_u32(&s->out, T_JOINHIST_MODE, v);
+
+    v = 0;
+    db_get_uint(s->db, "node-ttl", &v);
+    tlv_put_u32(&s->out, T_NODE_TTL, v);
+    return 1;
+}
+
+
+/*
+ * Any of: T_RANDMAC, T_SCANINT, T_RSSI_SCANINT, T_NODE_TTL, T_APORDER*
+ *
+ * Everything is validated before anything is written.
+ */
+static int
+bcmd_set(cmd_state *s, const uint8_t *p, size_t n)
+{
+    char  names[128][AP_NAMELEN];
+    char *order[128];
+    int   norder   = 0;
+    int   randmac  = -1;
+    int   r        = -EINVAL;
+    unsigned int scanint  = 0,
+                 rssiint  = 0,
+                 nodettl  = 0;
+    tlv t;
+
+    while (tlv_get(&p, &n, &t)) {
+        switch (t.type) {
+            case T_RANDMAC:
+                randmac = !!tlv_u32(&t);
+                break;
+
+            case T_SCANINT:
+                scanint = tlv_u32(&t);
+                if (scanint < 1 || scanint > IFSCAND_INT_MAX)
+                    return bcmd_error(s, "invalid value %u for scan-int", scanint);
+                break;
+
+            case T_RSSI_SCANINT:
+                rssiint = tlv_u32(&t);
+                if (rssiint < 1 || rssiint > IFSCAND_INT_MAX)
+                    return bcmd_error(s, "invalid value %u for rssi-scan-int", rssiint);
+                break;
+
+            case T_NODE_TTL:
+                nodettl = tlv_u32(&t);
+                if (nodettl < 1 || nodettl > IFSCAND_INT_MAX)
+                    return bcmd_error(s, "invalid value %u for node-ttl", nodettl);
+                break;
+
+            case T_APORDER:
+                if (norder >= (int)ARRAY_SIZE(order))
+                    return bcmd_error(s, "too many arguments (max 128)");
+
+                order[norder] = tlv_str(&t, names[norder], AP_NAMELEN);
+                norder++;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if (randmac >= 0) {
+        db_set_randmac(s->db, randmac);
+        r = 1;
+    }
+    if (scanint > 0) {
+        db_set_uint(s->db, "scan-int", scanint);
+        r = 1;
+    }
+    if (rssiint > 0) {
+        db_set_uint(s->db, "rssi-scan-int", rssiint);
+        r = 1;
+    }
+    if (nodettl > 0) {
+        db_set_uint(s->db, "node-ttl", nodettl);
+        r = 1;
+    }
+    if (norder > 0) {
+        db_set_ap_order(s->db, order, norder);
+        r = 1;
+    }
+
+    if (r < 0) return bcmd_error(s, "insufficient arguments to 'set'");
+
+    bcmd_response_ok(s);
+    s->kick = 1;
+    return r;
+}
+
+
+/*
+ * Quit the event loop and end the daemon. The event loop checks
+ * for Quit after every command; there is no need to wake it up.
+ */
+static int
+bcmd_down(cmd_state *s, const uint8_t *p, size_t n)
+{
+    extern volatile uint32_t Quit;
+
+    Quit = 1;
+    bcmd_response_ok(s);
+    return 1;
+}
+
+
+/*
+ * Return true if the request in 's->in' is a binary request.
+ */
+int
+bcmd_request_p(cmd_state *s)
+{
+    bproto_hdr h;
+
+    if (fast_buf_size(&s->in) < sizeof h) return 0;
+
+    memcpy(&h, fast_buf_ptr(&s->in), sizeof h);
+    return h.magic == BPROTO_MAGIC;
+}
+
+
+/*
+ * Return true if the binary request in 's->in' needs a fresh scan.
+ */
+int
+bcmd_expensive_p(cmd_state *s)
+{
+    const uint8_t *p = fast_buf_ptr(&s->in);
+    size_t         n = fast_buf_size(&s->in);
+    bproto_hdr h;
+    tlv t;
+
+    memcpy(&h, p, sizeof h);
+    if (h.cmd != BCMD_SCAN) return 0;
+
+    p += sizeof h;
+    n -= sizeof h;
+    while (tlv_get(&p, &n, &t)) {
+        if (t.type == T_CACHED) return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * Write a binary error response to the binary request in 's->in'.
+ */
+void
+bcmd_reply_error(cmd_state *s, const char *msg)
+{
+    bproto_hdr h;
+
+    memcpy(&h, fast_buf_ptr(&s->in), sizeof h);
+    h.version = BPROTO_VERSION;
+    h.resv    = 0;
+
+    fast_buf_push(&s->out, &h, sizeof h);
+    tlv_put_str(&s->out, T_ERROR, msg);
+}
+
+
+/*
+ * Process a binary request in 's->in' and push the binary response
+ * to 's->out'.
+ *
+ * Returns:
+ *    > 0 on success
+ *    -errno on failure
+ */
+int
+bcmd_process(cmd_state *s)
+{
+    const uint8_t *p = fast_buf_ptr(&s->in);
+    size_t         n = fast_buf_size(&s->in);
+    const bcmdpair *c;
+    bproto_hdr h;
+
+    assert(n >= sizeof h);
+
+    memcpy(&h, p, sizeof h);
+    p += sizeof h;
+    n -= sizeof h;
+
+    fast_buf_reset(&s->out);
+
+    // The reply header echoes the command.
+    h.resv = 0;
+    if (h.version != BPROTO_VERSION) {
+        h.version = BPROTO_VERSION;
+        fast_buf_push(&s->out, &h, sizeof h);
+        return bcmd_error(s, "unsupported protocol version");
+    }
+
+    fast_buf_push(&s->out, &h, sizeof h);
+
+    for (c = BCommands; c->fp; c++) {
+        if (c->cmd == h.cmd) return (*c->fp)(s, p, n);
+    }
+
+    return bcmd_error(s, "unknown command %u", h.cmd);
+}
+
+/* EOF */
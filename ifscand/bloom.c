@@ -0,0 +1,123 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * bloom.c - Bloom filter of byte strings
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * About 10 bits per key and 4 probes: ~1% false positives.
+ *
+ * * The probes are derived from one 64-bit FNV-1a hash of the key
+ *   (double hashing); the table size is a power of two so a probe
+ *   is a mask, not a division.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+#define BLOOM_BITS_PER_KEY  10
+#define BLOOM_PROBES        4
+#define BLOOM_MINBITS       512
+
+
+/*
+ * Make 'b' an empty filter sized for 'nkeys' keys.
+ */
+void
+bloom_init(bloom *b, size_t nkeys)
+{
+    size_t want  = nkeys * BLOOM_BITS_PER_KEY;
+    size_t nbits = BLOOM_MINBITS;
+
+    while (nbits < want) nbits <<= 1;
+
+    b->bits  = calloc(nbits / 64, sizeof(uint64_t));
+    if (!b->bits) error(1, ENOMEM, "can't allocate %zu bit filter", nbits);
+
+    b->mask  = nbits - 1;
+    b->nkeys = 0;
+}
+
+
+void
+bloom_fini(bloom *b)
+{
+    free(b->bits);
+    b->bits  = 0;
+    b->mask  = 0;
+    b->nkeys = 0;
+}
+
+
+void
+bloom_add(bloom *b, const void *key, size_t n)
+{
+    uint64_t h  = fnv64(key, n);
+    uint32_t h1 = h,
+             h2 = (h >> 32) | 1;
+    int i;
+
+    for (i = 0; i < BLOOM_PROBES; i++, h1 += h2) {
+        uint32_t j = h1 & b->mask;
+
+        b->bits[j / 64] |= 1ULL << (j % 64);
+    }
+    b->nkeys++;
+}
+
+
+/*
+ * Return 0 if 'key' is definitely not in 'b', 1 if it may be.
+ */
+int
+bloom_maybe(const bloom *b, const void *key, size_t n)
+{
+    uint64_t h  = fnv64(key, n);
+    uint32_t h1 = h,
+             h2 = (h >> 32) | 1;
+    int i;
+
+    for (i = 0; i < BLOOM_PROBES; i++, h1 += h2) {
+        uint32_t j = h1 & b->mask;
+
+        if (!(b->bits[j / 64] & (1ULL << (j % 64)))) return 0;
+    }
+    return 1;
+}
+
+/* EOF */
@@ -0,0 +1,248 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * catalog.c - read-only, memory mapped catalog of APs
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * The catalog is built offline ("ifscanctl compile-catalog") and
+ *   installed by renaming it over IFSCAND_CATALOG. The format is in
+ *   common.h.
+ *
+ * * Opening it is an mmap(2) and a header check; nothing is read
+ *   until it is used. Lookups are a binary search over the sorted
+ *   entries. Offsets are checked as entries are used, not at open.
+ *
+ * * catalog_refresh() notices a new file (by inode and mtime) and
+ *   maps it in place of the old one.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+
+static void
+unmap(catalog *c)
+{
+    if (c->base) munmap((void *)c->base, c->size);
+
+    c->base = 0;
+    c->size = 0;
+    c->n    = 0;
+    c->gen  = 0;
+    c->hash = 0;
+    c->ent  = 0;
+}
+
+
+/*
+ * Map catalog 'fn' if it exists. A missing catalog is an empty one.
+ *
+ * Return 0 on success, -errno on failure.
+ */
+int
+catalog_open(catalog *c, const char *fn)
+{
+    struct stat st;
+    int fd, r;
+
+    memset(c, 0, sizeof *c);
+    strlcpy(c->fn, fn, sizeof c->fn);
+
+    if ((fd = open(fn, O_RDONLY)) < 0) return errno == ENOENT ? 0 : -errno;
+
+    if (fstat(fd, &st) < 0) goto fail;
+
+    c->dev   = st.st_dev;
+    c->ino   = st.st_ino;
+    c->mtime = st.st_mtime;
+
+    if ((size_t)st.st_size < sizeof(catalog_hdr)) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    void *p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) goto fail;
+
+    close(fd);
+
+    const catalog_hdr *h = p;
+
+    c->base = p;
+    c->size = st.st_size;
+
+    if (h->magic != CATALOG_MAGIC || h->version != CATALOG_VERSION || h->size != c->size ||
+        h->n > (c->size - sizeof *h) / sizeof(catalog_ent)) {
+        printlog(LOG_ERR, "%s: not a valid catalog; ignoring it", fn);
+        unmap(c);
+        return -EINVAL;
+    }
+
+    c->n    = h->n;
+    c->gen  = h->gen;
+    c->hash = h->hash;
+    c->ent  = (const catalog_ent *)(h + 1);
+
+    printlog(LOG_INFO, "%s: %u access points, gen %u", fn, c->n, c->gen);
+    return 0;
+
+fail:
+    r = -errno;
+    close(fd);
+    return r;
+}
+
+
+void
+catalog_close(catalog *c)
+{
+    unmap(c);
+}
+
+
+/*
+ * Map the catalog again if its file was replaced or removed.
+ *
+ * Return 1 if the catalog changed, 0 otherwise.
+ */
+int
+catalog_refresh(catalog *c)
+{
+    struct stat st;
+    char fn[PATH_MAX];
+
+    // The identity is remembered even for a file we rejected.
+    if (stat(c->fn, &st) < 0) {
+        if (c->ino == 0) return 0;  // still missing
+    } else if (st.st_dev == c->dev && st.st_ino == c->ino && st.st_mtime == c->mtime) {
+        return 0;
+    }
+
+    strlcpy(fn, c->fn, sizeof fn);
+    unmap(c);
+    catalog_open(c, fn);
+    return 1;
+}
+
+
+/*
+ * Return the name of entry 'i' and its length in '*len'; null if
+ * the entry is damaged.
+ */
+const char *
+catalog_name(const catalog *c, size_t i, size_t *len)
+{
+    const catalog_ent *e = &c->ent[i];
+
+    if (e->name > c->size || e->namelen > (c->size - e->name)) return 0;
+
+    *len = e->namelen;
+    return (const char *)c->base + e->name;
+}
+
+
+/*
+ * Return the index of the first entry whose name is >= 'name';
+ * set '*found' if it is equal.
+ */
+size_t
+catalog_find(const catalog *c, const char *name, size_t len, int *found)
+{
+    size_t lo = 0,
+           hi = c->n;
+
+    *found = 0;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        size_t n;
+        const char *s = catalog_name(c, mid, &n);
+        int r;
+
+        if (!s) return c->n;    // damaged; treat as the end
+
+        r = memcmp(s, name, n < len ? n : len);
+        if (r == 0) r = n < len ? -1 : n > len;
+
+        if (r == 0) {
+            *found = 1;
+            return mid;
+        }
+
+        if (r < 0) lo = mid + 1;
+        else       hi = mid;
+    }
+    return lo;
+}
+
+
+/*
+ * Decode entry 'i' into 'd'.
+ *
+ * Return 0 on success, -errno if the entry is damaged.
+ */
+int
+catalog_get(const catalog *c, size_t i, apdata *d)
+{
+    const catalog_ent *e = &c->ent[i];
+
+    if (e->rec > c->size || e->reclen > (c->size - e->rec)) return -EINVAL;
+
+    return apdata_decode(d, c->base + e->rec, e->reclen) == 0 ? 0 : -EINVAL;
+}
+
+
+/*
+ * Find AP 'name' in the catalog.
+ *
+ * Return 1 if found, 0 otherwise.
+ */
+int
+catalog_lookup(const catalog *c, const char *name, apdata *d)
+{
+    int found;
+    size_t i = catalog_find(c, name, strlen(name), &found);
+
+    return found && 0 == catalog_get(c, i, d);
+}
+
+/* EOF */
@@ -40,17 +40,17 @@
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <arpa/inet.h>
 
 #include "utils.h"
+#include "jsonw.h"
 #include "ifscand.h"
 
 // Handle command and send response to 'fp'
 typedef int cmd_handler_func(cmd_state *s, char **args, int argc);
-typedef void get_handler_func(apdb *db, fast_buf *out);
-
-// "add" keyword parser
-typedef int kwparser(apdata *d, char* val);
+// Show a setting; as a JSON key:value if 'jw' is non-null
+typedef void get_handler_func(apdb *db, fast_buf *out, jsonw *jw);
 
 // Command name -to- handler mapping
 struct cmdpair
@@ -63,13 +63,6 @@ struct cmdpair
 typedef struct cmdpair cmdpair;
 
 
-struct kwpair
-{
-    const char *name;
-    kwparser *fp;
-};
-typedef struct kwpair kwpair;
-
 
 /*
  * Command handlers.
@@ -81,16 +74,28 @@ static int cmd_scan(cmd_state *s, char **args, int argc);
 static int cmd_down(cmd_state *s, char **args, int argc);
 static int cmd_set(cmd_state *s,  char **args, int argc);
 static int cmd_get(cmd_state *s,  char **args, int argc);
+static int cmd_stats(cmd_state *s, char **args, int argc);
+static int cmd_watch(cmd_state *s, char **args, int argc);
+static int cmd_join(cmd_state *s, char **args, int argc);
+static int cmd_unwatch(cmd_state *s, char **args, int argc);
+static int cmd_import(cmd_state *s, char **args, int argc);
+static int cmd_sync(cmd_state *s, char **args, int argc);
 
 
 static const cmdpair Commands[] = {
-      {"add",  cmd_add,  0, 0}
-    , {"del",  cmd_del,  0, 0}
-    , {"list", cmd_list, 0, 0}
-    , {"scan", cmd_scan, 0, 0}
-    , {"down", cmd_down, 0, 0}
-    , {"set",  cmd_set,  0, 0}
-    , {"get",  cmd_get,  0, 0}
+      {"add",   cmd_add,   0, 0}
+    , {"del",   cmd_del,   0, 0}
+    , {"list",  cmd_list,  0, 0}
+    , {"scan",  cmd_scan,  0, 0}
+    , {"down",  cmd_down,  0, 0}
+    , {"set",   cmd_set,   0, 0}
+    , {"get",   cmd_get,   0, 0}
+    , {"stats", cmd_stats, 0, 0}
+    , {"watch", cmd_watch, 0, 0}
+    , {"join",  cmd_join,  0, 0}
+    , {"unwatch", cmd_unwatch, 0, 0}
+    , {"import", cmd_import, 0, 0}
+    , {"sync",  cmd_sync,  0, 0}
     , {0, 0}
 };
 
@@ -102,11 +107,15 @@ static int set_randmac(cmd_state *, char **args, int argc);
 static int set_aporder(cmd_state *, char **args, int argc);
 static int set_scanint(cmd_state *, char **args, int argc);
 static int set_rssi_scanint(cmd_state *, char **args, int argc);
+static int set_joinhist(cmd_state *, char **args, int argc);
+static int set_nodettl(cmd_state *, char **args, int argc);
 
-static void append_randmac(apdb *, fast_buf *out);
-static void append_aporder(apdb *, fast_buf *out);
-static void append_scanint(apdb *, fast_buf *out);
-static void append_rssi_scanint(apdb *, fast_buf *out);
+static void append_randmac(apdb *, fast_buf *out, jsonw *);
+static void append_aporder(apdb *, fast_buf *out, jsonw *);
+static void append_scanint(apdb *, fast_buf *out, jsonw *);
+static void append_rssi_scanint(apdb *, fast_buf *out, jsonw *);
+static void append_joinhist(apdb *, fast_buf *out, jsonw *);
+static void append_nodettl(apdb *, fast_buf *out, jsonw *);
 
 static const char *scan_aliases[]      = {"scanint", "scan-int", 0};
 static const char *rssi_scan_aliases[] = {"rssi-scanint", "rssi-scan-int", 0};
@@ -115,39 +124,12 @@ static const cmdpair Set_commands[] = {
     , {"aporder",            set_aporder, append_aporder, 0}
     , {"scan-interval",      set_scanint, append_scanint, scan_aliases}
     , {"rssi-scan-interval", set_rssi_scanint, append_rssi_scanint, rssi_scan_aliases}
+    , {"join-history",       set_joinhist, append_joinhist, 0}
+    , {"node-ttl",           set_nodettl, append_nodettl, 0}
     , {0, 0, 0}
 };
 
 
-/*
- * "add" keyword parsers.
- */
-static int parse_apmac(apdata *d, char *val);
-static int parse_mymac(apdata *d, char *val);
-static int parse_in4mask(apdata *d, char *val);
-static int parse_in6mask(apdata *d, char *val);
-static int parse_gw4(apdata *d, char *val);
-static int parse_gw6(apdata *d, char *val);
-
-static int parse_wpakey(apdata *d, char *val);
-static int parse_wepkey(apdata *d, char *val);
-static int parse_nwid(apdata *d, char *val);
-
-
-static const kwpair Add_kw[] = {
-      {"nwid",      parse_nwid}
-    , {"lladdr",    parse_mymac}
-    , {"wpakey",    parse_wpakey}
-    , {"nwkey",     parse_wepkey}
-    , {"bssid",     parse_apmac}
-    , {"inet",      parse_in4mask}
-    , {"inet6",     parse_in6mask}
-    , {"gw",        parse_gw4}
-    , {"gw6",       parse_gw6}
-    , {0, 0}
-};
-
-
 static const cmdpair * find_cmd(const char *name, const cmdpair *p);
 
 
@@ -168,6 +150,47 @@ cmd_error(cmd_state *s, const char *fmt, ...)
 }
 
 
+/*
+ * Stream out every full fragment so that large replies don't
+ * accumulate in s->out.
+ */
+static void
+cmd_flush(cmd_state *s)
+{
+    if (fast_buf_size(&s->out) >= IPC_MAXDATA) ipc_flush(s, 0);
+}
+
+
+/*
+ * Append 'n' bytes of output.
+ */
+static void
+cmd_push(cmd_state *s, const void *buf, size_t n)
+{
+    fast_buf_push(&s->out, buf, n);
+    cmd_flush(s);
+}
+
+
+/*
+ * Append all of 'b' (usually cached output) one fragment at a time.
+ */
+static void
+cmd_push_buf(cmd_state *s, fast_buf *b)
+{
+    const uint8_t *p = fast_buf_ptr(b);
+    size_t         n = fast_buf_size(b);
+
+    while (n > 0) {
+        size_t m = n > IPC_MAXDATA ? IPC_MAXDATA : n;
+
+        cmd_push(s, p, m);
+        p += m;
+        n -= m;
+    }
+}
+
+
 static void
 cmd_response_ok(cmd_state *s)
 {
@@ -178,317 +201,533 @@ cmd_response_ok(cmd_state *s)
     fast_buf_push(&s->out, out, strlen(out));
 }
 
+// add nwid AP [lladdr MAC] [wpakey|nwkey KEY] [bssid mac] [inet dhcp|IP/MASK] [gw IP] [inet6 IP6/MASK6] [GW6 IP]
 static int
-parse_mac(unsigned char *dest, char *s)
-{
-    int i, k;
-    char *p;
-
-    for (k = i = 0; i < 6; i++) {
-        int v = strtol(s, &p, 16);
-        if (p == s || v > 0xff || v < 0) return 0;
-        switch (*p) {
-            case ':':
-                if (i == 5) return 0;
-                break;
-            case 0:
-                if (i != 5) return 0;
-                break;
-            default:
-                return 0;
-        }
+cmd_add(cmd_state *s, char **args, int argc)
+{
+    char err[256];
+    apdata d;
 
-        *dest++ = 0xff & v;
-        s = p + 1;
-    }
+    if (apdata_parse(&d, args, argc, err, sizeof err) < 0) return cmd_error(s, "%s", err);
+
+    db_set_apdata(s->db, &d);
 
+    cmd_response_ok(s);
+    s->kick = 1;
     return 1;
 }
 
 
+#define IMPORT_MAXERR   8   // stop validating after this many errors
+
+/*
+ * import [replace]
+ *
+ * The rest of the request is a file of "add" lines. All of them
+ * are parsed and validated before the DB is touched; then they are
+ * stored with a single sync. With 'replace', APs that aren't in
+ * the file are forgotten.
+ */
 static int
-parse_in4mask(apdata *d, char *s)
+cmd_import(cmd_state *s, char **args, int argc)
 {
-    if (0 == strcmp(s, "dhcp")) {
-        d->flags |= AP_IN4DHCP;
-        return 1;
+    unsigned lineno = 0;
+    int      replace = 0;
+    int      nerr = 0;
+    apvect   av;
+    char    *p, *nl;
+
+    if (argc > 0) {
+        if (argc > 1 || 0 != strcmp(args[0], "replace")) return cmd_error(s, "usage: import [replace]");
+        replace = 1;
     }
 
-    char *mask = strchr(s, '/');
-    if (mask) {
-        *mask = 0;
+    if (!s->body) return cmd_error(s, "nothing to import");
 
-        // see if it looks like an IP address.
-        if (1 != inet_pton(AF_INET, mask+1, &d->mask4)) {
-            const char *err;
-            int v = strtonum(mask+1, 0, 32, &err);
-            if (err)     return 0;
+    VECT_INIT(&av, 64);
+    for (p = s->body; p && nerr < IMPORT_MAXERR; p = nl) {
+        char  err[256];
+        char *argv[128];
+        char *line;
+        apdata d;
+        int n;
 
-            d->mask4.s_addr = htonl(~((1 << (32 -v))-1));
+        lineno++;
+        if ((nl = strchr(p, '\n'))) *nl++ = 0;
+
+        line = strtrim(p);
+        if (*line == 0 || *line == '#') continue;
+
+        n = strsplitargs(argv, ARRAY_SIZE(argv), line);
+        if (n < 0) {
+            cmd_error(s, "line %u: parse error\n", lineno);
+            nerr++;
+            continue;
         }
 
-    } else {
-        d->mask4.s_addr = 0xffffffff;
+        if (0 != strcmp(argv[0], "add")) {
+            cmd_error(s, "line %u: expected 'add', saw '%s'\n", lineno, argv[0]);
+            nerr++;
+            continue;
+        }
+
+        if (apdata_parse(&d, &argv[1], n-1, err, sizeof err) < 0) {
+            cmd_error(s, "line %u: %s\n", lineno, err);
+            nerr++;
+            continue;
+        }
+
+        VECT_PUSH_BACK(&av, d);
+    }
+
+    if (nerr > 0) {
+        cmd_error(s, "import aborted; nothing was changed");
+        goto fail;
     }
 
-    if (1 != inet_pton(AF_INET, s, &d->in4)) return 0;
+    if (VECT_SIZE(&av) == 0) {
+        cmd_error(s, "no access points to import");
+        goto fail;
+    }
 
-    d->flags |= AP_IN4;
+    int  ndel = db_import_ap(s->db, &av, replace);
+    char out[128];
+
+    snprintf(out, sizeof out, "OK: imported %zu access points, forgot %d",
+             VECT_SIZE(&av), ndel);
+    fast_buf_push(&s->out, out, strlen(out));
+
+    VECT_FINI(&av);
+    s->kick = 1;
     return 1;
+
+fail:
+    VECT_FINI(&av);
+    return -EINVAL;
 }
 
+
+// del AP | del pattern PATTERN
 static int
-parse_gw4(apdata *d, char *s)
+cmd_del(cmd_state *s, char **args, int argc)
 {
-    if (1 == inet_pton(AF_INET, s, &d->gw4)) {
-        d->flags |= AP_GW4;
-        return 1;
+    if (argc < 1) return cmd_error(s, "insufficient arguments to 'del'");
+
+    if (argc == 2 && 0 == strcmp(args[0], "pattern")) {
+        db_del_pattern(s->db, args[1]);
+    } else if (argc == 1) {
+        db_del_ap(s->db, args[0]);
+    } else {
+        return cmd_error(s, "usage: del AP | del pattern PATTERN");
     }
 
-    return 0;
+    cmd_response_ok(s);
+    s->kick = 1;
+    return 1;
 }
 
 
-static int
-parse_in6mask(apdata *d, char *s)
-{
-    char *mask = strchr(s, '/');
-    if (mask) {
-        *mask = 0;
-        if (1 != inet_pton(AF_INET6, mask+1, &d->mask6)) {
-            const char *err;
-            int v = strtonum(mask+1, 0, 128, &err);
-            if (err)    return 0;
-            if (v == 0 || v == 128) {
-                memset(&d->mask6.s6_addr, 0xff, sizeof d->mask6.s6_addr);
-            } else {
-                uint8_t *p;
-                memset(&d->mask6.s6_addr, 0x00, sizeof d->mask6.s6_addr);
-                for (p = (uint8_t*)&d->mask6.s6_addr; v > 7; v -= 8) {
-                    *p++ = 0xff;
-                }
-                if (v)    *p = (0xff << (8-v));
-            }
-        }
-    } else {
-        memset(&d->mask6.s6_addr, 0xff, sizeof d->mask6.s6_addr);
-    }
+/*
+ * State for walking the AP DB on behalf of 'list'.
+ */
+struct listctx
+{
+    cmd_state *s;       // flush to s after each AP (if non-null)
+    fast_buf  *b;       // output buffer
+    jsonw     *jw;      // json writer (if json output)
 
-    if (1 != inet_pton(AF_INET6, s, &d->in6)) return 0;
+    const char *glob;   // fnmatch(3) pattern (if non-null)
+    const char *after;  // skip names <= this (if non-null)
 
-    d->flags |= AP_IN6;
-    return 1;
-}
+    int limit;          // max # of APs to emit; 0 => unlimited
+    int n;              // # of APs emitted so far
+    int more;           // set if we stopped due to limit
+
+    int pat;            // set while walking pattern profiles
+    int lastpat;        // set if 'last' is a pattern profile
+    char last[AP_NAMELEN];  // last AP emitted
+};
+typedef struct listctx listctx;
 
 
 static int
-parse_gw6(apdata *d, char *s)
+list_one(void *ctx, const apdata *a)
 {
-    if (1 == inet_pton(AF_INET6, s, &d->gw6)) {
-        d->flags |= AP_GW6;
-        return 1;
+    listctx *lc = ctx;
+    char line[APDATA_TEXT_MAX];
+
+    if (lc->after && strcmp(a->apname, lc->after) <= 0) return 1;
+    if (lc->glob  && 0 != fnmatch(lc->glob, a->apname, 0)) return 1;
+
+    if (lc->limit > 0 && lc->n == lc->limit) {
+        lc->more = 1;
+        return 0;
     }
 
-    return 0;
-}
+    if (lc->jw) {
+        apdata_json(lc->jw, a);
+    } else {
+        size_t n = apdata_sprintf(line, (sizeof line)-2,  a);
 
+        line[n++] = '\n';
+        line[n]   = 0;
 
-static int
-parse_apmac(apdata *d, char *s)
-{
-    if (parse_mac(d->apmac, s)) {
-        d->flags |= AP_BSSID;
-        return 1;
+        fast_buf_push(lc->b, line, n);
     }
-    return 0;
+
+    lc->n++;
+    lc->lastpat = lc->pat;
+    strlcpy(lc->last, a->apname, sizeof lc->last);
+    if (lc->s) cmd_flush(lc->s);
+    return 1;
 }
 
 
-static int
-parse_mymac(apdata *d, char *s)
+/*
+ * Render the list of remembered APs into 'b'.
+ */
+static void
+render_list(apdb *db, fast_buf *b, int json)
 {
-    if (0 == strcmp("random", s)) {
-        d->flags |= AP_RANDMAC|AP_MYMAC;
-        return 1;
+    listctx lc;
+    jsonw jw;
+
+    memset(&lc, 0, sizeof lc);
+    lc.b = b;
+
+    if (json) {
+        jsonw_init(&jw, b);
+        jsonw_arr_open(&jw);
+        lc.jw = &jw;
     }
 
-    if (parse_mac(d->apmac, s)) {
-        d->flags |= AP_MYMAC;
-        return 1;
+    db_walk_ap(db, 0, 0, list_one, &lc);
+    db_walk_pat(db, 0, 0, list_one, &lc);
+
+    if (json) {
+        jsonw_arr_close(&jw);
+    } else if (lc.n == 0) {
+        const char *err = "ERROR: No remembered access points";
+
+        fast_buf_push(b, err, strlen(err));
     }
-    return 0;
 }
 
 
-static int
-parse_wpakey(apdata *d, char *s)
+/*
+ * Copy the literal leading part of glob 'g' into 'pfx'; that bounds
+ * the range of keys a 'match' has to look at.
+ */
+static void
+glob_prefix(char *pfx, size_t sz, const char *g)
 {
-    strlcpy(d->key, s, sizeof d->key);
-    d->flags |= AP_WPAKEY;
-    return 1;
-}
+    size_t n = strcspn(g, "*?[\\");
 
-static int
-parse_wepkey(apdata *d, char *s)
-{
-    strlcpy(d->key, s, sizeof d->key);
-    d->flags |= AP_WEPKEY;
-    return 1;
+    if (n >= sz) n = sz - 1;
+    memcpy(pfx, g, n);
+    pfx[n] = 0;
 }
 
 
+/*
+ * Filtered and paginated listing. Matches are streamed straight
+ * out of the btree cursor; nothing is held back except the
+ * current fragment.
+ *
+ * As with the plain list, pattern profiles follow the APs. The
+ * cursor is the hex encoded name of the last entry shown; 'p'
+ * in front of it says that entry was a pattern profile.
+ */
 static int
-parse_nwid(apdata *d, char *s)
+list_filtered(cmd_state *s, const char *prefix, const char *glob,
+              const char *cursor, int limit, int json)
 {
-    strlcpy(d->apname, s, sizeof d->apname);
-    d->flags |= AP_NWID;
-    return 1;
-}
+    char pfx[AP_NAMELEN];
+    char after[AP_NAMELEN];
+    char tok[2*AP_NAMELEN+2];
+    listctx lc;
+    jsonw jw;
+
+    memset(&lc, 0, sizeof lc);
+    lc.s     = s;
+    lc.b     = &s->out;
+    lc.glob  = glob;
+    lc.limit = limit;
+
+    if (glob) {
+        glob_prefix(pfx, sizeof pfx, glob);
+        prefix = pfx;
+    }
 
+    if (cursor) {
+        const char *c = cursor;
+        ssize_t m;
 
-static kwparser *
-find_parser(const char *kw)
-{
-    const kwpair *a = Add_kw;
+        if (*c == 'p') {
+            lc.pat = 1;
+            c++;
+        }
 
-    for (; a->name; a++) {
-        if (0 == strcmp(kw, a->name)) return a->fp;
+        m = str2hex((uint8_t *)after, sizeof after - 1, c);
+        if (m <= 0) return cmd_error(s, "malformed cursor %s", cursor);
+
+        after[m] = 0;
+        lc.after = after;
+    }
+
+    if (json) {
+        jsonw_init(&jw, &s->out);
+        if (limit > 0 || cursor) {
+            jsonw_obj_open(&jw);
+            jsonw_key(&jw, "aps");
+        }
+        jsonw_arr_open(&jw);
+        lc.jw = &jw;
     }
-    return 0;
-}
 
+    if (!lc.pat) {
+        db_walk_ap(s->db, lc.after, prefix, list_one, &lc);
 
+        lc.pat   = 1;
+        lc.after = 0;
+    }
+    if (!lc.more) db_walk_pat(s->db, lc.after, prefix, list_one, &lc);
 
-// add nwid AP [lladdr MAC] [wpakey|nwkey KEY] [bssid mac] [inet dhcp|IP/MASK] [gw IP] [inet6 IP6/MASK6] [GW6 IP]
+    tok[0] = 0;
+    if (lc.more) {
+        size_t i, n = strlen(lc.last);
+        char  *t = tok;
+
+        if (lc.lastpat) *t++ = 'p';
+        for (i = 0; i < n; i++) {
+            snprintf(&t[2*i], 3, "%02x", (uint8_t)lc.last[i]);
+        }
+    }
+
+    if (json) {
+        jsonw_arr_close(&jw);
+        if (limit > 0 || cursor) {
+            jsonw_key(&jw, "cursor");
+            if (lc.more) jsonw_str(&jw, tok);
+            else         jsonw_null(&jw);
+            jsonw_obj_close(&jw);
+        }
+        return 1;
+    }
+
+    if (lc.n == 0) {
+        if (cursor) return 1;
+        return cmd_error(s, "no matching access points");
+    }
+
+    if (lc.more) {
+        char line[sizeof tok + 16];
+
+        snprintf(line, sizeof line, "cursor %s\n", tok);
+        cmd_push(s, line, strlen(line));
+    }
+    return 1;
+}
+
+
+/*
+ * list [prefix P | match GLOB] [limit N] [cursor TOKEN] [json]
+ */
 static int
-cmd_add(cmd_state *s, char **args, int argc)
+cmd_list(cmd_state *s, char **args, int argc)
 {
+    const char *prefix = 0;
+    const char *glob   = 0;
+    const char *cursor = 0;
+    int limit = 0;
+    int json  = 0;
     int i;
-    apdata d;
 
-    if (argc < 1)  return cmd_error(s, "insufficient arguments to 'add'");
-    if (argc > 12) return cmd_error(s, "too many arguments to 'add'");
-    if (0 != (argc % 2)) return cmd_error(s, "incomplete arguments to 'add'");
+    for (i = 0; i < argc; i++) {
+        const char *a = args[i];
 
-    memset(&d, 0, sizeof d);
-    for (i = 0; i < argc; i += 2) {
-        char *kw  = args[i];
-        char *val = args[i+1];
+        if (0 == strcmp(a, "json")) {
+            json = 1;
+            continue;
+        }
 
-        kwparser *fp = find_parser(kw);
-        if (!fp) return cmd_error(s, "unknown keyword %s in 'add'", kw);
+        if (i+1 >= argc) return cmd_error(s, "missing value for '%s'", a);
 
-        if (!(*fp)(&d, val)) return cmd_error(s, "malformed value %s for %s in 'add'", val, kw);
-    }
+        const char *v = args[++i];
 
-    uint32_t flags = d.flags;
+        if (0 == strcmp(a, "prefix")) {
+            prefix = v;
+        } else if (0 == strcmp(a, "match")) {
+            glob = v;
+        } else if (0 == strcmp(a, "cursor")) {
+            cursor = v;
+        } else if (0 == strcmp(a, "limit")) {
+            char *end = 0;
+            long  l   = strtol(v, &end, 10);
 
-    if (! (flags & AP_NWID)) return cmd_error(s, "missing AP name");
+            if (*end || l <= 0 || l > 65536) return cmd_error(s, "invalid limit %s", v);
+            limit = l;
+        } else {
+            return cmd_error(s, "unknown keyword '%s' for 'list'", a);
+        }
+    }
 
-    if ( (flags & (AP_WPAKEY|AP_WEPKEY)) == (AP_WPAKEY|AP_WEPKEY))
-        return cmd_error(s, "only one of WPA or WEP is needed");
+    if (prefix && glob) return cmd_error(s, "'prefix' and 'match' are mutually exclusive");
 
-    if ((flags & AP_GW4) && !(flags & AP_IN4))
-        return cmd_error(s, "default-gateway needs an IPv4 address/mask");
+    if (prefix || glob || cursor || limit)
+        return list_filtered(s, prefix, glob, cursor, limit, json);
 
-    if ((flags & AP_GW6) && !(flags & AP_IN6))
-        return cmd_error(s, "default-gateway needs IPv6 address/mask");
+    const char *id = json ? "list json" : "list";
+    fast_buf   *b  = rcache_get(id, s->db->gen, 0);
 
-    db_set_apdata(s->db, &d);
+    if (!b) {
+        b = rcache_fill(id, s->db->gen, 0);
+        render_list(s->db, b, json);
+    }
 
-    cmd_response_ok(s);
+    cmd_push_buf(s, b);
     return 1;
 }
 
 
-// del AP
+/*
+ * Print the latest scan snapshot.
+ */
 static int
-cmd_del(cmd_state *s, char **args, int argc)
+scan_print(cmd_state *s, int json)
 {
-    if (argc < 1) return cmd_error(s, "insufficient arguments to 'del'");
+    scansnap *snap = ifstate_snap(s->ifs);
 
-    char *ap = args[0];
+    if (!snap) return cmd_error(s, "no scan results yet");
 
-    db_del_ap(s->db, ap);
-    cmd_response_ok(s);
+    /*
+     * The output depends on the snapshot and the join history. A
+     * quarantine counts down with time; such output isn't reused.
+     */
+    const char *id = json ? "scan json" : "scan";
+    fast_buf   *b  = joinhist_active() ? 0 : rcache_get(id, snap->seq, joinhist_gen());
+
+    if (!b) {
+        b = rcache_fill(id, snap->seq, joinhist_gen());
+        snap_render(snap, b, json);
+    }
+
+    cmd_push_buf(s, b);
+    snap_put(snap);
     return 1;
 }
 
 
-// list all configured AP
+// Deferred reply of "scan wait|fresh"; 'arg' is "json" for json output
+static void
+scan_wait_done(cmd_state *s, const char *arg, int status)
+{
+    if (status < 0) {
+        cmd_error(s, "no scan completed: %s", strerror(-status));
+        return;
+    }
+
+    scan_print(s, 0 == strcmp(arg, "json"));
+}
+
+
+// scan visible AP
+//
+// scan [cached|wait|fresh] [json]
+//
+// "cached" returns the most recent snapshot without asking the
+// driver for its node cache again. "wait" returns the result of
+// the next scan done by the state machine. "fresh" starts an
+// active scan and returns its result when it is done.
 static int
-cmd_list(cmd_state *s, char **args, int argc)
+cmd_scan(cmd_state *s, char **args, int argc)
 {
-    int json = 0;
+    assert(s->ifs);
 
-    if (argc > 0) {
-        if (argc > 1) return cmd_error(s, "too many arguments to 'list'");
+    int json   = 0;
+    int cached = 0;
+    int wait   = 0;
+    int fresh  = 0;
+    int i;
 
-        if (0 != strcmp(args[0], "json")) return cmd_error(s, "unknown format %s for 'list'", args[0]);
-        json = 1;
+    for (i = 0; i < argc; i++) {
+        char *a = args[i];
+
+        if (0 == strcmp(a, "json"))
+            json = 1;
+        else if (0 == strcmp(a, "cached"))
+            cached = 1;
+        else if (0 == strcmp(a, "wait"))
+            wait = 1;
+        else if (0 == strcmp(a, "fresh"))
+            fresh = 1;
+        else
+            return cmd_error(s, "unknown argument %s for 'scan'", a);
     }
 
-    // XXX Lets not do json yet
+    if (fresh) {
+        int r = ascan_start(s->ifs, "request");
+        if (r < 0) return cmd_error(s, "can't start active scan: %s", strerror(-r));
 
-    char line[1024];
-    apvect av;
+        r = defer_reply(s, DEFER_FRESH, json ? "json" : "", IFSCAND_DEFER_TIMEOUT, scan_wait_done);
+        if (r < 0) return cmd_error(s, "can't wait for scan: %s", strerror(-r));
 
-    VECT_INIT(&av, 8);
-    db_get_all_ap(s->db, &av);
-    if (VECT_SIZE(&av) == 0) {
-        cmd_error(s, "No remembered access points");
-        goto end;
+        return 1;
     }
 
-    apdata *a;
-    VECT_FOR_EACH(&av, a) {
-        size_t n = db_ap_sprintf(line, (sizeof line)-2,  a);
+    if (wait) {
+        int r = defer_reply(s, DEFER_SCAN, json ? "json" : "", IFSCAND_DEFER_TIMEOUT, scan_wait_done);
+        if (r < 0) return cmd_error(s, "can't wait for scan: %s", strerror(-r));
 
-        line[n++] = '\n';
-        line[n]   = 0;
+        s->kick = 1;
+        return 1;
+    }
 
-        fast_buf_push(&s->out, line, n);
+    if (!cached || !s->ifs->snap) {
+        int r = ifstate_scan(s->ifs);
+        if (r < 0) return cmd_error(s, "can't scan: %s", strerror(-r));
     }
 
-end:
-    VECT_FINI(&av);
-    return 1;
+    return scan_print(s, json);
 }
 
 
-// scan visible AP
-static int
-cmd_scan(cmd_state *s, char **args, int argc)
+// Deferred reply of "join"
+static void
+join_reply(cmd_state *s, const char *ap, int status)
 {
-    assert(s->ifs);
-
-    int json = 0;
-
-    if (argc > 0) {
-        if (argc > 1) return cmd_error(s, "too many arguments to 'scan'");
-
-        if (0 != strcmp(args[0], "json")) return cmd_error(s, "unknown format %s for 'scan'", args[0]);
-        json = 1;
+    if (status == 0) {
+        cmd_response_ok(s);
+    } else if (status == -ENOENT) {
+        cmd_error(s, "can't join %s: not visible", ap);
+    } else {
+        cmd_error(s, "can't join %s: %s", ap, strerror(-status));
     }
+}
 
-    // XXX Lets not do json yet
 
-    ifstate_scan(s->ifs);
+// join AP
+//
+// Join remembered AP now instead of the one the state machine
+// prefers. The reply is sent when the attempt is over.
+static int
+cmd_join(cmd_state *s, char **args, int argc)
+{
+    apdata d;
 
-    nodevect *apv = &s->ifs->nv;
-    struct ieee80211_nodereq *nr;
-    
-    if (VECT_SIZE(apv) == 0) return cmd_error(s, "no access points visible");
+    if (argc < 1) return cmd_error(s, "insufficient arguments to 'join'");
+    if (argc > 1) return cmd_error(s, "too many arguments to 'join'");
 
-    char buf[1024];
-    VECT_FOR_EACH(apv, nr) {
-        ssize_t n = ifstate_sprintf_node(buf, (sizeof buf)-2, nr);
+    char *ap = args[0];
 
-        buf[n++] = '\n';
-        buf[n]   = 0;
+    if (!db_get_apdata(s->db, ap, &d)) return cmd_error(s, "unknown access point %s", ap);
+    if (s->ifs->joinreq[0])            return cmd_error(s, "already joining %s", s->ifs->joinreq);
 
-        fast_buf_push(&s->out, buf, n);
-    }
+    int r = defer_reply(s, DEFER_JOIN, ap, IFSCAND_DEFER_TIMEOUT, join_reply);
+    if (r < 0) return cmd_error(s, "can't join %s: %s", ap, strerror(-r));
+
+    strlcpy(s->ifs->joinreq, ap, sizeof s->ifs->joinreq);
+    s->kick = 1;
     return 1;
 }
 
@@ -537,9 +776,9 @@ set_uint(cmd_state *s, const char *key, const char *val)
     const char *err = 0;
 
     // XXX maximum of 60 minutes?
-    long long ll = strtonum(val, 1, 60 * 60, &err);
+    long long ll = strtonum(val, 1, IFSCAND_INT_MAX, &err);
 
-    if (ll == 0) return cmd_error(s, "invalid value %s for scan-int", val);
+    if (ll == 0) return cmd_error(s, "invalid value %s for %s", val, key);
 
     unsigned int v = ll & 0xffffffff;
 
@@ -570,6 +809,36 @@ set_rssi_scanint(cmd_state *s, char **args, int argc)
 }
 
 
+// set how long scanned nodes are remembered
+static int
+set_nodettl(cmd_state *s, char **args, int argc)
+{
+    if (argc < 1) return cmd_error(s, "Insufficient arguments to 'node-ttl'");
+
+    return set_uint(s, "node-ttl", args[0]);
+}
+
+
+// keep the join history in memory or also in the DB
+static int
+set_joinhist(cmd_state *s, char **args, int argc)
+{
+    char *z = args[0];
+    unsigned int v;
+
+    if (argc < 1) return cmd_error(s, "Insufficient arguments to 'join-history'");
+
+    if (0 == strcmp(z, "persist"))     v = 1;
+    else if (0 == strcmp(z, "memory")) v = 0;
+    else return cmd_error(s, "invalid value %s for join-history", z);
+
+    db_set_uint(s->db, "join-history", v);
+
+    cmd_response_ok(s);
+    return 1;
+}
+
+
 static int
 cmd_set(cmd_state *s, char **args, int argc)
 {
@@ -582,8 +851,10 @@ cmd_set(cmd_state *s, char **args, int argc)
     argc--;
 
     const cmdpair * p = find_cmd(sub, Set_commands);
-    return p ?  (*p->set)(s, args, argc)
-             : cmd_error(s, "unknown 'set %s'", sub);
+    if (!p) return cmd_error(s, "unknown 'set %s'", sub);
+
+    s->kick = 1;
+    return (*p->set)(s, args, argc);
 }
 
 
@@ -592,47 +863,90 @@ cmd_set(cmd_state *s, char **args, int argc)
  */
 
 static void
-append_randmac(apdb *db, fast_buf *out)
+append_randmac(apdb *db, fast_buf *out, jsonw *jw)
 {
     char buf[64];
     int randmac = db_get_randmac(db);
+
+    if (jw) {
+        jsonw_kv_bool(jw, "randmac", randmac);
+        return;
+    }
+
     snprintf(buf, sizeof buf, "randmac %s\n", randmac ? "true" : "false");
     fast_buf_push(out, buf, strlen(buf));
 }
 
 
 static void
-append_uint(apdb *db, const char *key, fast_buf *out)
+append_uint(apdb *db, const char *key, fast_buf *out, jsonw *jw)
 {
     char buf[128];
     unsigned int v = 0;
 
     db_get_uint(db, key, &v);
+    if (jw) {
+        jsonw_kv_uint(jw, key, v);
+        return;
+    }
+
     snprintf(buf, sizeof buf, "%s %u\n", key, v);
     fast_buf_push(out, buf, strlen(buf));
 }
 
 
 static void
-append_scanint(apdb *db, fast_buf *out)
+append_scanint(apdb *db, fast_buf *out, jsonw *jw)
 {
-    append_uint(db, "scan-int", out);
+    append_uint(db, "scan-int", out, jw);
 }
 
 static void
-append_rssi_scanint(apdb *db, fast_buf *out)
+append_rssi_scanint(apdb *db, fast_buf *out, jsonw *jw)
 {
-    append_uint(db, "rssi-scan-int", out);
+    append_uint(db, "rssi-scan-int", out, jw);
 }
 
 
 static void
-append_aporder(apdb *db, fast_buf *out)
+append_nodettl(apdb *db, fast_buf *out, jsonw *jw)
+{
+    append_uint(db, "node-ttl", out, jw);
+}
+
+
+static void
+append_joinhist(apdb *db, fast_buf *out, jsonw *jw)
+{
+    char buf[64];
+    unsigned int v = 0;
+
+    db_get_uint(db, "join-history", &v);
+    if (jw) {
+        jsonw_kv_str(jw, "join-history", v ? "persist" : "memory");
+        return;
+    }
+
+    snprintf(buf, sizeof buf, "join-history %s\n", v ? "persist" : "memory");
+    fast_buf_push(out, buf, strlen(buf));
+}
+
+
+static void
+append_aporder(apdb *db, fast_buf *out, jsonw *jw)
 {
     char buf[256];
     strvect sv  = db_get_ap_order(db);
     size_t i;
 
+    if (jw) {
+        jsonw_key(jw, "ap-order");
+        jsonw_arr_open(jw);
+        for (i = 0; i < VECT_SIZE(&sv); i++) jsonw_str(jw, VECT_ELEM(&sv, i));
+        jsonw_arr_close(jw);
+        goto end;
+    }
+
     if (VECT_SIZE(&sv) == 0) {
         fast_buf_append(out, '\n');
         goto end;
@@ -656,26 +970,212 @@ end:
 
 /*
  * get sub-command implementation.
+ *
+ * get KEY|all [json]
  */
 static int
 cmd_get(cmd_state *s, char **args, int argc)
 {
     if (argc < 1) return cmd_error(s, "too few arguments to 'get'");
     char *key = args[0];
+    const cmdpair *p = 0;
+    jsonw jw, *j = 0;
 
-    if (0 == strcmp(key, "all")) {
-        const cmdpair *p = Set_commands;
+    if (argc > 1) {
+        if (argc > 2) return cmd_error(s, "too many arguments to 'get'");
 
-        for (; p->name; p++) {
-            (*p->get)(s->db, &s->out);
-        }
+        if (0 != strcmp(args[1], "json")) return cmd_error(s, "unknown format %s for 'get'", args[1]);
+        j = &jw;
+    }
 
-    } else {
-        const cmdpair *p = find_cmd(key, Set_commands);
+    if (0 != strcmp(key, "all")) {
+        p = find_cmd(key, Set_commands);
         if (!p) return cmd_error(s, "unknown get subcommand '%s'", key);
+    }
+
+    char id[64];
+    snprintf(id, sizeof id, "get %s%s", p ? p->name : "all", j ? " json" : "");
+
+    fast_buf *b = rcache_get(id, s->db->gen, 0);
+    if (b) goto done;
+
+    b = rcache_fill(id, s->db->gen, 0);
+    if (j) {
+        jsonw_init(j, b);
+        jsonw_obj_open(j);
+    }
 
-        (*p->get)(s->db, &s->out);
+    if (p) {
+        (*p->get)(s->db, b, j);
+    } else {
+        for (p = Set_commands; p->name; p++) {
+            (*p->get)(s->db, b, j);
+        }
     }
+
+    if (j) jsonw_obj_close(j);
+
+done:
+    cmd_push_buf(s, b);
+    return 1;
+}
+
+
+/*
+ * Show runtime statistics.
+ *
+ * stats [json]
+ */
+static int
+cmd_stats(cmd_state *s, char **args, int argc)
+{
+    char buf[1024];
+    scansnap *snap;
+    uint32_t nsubs, npeers;
+    uint64_t drops, hits, misses, busy;
+
+    event_stats(&nsubs, &drops);
+    rcache_stats(&hits, &misses);
+    admit_stats(&npeers, &busy);
+
+    // Nodes in the snapshot that the last read of the driver missed
+    size_t nstale;
+    nodetab_stats(&nstale);
+
+    // What a catalog delta must name as its base.
+    char catver[24];
+    snprintf(catver, sizeof catver, "%016llx", (unsigned long long)s->db->cat.hash);
+
+    if (argc > 0) {
+        if (argc > 1) return cmd_error(s, "too many arguments to 'stats'");
+        if (0 != strcmp(args[0], "json")) return cmd_error(s, "unknown format %s for 'stats'", args[0]);
+
+        jsonw jw;
+
+        jsonw_init(&jw, &s->out);
+        jsonw_obj_open(&jw);
+        if ((snap = ifstate_snap(s->ifs))) {
+            jsonw_kv_uint(&jw, "scan-seq", snap->seq);
+            jsonw_kv_int(&jw,  "scan-age", time(0) - snap->when);
+            jsonw_kv_uint(&jw, "scan-nodes", VECT_SIZE(&snap->nv));
+            jsonw_kv_uint(&jw, "scan-nodes-stale", nstale);
+            jsonw_kv_int(&jw,  "scan-fresh", snap->fresh);
+            snap_put(snap);
+        }
+        jsonw_kv_uint(&jw, "snapshots-live", snap_live());
+        jsonw_kv_uint(&jw, "event-subscribers", nsubs);
+        jsonw_kv_uint(&jw, "event-drops", drops);
+        jsonw_kv_uint(&jw, "render-cache-hits", hits);
+        jsonw_kv_uint(&jw, "render-cache-misses", misses);
+        jsonw_kv_uint(&jw, "control-peers", npeers);
+        jsonw_kv_uint(&jw, "control-busy", busy);
+        jsonw_kv_uint(&jw, "db-dirty", s->db->dirty);
+        jsonw_kv_uint(&jw, "db-syncs", s->db->syncs);
+        jsonw_kv_uint(&jw, "ssid-filter-names", s->db->ssids.nkeys);
+        jsonw_kv_uint(&jw, "ssid-filter-lookups", s->db->ssid_lookups);
+        jsonw_kv_uint(&jw, "ssid-filter-rejects", s->db->ssid_rejects);
+        jsonw_kv_uint(&jw, "ssid-filter-false-positives", s->db->ssid_falsepos);
+        jsonw_kv_uint(&jw, "ssid-patterns", VECT_SIZE(&s->db->pats.ents));
+        jsonw_kv_uint(&jw, "catalog-entries", s->db->cat.n);
+        jsonw_kv_uint(&jw, "catalog-gen", s->db->cat.gen);
+        jsonw_kv_str(&jw,  "catalog-version", catver);
+        jsonw_obj_close(&jw);
+        return 1;
+    }
+
+    if ((snap = ifstate_snap(s->ifs))) {
+        snprintf(buf, sizeof buf,
+                 "scan-seq %llu\n"
+                 "scan-age %lld\n"
+                 "scan-nodes %zu\n"
+                 "scan-nodes-stale %zu\n"
+                 "scan-fresh %d\n",
+                 (unsigned long long)snap->seq,
+                 (long long)(time(0) - snap->when),
+                 VECT_SIZE(&snap->nv), nstale, snap->fresh);
+        fast_buf_push(&s->out, buf, strlen(buf));
+        snap_put(snap);
+    }
+
+    snprintf(buf, sizeof buf,
+             "snapshots-live %u\n"
+             "event-subscribers %u\n"
+             "event-drops %llu\n"
+             "render-cache-hits %llu\n"
+             "render-cache-misses %llu\n"
+             "control-peers %u\n"
+             "control-busy %llu\n"
+             "db-dirty %u\n"
+             "db-syncs %llu\n"
+             "ssid-filter-names %u\n"
+             "ssid-filter-lookups %llu\n"
+             "ssid-filter-rejects %llu\n"
+             "ssid-filter-false-positives %llu\n"
+             "ssid-patterns %zu\n"
+             "catalog-entries %u\n"
+             "catalog-gen %u\n"
+             "catalog-version %s\n",
+             snap_live(), nsubs, (unsigned long long)drops,
+             (unsigned long long)hits, (unsigned long long)misses,
+             npeers, (unsigned long long)busy,
+             s->db->dirty, (unsigned long long)s->db->syncs,
+             s->db->ssids.nkeys,
+             (unsigned long long)s->db->ssid_lookups,
+             (unsigned long long)s->db->ssid_rejects,
+             (unsigned long long)s->db->ssid_falsepos,
+             VECT_SIZE(&s->db->pats.ents),
+             s->db->cat.n, s->db->cat.gen, catver);
+    fast_buf_push(&s->out, buf, strlen(buf));
+    return 1;
+}
+
+
+/*
+ * Write pending DB updates to disk before replying.
+ */
+static int
+cmd_sync(cmd_state *s, char **args, int argc)
+{
+    if (argc > 0) return cmd_error(s, "too many arguments to 'sync'");
+
+    db_sync(s->db);
+    cmd_response_ok(s);
+    return 1;
+}
+
+
+/*
+ * Subscribe to the event stream. The reply to this request never
+ * ends; events are sent as they happen (see event.c).
+ */
+static int
+cmd_watch(cmd_state *s, char **args, int argc)
+{
+    int r;
+
+    cmd_response_ok(s);
+    fast_buf_append(&s->out, '\n');
+
+    if ((r = event_subscribe(s)) < 0) {
+        fast_buf_reset(&s->out);
+        if (r == -EPROTONOSUPPORT) return cmd_error(s, "'watch' needs a newer ifscanctl");
+        return cmd_error(s, "can't watch: %s", strerror(-r));
+    }
+
+    s->noreply = 1;
+    return 1;
+}
+
+
+/*
+ * End the event stream of the sender.
+ */
+static int
+cmd_unwatch(cmd_state *s, char **args, int argc)
+{
+    if (!event_unsubscribe(s)) return cmd_error(s, "not watching");
+
+    cmd_response_ok(s);
     return 1;
 }
 
@@ -720,6 +1220,48 @@ find_cmd(const char *name, const cmdpair *p)
 }
 
 
+/*
+ * Return true if the request in 's->in' makes us do real work: a
+ * fresh scan or a join.
+ */
+int
+cmd_expensive_p(cmd_state *s)
+{
+    char  line[256];
+    char *args[16];
+    int   i, n;
+
+    if (bcmd_request_p(s)) return bcmd_expensive_p(s);
+
+    strlcpy(line, (char *)fast_buf_ptr(&s->in), sizeof line);
+
+    // Malformed requests fail quickly; they aren't expensive.
+    n = strsplitargs(args, ARRAY_SIZE(args), line);
+    if (n <= 0) return 0;
+
+    if (0 == strcmp(args[0], "join")) return 1;
+    if (0 != strcmp(args[0], "scan")) return 0;
+
+    for (i = 1; i < n; i++) {
+        if (0 == strcmp(args[i], "cached") || 0 == strcmp(args[i], "wait")) return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * Write error 'msg' in the format of the request in 's->in'.
+ */
+void
+cmd_reply_error(cmd_state *s, const char *msg)
+{
+    if (bcmd_request_p(s))
+        bcmd_reply_error(s, msg);
+    else
+        cmd_error(s, "%s", msg);
+}
+
+
 // Process a command in the input buffer 's->in'. Push output to the
 // output buffer 's->out'
 //
@@ -734,6 +1276,16 @@ cmd_process(cmd_state* s)
     int n;
 
     if (fast_buf_size(&s->in) == 0) return 0;
+    if (bcmd_request_p(s))          return bcmd_process(s);
+
+    // Only the first line is the command; see cmd_import().
+    char *nl = strchr(line, '\n');
+
+    s->body = 0;
+    if (nl) {
+        *nl = 0;
+        s->body = nl + 1;
+    }
 
     strtrim(line);
     if (strlen(line) == 0 || line[0] == '#') return 0;
@@ -752,6 +1304,9 @@ cmd_process(cmd_state* s)
 
     if (!c) return cmd_error(s, "unknown command %s", args[0]);
 
+    if (s->body && c->set != cmd_import && *strtrim(s->body))
+        return cmd_error(s, "unexpected lines after '%s'", args[0]);
+
     fast_buf_reset(&s->out);
     return (*c->set)(s, &args[1], n-1);
 }
@@ -40,6 +40,10 @@
  *
  * * Locking and multi-process access is mediated by NDBM.
  *
+ * * The DB is a dbopen(3) btree (prefs.db) or the log-structured
+ *   store in db_log.c (prefs.log); the latter has the same DB
+ *   interface, so nothing below depends on which one is in use.
+ *
  * * All preference keys are stored with prefix "prefs."
  *
  * * All AP name keys are stored with prefix "ap."
@@ -50,6 +54,20 @@
  * * AP Names and properties are global for all interfaces. To
  *   minimize cache-coherency issues, we always go back to NDBM to
  *   filter or arrange entries in the way we want.
+ *
+ * * Updates are write-behind: they go to the btree's page cache
+ *   (IFSCAND_DB_CACHE bytes; reads are served from it too) and
+ *   the event loop syncs them to disk in one batch, at most
+ *   IFSCAND_SYNC_MS after the first unsynced update. "sync",
+ *   db_import_ap() and shutdown sync right away. A forked child
+ *   only closes the DB file; syncing there would write the
+ *   parent's pages as they were at fork.
+ *
+ * * When it has the DB to itself, db_import_ap() writes the result
+ *   of the import to a new file and renames it over the DB, so
+ *   that the DB holds either all of the import or none of it.
+ *   Other instances would keep using the old file; so while they
+ *   hold it open, the import is applied in place instead.
  */
 
 #include <stdio.h>
@@ -58,9 +76,11 @@
 #include <assert.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
 #include <db.h>
 #include <libgen.h>
+#include <sys/file.h>
 
 #include "vect.h"
 #include "utils.h"
@@ -90,35 +110,158 @@ dec_LE_u32(const uint8_t * p) {
 }
 #endif
 
+/*
+ * Open (creating if needed) DB file 'fn' of the 'backend' kind.
+ */
+static DB *
+db_open_file(const char *fn, int backend)
+{
+    BTREEINFO bt;
+
+    if (backend == DB_BACKEND_LOG) return dblog_open(fn, O_RDWR|O_CREAT|O_SHLOCK, 0600);
+
+    memset(&bt, 0, sizeof bt);
+    bt.cachesize = IFSCAND_DB_CACHE;
+
+    return dbopen(fn, O_RDWR|O_CREAT|O_SHLOCK, 0600, DB_BTREE, &bt);
+}
+
+
 void
-db_init(apdb *db, const char *iface)
+db_init(apdb *db, const char *iface, int backend)
 {
-    char fn[PATH_MAX];
-    snprintf(fn, sizeof fn, "%s.db", IFSCAND_PREFS);
+    char *fn = db->fn;
+    DB   *d;
+
+    snprintf(fn, sizeof db->fn, "%s.%s", IFSCAND_PREFS, backend == DB_BACKEND_LOG ? "log" : "db");
 
     make_dir(fn);
 
-    DB *d = dbopen(fn, O_RDWR|O_CREAT|O_SYNC|O_SHLOCK, 0600, DB_BTREE, 0);
+    d = db_open_file(fn, backend);
     if (!d) error(1, errno, "can't open %s", fn);
 
-    db->db = d;
+    db->backend = backend;
+
+    db->db      = d;
+    db->gen     = 1;
+    db->dirty   = 0;
+    db->dirtyat = 0;
+    db->syncs   = 0;
+
+    memset(&db->ssids, 0, sizeof db->ssids);
+    db->ssidgen  = 0;
+    db->ssidwhen = 0;
+    db->ssid_lookups = db->ssid_rejects = db->ssid_falsepos = 0;
+
+    memset(&db->ranks, 0, sizeof db->ranks);
+    db->rankwhen = 0;
+
+    memset(&db->pats, 0, sizeof db->pats);
+    db->patgen  = 0;
+    db->patwhen = 0;
+
+    db->nodettl = IFSCAND_NODE_TTL;
+    db->ttlgen  = 0;
+
+    int r = catalog_open(&db->cat, IFSCAND_CATALOG);
+    if (r < 0) printlog(LOG_ERR, "can't open catalog %s: %s", IFSCAND_CATALOG, strerror(-r));
+
     strlcpy(db->ifname, iface, sizeof db->ifname);
 
     // get and set default values
     unsigned int v = 0;
     if (!db_get_uint(db, "scan-int", &v))       db_set_uint(db, "scan-int",      IFSCAND_INT_SCAN);
     if (!db_get_uint(db, "rssi-scan-int", &v))  db_set_uint(db, "rssi-scan-int", IFSCAND_INT_RSSI_FAST);
+    if (!db_get_uint(db, "node-ttl", &v))       db_set_uint(db, "node-ttl",      IFSCAND_NODE_TTL);
 }
 
 
 void
 db_close(apdb *db)
 {
+    db_sync(db);
+    bloom_fini(&db->ssids);
+    rankmap_fini(&db->ranks);
+    patset_fini(&db->pats);
+    catalog_close(&db->cat);
     db->db->close(db->db);
 }
 
+
+void
+db_child_close(apdb *db)
+{
+    int fd = db->db->fd(db->db);
+
+    if (fd >= 0) close(fd);
+}
+
+
+void
+db_maint(apdb *db)
+{
+    if (db->backend == DB_BACKEND_LOG) dblog_maint(db->db);
+
+    // A new catalog changes what we remember.
+    if (catalog_refresh(&db->cat)) db->gen++;
+}
+
+
+/*
+ * Note a write that is not yet on disk.
+ */
 static void
-db_put(apdb *db, const char * rkey, DBT *val)
+db_unsynced(apdb *db)
+{
+    if (db->dirty++ == 0) db->dirtyat = mono_ms();
+}
+
+
+/*
+ * Note an update (new content) that is not yet on disk.
+ */
+static void
+db_dirty(apdb *db)
+{
+    db_unsynced(db);
+    db->gen++;
+}
+
+
+/*
+ * Write all pending updates to disk.
+ */
+void
+db_sync(apdb *db)
+{
+    if (db->dirty == 0) return;
+
+    if (0 != db->db->sync(db->db, 0))
+        printlog(LOG_ERR, "can't sync prefs DB: %s", strerror(errno));
+
+    db->dirty = 0;
+    db->syncs++;
+}
+
+
+/*
+ * Return the # of ms before pending updates must be synced; -1 if
+ * there are none.
+ */
+int64_t
+db_sync_due(apdb *db)
+{
+    if (db->dirty == 0) return -1;
+
+    int64_t ms = db->dirtyat + IFSCAND_SYNC_MS - mono_ms();
+    return ms > 0 ? ms : 0;
+}
+
+/*
+ * Store the preference 'rkey'; the caller accounts for the update.
+ */
+static void
+db_store(apdb *db, const char * rkey, DBT *val)
 {
     char key[128];
     int r;
@@ -133,8 +276,14 @@ db_put(apdb *db, const char * rkey, DBT *val)
         printlog(LOG_ERR, "can't store %s: %s", key, strerror(errno));
         error(1, errno, "fatal: DB store of %s failed", key);
     }
+}
+
 
-    db->db->sync(db->db, 0);
+static void
+db_put(apdb *db, const char * rkey, DBT *val)
+{
+    db_store(db, rkey, val);
+    db_dirty(db);
 }
 
 
@@ -193,48 +342,262 @@ db_get_strvect(apdb *db, strvect *sv, const char *rkey)
 
 
 /*
- * Serialize apdata into durable storage.
+ * Write 'd' to 'db' in the compact encoding (see apdata.c).
+ *
+ * Return 0 on success, -1 (errno set) on failure.
  */
-static ssize_t
-pack_apdata(uint8_t *buf, size_t bsiz, const apdata *d)
+static int
+store_apdata(DB *db, const apdata *d)
 {
-    assert(bsiz >= sizeof *d);
+    uint8_t buf[APDATA_ENC_MAX];
+    char key[256];
+
+    snprintf(key, sizeof key, "%s%s", d->flags & AP_PATTERN ? "pat." : "ap.", d->apname);
+
+    DBT k = { .data = key, .size = strlen(key) };
+    DBT v = { .data = buf };
+
+    v.size = apdata_encode(buf, sizeof buf, d);
 
-    memcpy(buf, d, sizeof *d);
-    return sizeof *d;
+    return db->put(db, &k, &v, 0) == 0 ? 0 : -1;
 }
 
 
+static void
+put_apdata(apdb *db, const apdata *d)
+{
+    if (store_apdata(db->db, d) != 0) {
+        const char *pfx = d->flags & AP_PATTERN ? "pat." : "ap.";
+
+        printlog(LOG_ERR, "can't store %s%s: %s", pfx, d->apname, strerror(errno));
+        error(1, errno, "fatal: DB store of %s%s failed", pfx, d->apname);
+    }
+}
+
+
+/*
+ * Decode the AP record in 'v'.
+ *
+ * Returns the same as apdata_decode(); damaged records are logged.
+ */
 static int
-unpack_apdata(apdata *d, uint8_t *buf, size_t bsiz)
+unpack_apdata(apdata *d, const DBT *v)
+{
+    int r = apdata_decode(d, v->data, v->size);
+
+    if (r < 0) printlog(LOG_WARNING, "ignoring damaged AP record (%zu bytes): %s",
+                        v->size, strerror(-r));
+    return r;
+}
+
+
+/*
+ * Rewrite an old fixed-size record in the compact encoding. What
+ * it says doesn't change; so neither does the DB generation.
+ */
+static void
+migrate_apdata(apdb *db, const apdata *d)
 {
-    assert(bsiz >= sizeof *d);
-    memcpy(d, buf, sizeof *d);
-    return sizeof *d;
+    debuglog("migrating AP record %s to the compact encoding", d->apname);
+
+    put_apdata(db, d);
+    db_unsynced(db);
 }
 
+
 /*
  * Store a given AP's info in the DB.
  */
 void
 db_set_apdata(apdb *db, const apdata *d)
 {
-    uint8_t buf[1024];
+    put_apdata(db, d);
+    db_dirty(db);
+}
+
+
+/*
+ * Recompile the SSID patterns if the DB changed or they are too
+ * old.
+ */
+static void
+patterns_update(apdb *db)
+{
+    time_t now = time(0);
+    DB *d = db->db;
+    DBT k, v;
+    int r;
+
+    if (db->patgen == db->gen && (now - db->patwhen) < IFSCAND_SSID_FILTER_AGE) return;
+
+    patset_fini(&db->pats);
+    patset_init(&db->pats);
+
+    k.data = "pat.";
+    k.size = 4;
+    for (r = d->seq(d, &k, &v, R_CURSOR); r == 0; r = d->seq(d, &k, &v, R_NEXT)) {
+        char pat[AP_NAMELEN];
+        size_t n = k.size - 4;
+
+        if (k.size < 4 || 0 != memcmp(k.data, "pat.", 4)) break;
+        if (n >= sizeof pat) continue;
+
+        memcpy(pat, (char *)k.data + 4, n);
+        pat[n] = 0;
+        patset_add(&db->pats, pat);
+    }
+
+    db->patgen  = db->gen;
+    db->patwhen = now;
+    debuglog("db: %zu SSID patterns compiled", VECT_SIZE(&db->pats.ents));
+}
+
+
+/*
+ * Find the best pattern profile for 'ssid' and return it in 'd' as
+ * if it were an AP of that name.
+ *
+ * Return 1 if found, 0 otherwise.
+ */
+static int
+pattern_lookup(apdb *db, const char *ssid, apdata *d)
+{
+    const char *pat = patset_match(&db->pats, ssid);
     char key[256];
 
-    snprintf(key, sizeof key, "ap.%s", d->apname);
+    if (!pat) return 0;
+
+    snprintf(key, sizeof key, "pat.%s", pat);
 
     DBT k = { .data = key, .size = strlen(key) };
-    DBT v = { .data = buf };
+    DBT v = { 0, 0 };
 
-    v.size = pack_apdata(buf, sizeof buf, d);
+    if (0 != db->db->get(db->db, &k, &v, 0)) return 0;
 
-    int r = db->db->put(db->db, &k, &v, 0);
-    if (r != 0) {
-        printlog(LOG_ERR, "can't store %s: %s", key, strerror(errno));
-        error(1, errno, "fatal: DB store of %s failed", key);
+    int r = unpack_apdata(d, &v);
+    if (r < 0)  return 0;
+    if (r == 1) migrate_apdata(db, d);
+
+    debuglog("db: %s matches pattern %s", ssid, pat);
+    strlcpy(d->apname, ssid, sizeof d->apname);
+    d->flags &= ~AP_PATTERN;
+    return 1;
+}
+
+
+/*
+ * Fetch the remembered AP 'name' into 'd'.
+ *
+ * Return 1 if found, 0 otherwise.
+ */
+int
+db_get_apdata(apdb *db, const char *name, apdata *d)
+{
+    char key[256];
+
+    snprintf(key, sizeof key, "ap.%s", name);
+
+    DBT k = { .data = key, .size = strlen(key) };
+    DBT v = { 0, 0 };
+
+    if (0 != db->db->get(db->db, &k, &v, 0)) {
+        if (catalog_lookup(&db->cat, name, d)) return 1;
+
+        patterns_update(db);
+        return pattern_lookup(db, name, d);
+    }
+
+    int r = unpack_apdata(d, &v);
+    if (r < 0)  return 0;
+    if (r == 1) migrate_apdata(db, d);
+    return 1;
+}
+
+
+/*
+ * Rebuild the filter of remembered AP names - in the DB and the
+ * catalog - if either changed or the filter is too old. A new
+ * catalog bumps db->gen (see db_maint()).
+ */
+static void
+ssid_filter_update(apdb *db)
+{
+    time_t now = time(0);
+    DB *d = db->db;
+    DBT k, v;
+    size_t n = 0, i;
+    int r, pass;
+
+    if (db->ssidgen == db->gen && (now - db->ssidwhen) < IFSCAND_SSID_FILTER_AGE) return;
+
+    // Count, then add.
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            bloom_fini(&db->ssids);
+            bloom_init(&db->ssids, n + db->cat.n);
+        }
+
+        k.data = "ap.";
+        k.size = 3;
+        for (r = d->seq(d, &k, &v, R_CURSOR); r == 0; r = d->seq(d, &k, &v, R_NEXT)) {
+            if (k.size < 3 || 0 != memcmp(k.data, "ap.", 3)) break;
+
+            if (pass == 0) n++;
+            else           bloom_add(&db->ssids, (char *)k.data + 3, k.size - 3);
+        }
+    }
+
+    for (i = 0; i < db->cat.n; i++) {
+        size_t      len;
+        const char *nm = catalog_name(&db->cat, i, &len);
+
+        if (nm) bloom_add(&db->ssids, nm, len);
     }
-    db->db->sync(db->db, 0);
+
+    db->ssidgen  = db->gen;
+    db->ssidwhen = now;
+    debuglog("db: SSID filter rebuilt with %u names", db->ssids.nkeys);
+}
+
+
+/*
+ * Recompile "aporder" if it was set or the table is too old.
+ */
+static void
+ranks_update(apdb *db)
+{
+    time_t now = time(0);
+
+    if (db->rankwhen > 0 && (now - db->rankwhen) < IFSCAND_APORDER_AGE) return;
+
+    DBT d = db_get(db, "aporder");
+
+    rankmap_fini(&db->ranks);
+    rankmap_init(&db->ranks, d.data, d.data ? d.size : 0);
+    db->rankwhen = now;
+    debuglog("db: ap-order compiled with %u names", db->ranks.n);
+}
+
+
+/*
+ * Sort key of a candidate AP: its rank, then its place in the scan.
+ */
+struct rankkey
+{
+    uint32_t rank;
+    uint32_t idx;
+};
+typedef struct rankkey rankkey;
+
+
+static int
+rankkey_cmp(const void *x, const void *y)
+{
+    const rankkey *a = x;
+    const rankkey *b = y;
+
+    if (a->rank != b->rank) return a->rank < b->rank ? -1 : 1;
+    return a->idx < b->idx ? -1 : a->idx > b->idx;
 }
 
 
@@ -250,43 +613,56 @@ db_filter_ap(apdb *db, apvect *av, nodevect *nv)
     struct ieee80211_nodereq *nr;
     DBT k = { .data = key };
 
-    strvect sv; // Our ordered list of AP names (if any)
-
     VECT_RESET(av);
-
-    VECT_INIT(&sv, 8);
     VECT_RESERVE(av, 8);
 
-    db_get_strvect(db, &sv, "aporder");
+    ranks_update(db);
+    ssid_filter_update(db);
+    patterns_update(db);
 
     VECT_FOR_EACH(nv, nr) {
         DBT v = { 0, 0};
         apdata d;
+        int found = 0;
+
+        // Nodes the driver no longer lists are kept for "scan"
+        // (see nodetab.c); they aren't joinable.
+        if (nodetab_stale(nr->nr_bssid)) continue;
 
         copy_apname(nw, IEEE80211_NWID_LEN, nr);
 
-        snprintf(key, sizeof key, "ap.%s", nw);
-        k.size = strlen(key);
-        if (0 != db->db->get(db->db, &k, &v, 0)) continue;
+        // Most SSIDs in a crowded place are strangers; skip the DB
+        // and the catalog.
+        db->ssid_lookups++;
+        if (!bloom_maybe(&db->ssids, nw, strlen(nw))) {
+            db->ssid_rejects++;
+        } else {
+            snprintf(key, sizeof key, "ap.%s", nw);
+            k.size = strlen(key);
+            if (0 == db->db->get(db->db, &k, &v, 0)) {
+                int r = unpack_apdata(&d, &v);
+                if (r < 0)  continue;
+                if (r == 1) migrate_apdata(db, &d);
+                found = 1;
+            } else {
+                found = catalog_lookup(&db->cat, nw, &d);
+            }
+
+            if (!found) db->ssid_falsepos++;
+        }
 
-        unpack_apdata(&d, v.data, v.size);
+        // Exact names first, then patterns; they aren't in the filter.
+        if (!found) found = pattern_lookup(db, nw, &d);
+        if (!found) continue;
 
         /*
          * If the MAC address is pinned, make sure what we are
-         * seeing is the same as what we expect.
+         * seeing is one of the BSSIDs (or OUIs) we expect.
          */
-        if (d.flags & AP_BSSID) {
-            if (0 != memcmp(d.apmac, nr->nr_bssid, 6)) {
-                char exp[16];
-                char saw[16];
-                snprintf(exp, sizeof exp, MACFMT, sMAC(d.apmac));
-                snprintf(saw, sizeof saw, MACFMT, sMAC(nr->nr_bssid));
-
-                printlog(LOG_WARNING, "AP %s: MAC mismatch; exp %s, saw %s",
-                        d.apname, exp, saw);
-
-                continue;
-            }
+        if (!apdata_bssid_ok(&d, nr->nr_bssid)) {
+            printlog(LOG_WARNING, "AP %s: MAC mismatch; saw " MACFMT " (%u pinned BSSIDs, %u OUIs)",
+                    d.apname, sMAC(nr->nr_bssid), d.nbss, d.noui);
+            continue;
         }
 
         debuglog("scan: shortlisted known AP %s [" MACFMT "]..\n", d.apname, sMAC(nr->nr_bssid));
@@ -296,40 +672,34 @@ db_filter_ap(apdb *db, apvect *av, nodevect *nv)
         VECT_APPEND(av, d);       
     }
 
-    if (VECT_SIZE(&sv) == 0) goto end;
+    size_t n = VECT_SIZE(av);
+
+    if (db->ranks.n == 0 || n < 2) return;
 
 
     debuglog("scan: filtering based on ap-order ..");
 
     /*
-     * Now, we put the APs we want at the top.
+     * Now, we put the APs we want at the top: sort by rank and,
+     * for the same rank (or none), keep the order of the scan.
      */
+    rankkey keys[n];
     apvect fv;
-    char **p;
-    apdata *d;
-    bitvect bs;
     size_t i;
 
-    bv_init_alloca(&bs, VECT_SIZE(av));
-
-    VECT_INIT(&fv, 8);
-    VECT_FOR_EACH(&sv, p) {
-        char *s = *p;
-        VECT_FOR_EACHi(av, i, d) {
-            if (0 != strcmp(d->apname, s)) continue;
-
-            bv_set(&bs, i);
-            VECT_APPEND(&fv, *d);
-            debuglog("scan: selecting preferred AP %s..\n", d->apname);
-        }
+    for (i = 0; i < n; i++) {
+        keys[i].rank = rankmap_get(&db->ranks, VECT_ELEM(av, i).apname);
+        keys[i].idx  = i;
     }
+    qsort(keys, n, sizeof keys[0], rankkey_cmp);
 
-    // add back the ones we haven't ordered.
-    VECT_FOR_EACHi(av, i, d) {
-        if (!bv_isset(&bs, i)) {
-            VECT_APPEND(&fv, *d);
-            debuglog("scan: adding remaining AP %s..\n", d->apname);
-        }
+    VECT_INIT(&fv, n);
+    for (i = 0; i < n; i++) {
+        apdata *d = &VECT_ELEM(av, keys[i].idx);
+
+        debuglog("scan: %s AP %s..\n", keys[i].rank == RANK_NONE ? "adding remaining" : "selecting preferred",
+                 d->apname);
+        VECT_APPEND(&fv, *d);
     }
 
     VECT_SWAP(&fv, av);
@@ -337,9 +707,6 @@ db_filter_ap(apdb *db, apvect *av, nodevect *nv)
 
     debuglog("scan: Final %d APs in candidate set; top %s\n", VECT_SIZE(av),
                 VECT_SIZE(av) > 0 ? VECT_ELEM(av, 0).apname : "");
-
-end:
-    VECT_FINI(&sv);
 }
 
 
@@ -370,6 +737,7 @@ db_set_ap_order(apdb *db, char **args, int argc)
     DBT d = { .data = buf, .size = (sizeof buf)-n };
 
     db_put(db, "aporder", &d);
+    db->rankwhen = 0;
 }
 
 
@@ -385,31 +753,324 @@ db_get_ap_order(apdb *db)
 }
 
 
+/*
+ * Byte-wise order of two counted names; the same order as the
+ * btree and the catalog.
+ */
+static int
+name_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int r = memcmp(a, b, alen < blen ? alen : blen);
+
+    if (r == 0) r = alen < blen ? -1 : alen > blen;
+    return r;
+}
+
+
+/*
+ * State of a catalog walk that is merged with a btree walk.
+ */
+struct catwalk
+{
+    const catalog *c;
+    size_t  i;          // next catalog entry
+    const char *pfx;    // name prefix (without "ap.")
+    size_t  plen;
+    int     n;          // # of APs visited
+    int     more;       // 0 once the callback wants no more
+    db_ap_func *fp;
+    void   *ctx;
+};
+typedef struct catwalk catwalk;
+
+
+/*
+ * Visit catalog entries that sort before 'nm' (or all the remaining
+ * ones if 'nm' is null) and are within the prefix. If the next
+ * entry is 'nm' itself, skip it: the DB entry hides it.
+ */
+static void
+catwalk_upto(catwalk *w, const char *nm, size_t nlen)
+{
+    const catalog *c = w->c;
+    const char *cn;
+    size_t clen;
+    apdata x;
+    int r;
+
+    for (; w->more && w->i < c->n; w->i++) {
+        cn = catalog_name(c, w->i, &clen);
+        if (!cn || clen < w->plen || 0 != memcmp(cn, w->pfx, w->plen)) {
+            w->i = c->n;
+            return;
+        }
+
+        if (nm && (r = name_cmp(cn, clen, nm, nlen)) >= 0) {
+            if (r == 0) w->i++;
+            return;
+        }
+
+        if (catalog_get(c, w->i, &x) < 0) continue;
+
+        w->n++;
+        w->more = (*w->fp)(w->ctx, &x);
+    }
+}
+
+
+/*
+ * Call 'fp' on remembered APs in name order, starting at the first
+ * name >= 'from' (if non-null), until it returns 0. If 'prefix' is
+ * non-null, only names that start with it are visited; the btree
+ * is positioned at the start of that range with R_CURSOR and the
+ * walk ends at the first key past it.
+ *
+ * Catalog entries in the same range are merged in.
+ *
+ * Return the # of APs visited.
+ */
 int
-db_get_all_ap(apdb *db, apvect *av)
+db_walk_ap(apdb *db, const char *from, const char *prefix, db_ap_func *fp, void *ctx)
 {
+    char start[256];
+    char pfx[256];
     DBT k;
     DBT v;
     DB *d = db->db;
-    int r;
+    int r, found;
+    apvect old;     // old records; rewritten after the walk
+    apdata *a;
+    catwalk w;
+
+    VECT_INIT(&old, 4);
+    snprintf(pfx, sizeof pfx, "ap.%s", prefix ? prefix : "");
+    snprintf(start, sizeof start, "ap.%s", from ? from : "");
+
+    // Start at whichever of the two comes later.
+    if (strcmp(start, pfx) < 0) strlcpy(start, pfx, sizeof start);
+
+    size_t plen = strlen(pfx);
+
+    memset(&w, 0, sizeof w);
+    w.c    = &db->cat;
+    w.i    = catalog_find(w.c, start+3, strlen(start+3), &found);
+    w.pfx  = pfx+3;
+    w.plen = plen-3;
+    w.more = 1;
+    w.fp   = fp;
+    w.ctx  = ctx;
+
+    k.data = start;
+    k.size = strlen(start);
+    for (r = d->seq(d, &k, &v, R_CURSOR); r == 0; r = d->seq(d, &k, &v, R_NEXT)) {
+        assert(k.data);
+        if (k.size < plen || 0 != memcmp(pfx, k.data, plen)) break;
 
-    VECT_RESET(av);
-    VECT_RESERVE(av, 8);
+        catwalk_upto(&w, (const char *)k.data + 3, k.size - 3);
+        if (!w.more) break;
 
+        if (v.data) {
+            apdata x;
 
-    for (r = d->seq(d, &k, &v, R_FIRST); r == 0; r = d->seq(d, &k, &v, R_NEXT)) {
-        assert(k.data);
-        if (0 != memcmp("ap.", k.data, 3)) continue;
+            r = unpack_apdata(&x, &v);
+            if (r < 0)  continue;
+            if (r == 1) VECT_PUSH_BACK(&old, x);
 
-        if (v.data) {
-            apdata a;
+            w.n++;
+            if (!(w.more = (*fp)(ctx, &x))) break;
+        }
+    }
+    catwalk_upto(&w, 0, 0);
+
+    // Writing while the cursor is open would upset it.
+    VECT_FOR_EACH(&old, a) {
+        migrate_apdata(db, a);
+    }
+    VECT_FINI(&old);
+    return w.n;
+}
+
+
+static int
+apname_cmp(const void *x, const void *y)
+{
+    const apdata *a = x;
+    const apdata *b = y;
+    int pa = !!(a->flags & AP_PATTERN),
+        pb = !!(b->flags & AP_PATTERN);
+
+    // APs and patterns are separate namespaces.
+    if (pa != pb) return pa - pb;
+    return strcmp(a->apname, b->apname);
+}
 
-            unpack_apdata(&a, v.data, v.size);
-            VECT_APPEND(av, a);       
+
+/*
+ * Return true if 'k' is the key of an AP or pattern whose name
+ * isn't in the sorted 'av'.
+ */
+static int
+key_unlisted(const apvect *av, const DBT *k)
+{
+    const char *p = k->data;
+    size_t plen;
+    apdata key;
+
+    if (k->size > 3 && 0 == memcmp(p, "ap.", 3)) {
+        plen      = 3;
+        key.flags = 0;
+    } else if (k->size > 4 && 0 == memcmp(p, "pat.", 4)) {
+        plen      = 4;
+        key.flags = AP_PATTERN;
+    } else {
+        return 0;
+    }
+
+    size_t n = k->size - plen;
+
+    if (n >= sizeof key.apname) return 0;
+
+    memcpy(key.apname, p + plen, n);
+    key.apname[n] = 0;
+    return !bsearch(&key, &VECT_ELEM(av, 0), VECT_SIZE(av), sizeof key, apname_cmp);
+}
+
+
+/*
+ * Delete the keys starting with 'pfx' whose names aren't in the
+ * sorted 'av'.
+ *
+ * Return the # deleted.
+ */
+static int
+forget_unlisted(apdb *db, apvect *av, const char *pfx)
+{
+    DB *d = db->db;
+    size_t plen = strlen(pfx);
+    DBT k, v;
+    int r, ndel = 0;
+
+    k.data = (void *)pfx;
+    k.size = plen;
+    for (r = d->seq(d, &k, &v, R_CURSOR); r == 0; r = d->seq(d, &k, &v, R_NEXT)) {
+        if (k.size < plen || 0 != memcmp(k.data, pfx, plen)) break;
+        if (!key_unlisted(av, &k)) continue;
+
+        d->del(d, &k, R_CURSOR);
+        ndel++;
+    }
+    return ndel;
+}
+
+
+/*
+ * Write the DB as it is after the import to a new file and rename
+ * it over the DB. The caller has sorted 'av'.
+ *
+ * Return the # of APs forgotten; -errno if the DB is shared or the
+ * new file couldn't be made, in which case the DB is unchanged.
+ */
+static int
+import_staged(apdb *db, apvect *av, int replace)
+{
+    char tmp[PATH_MAX];
+    const apdata *a;
+    DB  *old = db->db;
+    DB  *nd;
+    DBT  k, v;
+    int  fd = old->fd(old);
+    int  r, ndel = 0;
+
+    // Others would go on with the old file.
+    if (fd < 0 || flock(fd, LOCK_EX|LOCK_NB) < 0) return -EBUSY;
+
+    snprintf(tmp, sizeof tmp, "%s.import", db->fn);
+    unlink(tmp);
+
+    nd = db_open_file(tmp, db->backend);
+    if (!nd) goto fail;
+
+    for (r = old->seq(old, &k, &v, R_FIRST); r == 0; r = old->seq(old, &k, &v, R_NEXT)) {
+        if (replace && key_unlisted(av, &k)) {
+            ndel++;
+            continue;
         }
+        if (nd->put(nd, &k, &v, 0) != 0) goto fail;
+    }
+
+    VECT_FOR_EACH(av, a) {
+        if (store_apdata(nd, a) != 0) goto fail;
+    }
+
+    if (nd->sync(nd, 0) != 0) goto fail;
+
+    r  = nd->close(nd);
+    nd = 0;
+    if (r != 0)                     goto fail;
+    if (rename(tmp, db->fn) < 0)    goto fail;
+
+    nd = db_open_file(db->fn, db->backend);
+    if (!nd) error(1, errno, "can't reopen %s after import", db->fn);
+
+    // What the old handle still has cached goes to the old file.
+    old->close(old);
+
+    db->db    = nd;
+    db->dirty = 0;
+    db->gen++;
+    db->syncs++;
+    return ndel;
+
+fail:
+    r = errno ? -errno : -EIO;
+    if (nd) nd->close(nd);
+    unlink(tmp);
+    flock(fd, LOCK_SH);
+    return r;
+}
+
+
+/*
+ * Store all the APs in 'av' and sync once. With 'replace', also
+ * forget every remembered AP and pattern that isn't in 'av'. 'av'
+ * is sorted by name as a side effect.
+ *
+ * The caller has validated 'av'. If the DB isn't shared, the
+ * import is staged in a new file that replaces the DB; either all
+ * of it is applied or none of it is. Otherwise it is applied in
+ * place: new records first, then the deletions, so that an
+ * interrupted import loses nothing that was remembered.
+ *
+ * Return the # of APs forgotten.
+ */
+int
+db_import_ap(apdb *db, apvect *av, int replace)
+{
+    const apdata *a;
+    int ndel = 0;
+
+    VECT_SORT(av, apname_cmp);
+
+    ndel = import_staged(db, av, replace);
+    if (ndel >= 0) return ndel;
+
+    if (ndel != -EBUSY)
+        printlog(LOG_ERR, "can't stage import in %s.import: %s; importing in place",
+                 db->fn, strerror(-ndel));
+
+    VECT_FOR_EACH(av, a) {
+        put_apdata(db, a);
     }
 
-    return VECT_SIZE(av);
+    ndel = 0;
+    if (replace) {
+        ndel += forget_unlisted(db, av, "ap.");
+        ndel += forget_unlisted(db, av, "pat.");
+    }
+
+    db_dirty(db);
+    db_sync(db);
+    return ndel;
 }
 
 
@@ -422,11 +1083,66 @@ db_del_ap(apdb *db, const char *ap)
     DBT k = { .data = key, .size = strlen(key) };
 
     db->db->del(db->db, &k, 0);
-    db->db->sync(db->db, 0);
+    db_dirty(db);
     return 1;
 }
 
 
+/*
+ * Forget SSID pattern 'pat'.
+ */
+int
+db_del_pattern(apdb *db, const char *pat)
+{
+    char key[256];
+    snprintf(key, sizeof key, "pat.%s", pat);
+
+    DBT k = { .data = key, .size = strlen(key) };
+
+    db->db->del(db->db, &k, 0);
+    db_dirty(db);
+    return 1;
+}
+
+
+/*
+ * Call 'fp' on the SSID pattern profiles in name order, starting at
+ * the first name >= 'from' (if non-null), until it returns 0. If
+ * 'prefix' is non-null, only names that start with it are visited;
+ * as with db_walk_ap().
+ *
+ * Return the # of patterns visited.
+ */
+int
+db_walk_pat(apdb *db, const char *from, const char *prefix, db_ap_func *fp, void *ctx)
+{
+    char start[256];
+    char pfx[256];
+    DB *d = db->db;
+    DBT k, v;
+    int r, n = 0;
+
+    snprintf(pfx, sizeof pfx, "pat.%s", prefix ? prefix : "");
+    snprintf(start, sizeof start, "pat.%s", from ? from : "");
+    if (strcmp(start, pfx) < 0) strlcpy(start, pfx, sizeof start);
+
+    size_t plen = strlen(pfx);
+
+    k.data = start;
+    k.size = strlen(start);
+    for (r = d->seq(d, &k, &v, R_CURSOR); r == 0; r = d->seq(d, &k, &v, R_NEXT)) {
+        apdata x;
+
+        if (k.size < plen || 0 != memcmp(k.data, pfx, plen)) break;
+        if (unpack_apdata(&x, &v) < 0) continue;
+
+        n++;
+        if (!(*fp)(ctx, &x)) break;
+    }
+    return n;
+}
+
+
 
 void
 db_set_randmac(apdb *db, int val)
@@ -473,111 +1189,53 @@ db_set_uint(apdb *db, const char* rkey, unsigned int val)
 }
 
 
-
-static ssize_t
-fmt_ipmask(char *buf, size_t bsiz, char *fmt, int af, void *addr, void *mask)
+// Read on every node cache read; so it is cached.
+unsigned int
+db_node_ttl(apdb *db)
 {
-    char a[128];
-    char m[128];
-
-    inet_ntop(af, addr, a, sizeof a);
-    inet_ntop(af, mask, m, sizeof m);
-
-    snprintf(buf, bsiz, fmt, a, m);
-    return strlen(buf);
-}
-
-static ssize_t
-fmt_ip(char *buf, size_t bsiz, char *fmt, int af, void *addr)
-{
-    char a[128];
-
-    inet_ntop(af, addr, a, sizeof a);
-
-    snprintf(buf, bsiz, fmt, a);
-    return strlen(buf);
+    if (db->ttlgen != db->gen) {
+        db->nodettl = IFSCAND_NODE_TTL;
+        db_get_uint(db, "node-ttl", &db->nodettl);
+        db->ttlgen = db->gen;
+    }
+    return db->nodettl;
 }
 
 
+/*
+ * Copy up to 'bsiz' bytes of the opaque preference 'rkey' to 'buf'.
+ *
+ * Return its size; 0 if it doesn't exist.
+ */
 size_t
-db_ap_sprintf(char *buf, size_t bsiz, apdata *a)
+db_get_blob(apdb *db, const char *rkey, void *buf, size_t bsiz)
 {
-    size_t orig = bsiz;
-    snprintf(buf, bsiz, "nwid \"%s\"", a->apname);
-
-    ssize_t n = strlen(buf);
-    buf  += n;
-    bsiz -= n;
-
-    if (a->flags & AP_MYMAC) {
-        if (a->flags & AP_RANDMAC) {
-            snprintf(buf, bsiz, " lladdr random");
-        } else {
-            uint8_t *m = &a->mymac[0];
-            snprintf(buf, bsiz, " lladdr " MACFMT, sMAC(m));
-        }
-        n = strlen(buf);
-        buf  += n;
-        bsiz -= n;
-    }
-
-
-    if (a->flags & AP_BSSID) {
-        uint8_t *m = &a->apmac[0];
-        snprintf(buf, bsiz, " bssid " MACFMT, sMAC(m));
-        n = strlen(buf);
-        buf  += n;
-        bsiz -= n;
-    }
+    DBT d = db_get(db, rkey);
 
-    // XXX Do we show the key or not?
-    if (a->flags & AP_WPAKEY) {
-        snprintf(buf, bsiz, " using \"%s\"", a->key);
-        n = strlen(buf);
-        buf  += n;
-        bsiz -= n;
-    } else if (a->flags & AP_WEPKEY) {
-        snprintf(buf, bsiz, " nwkey \"%s\"", a->key);
-        n = strlen(buf);
-        buf  += n;
-        bsiz -= n;
-    }
+    if (!d.data) return 0;
 
-    if (a->flags & (AP_IN4|AP_IN4DHCP)) {
-        if (a->flags & AP_IN4DHCP) {
-            snprintf(buf, bsiz, " inet dhcp");
-            n = strlen(buf);
-            buf  += n;
-            bsiz -= n;
-        } else {
-            n = fmt_ipmask(buf, bsiz, " inet %s/%s", AF_INET, &a->in4, &a->mask4);
-            buf  += n;
-            bsiz -= n;
-
-            if (a->flags & AP_GW4) {
-                n = fmt_ip(buf, bsiz, " gw %s", AF_INET, &a->gw4);
-                buf  += n;
-                bsiz -= n;
-            }
-        }
-    }
+    memcpy(buf, d.data, d.size < bsiz ? d.size : bsiz);
+    return d.size;
+}
 
-    if (a->flags & AP_IN6) {
-        n = fmt_ipmask(buf, bsiz, " inet6 %s/%s", AF_INET6, &a->in6, &a->mask6);
-        buf  += n;
-        bsiz -= n;
-    }
 
-    if (a->flags & AP_GW6) {
-        n = fmt_ip(buf, bsiz, " gw6 %s", AF_INET6, &a->gw6);
-        buf  += n;
-        bsiz -= n;
-    }
+/*
+ * Blobs are our own state, not configuration; storing one doesn't
+ * change the DB generation - and doesn't invalidate what is built
+ * from the configuration (SSID filter, ap-order, patterns, cached
+ * list/get output).
+ */
+void
+db_set_blob(apdb *db, const char *rkey, const void *buf, size_t n)
+{
+    DBT d = { .data = (void *)buf, .size = n };
 
-    return orig - bsiz;
+    db_store(db, rkey, &d);
+    db_unsynced(db);
 }
 
 
+
 /*
  * Make dir if needed
  */
@@ -0,0 +1,765 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * db_log.c - append-only, log-structured store for the prefs DB
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * The store presents the same DB interface as dbopen(3) - get,
+ *   put, del, seq, sync, close - so db.c works with either one.
+ *   Keys are ordered exactly as the btree orders them.
+ *
+ * * Every put or del appends one checksummed record to the log;
+ *   nothing is ever written in place. A del appends a tombstone.
+ *
+ * * An in-memory index (sorted by key) maps each live key to the
+ *   offset of its value in the log. It is rebuilt by reading the
+ *   log at open. A record with a bad checksum (e.g., a write torn
+ *   by a crash) is skipped by searching for the next record magic.
+ *
+ * * When more than half the log is dead records, a child process
+ *   writes the live records to a new log; the parent carries on.
+ *   When the child is done, records appended meanwhile are copied
+ *   over and the new log is renamed over the old one.
+ *
+ * * The log is opened close-on-exec and forked children only close
+ *   it (db_child_close()); they never sync, close or compact it.
+ *
+ * * All users hold a shared flock(2). Compaction upgrades it to an
+ *   exclusive lock without waiting; so it only runs when no other
+ *   ifscand has the log open.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+#define LOG_MAGIC       0x31676f6c  // "log1"
+#define LOG_F_DEL       1           // record is a tombstone
+#define LOG_COMPACT_MIN (64 * 1024) // don't compact smaller logs
+
+
+/*
+ * On-disk record header; followed by 'klen' bytes of key and
+ * 'vlen' bytes of value. 'crc' covers everything after itself.
+ */
+struct logrec
+{
+    uint32_t magic;
+    uint32_t crc;
+    uint32_t vlen;
+    uint16_t klen;
+    uint16_t flags;
+};
+typedef struct logrec logrec;
+
+
+/*
+ * Index entry of a live key.
+ */
+struct logent
+{
+    uint8_t *key;
+    uint16_t klen;
+    uint32_t vlen;
+    off_t    off;       // offset of the value in the log
+};
+typedef struct logent logent;
+
+VECT_TYPEDEF(logentvect, logent);
+
+
+struct dblog
+{
+    int   fd;
+    char  fn[PATH_MAX];
+
+    logentvect idx;     // sorted by key
+    size_t     cur;     // seq() cursor
+    int        curdel;  // set if the cursor entry was deleted
+
+    off_t end;          // size of the log
+    off_t live;         // bytes of live records
+
+    pid_t compactor;    // pid of the compacting child; 0 if none
+    off_t mark;         // size of the log when it started
+
+    fast_buf val;       // holds the value last returned
+};
+typedef struct dblog dblog;
+
+
+static int log_load(dblog *l);
+
+
+static uint32_t
+log_crc(uint32_t crc, const void *buf, size_t n)
+{
+    const uint8_t *p = buf;
+    int k;
+
+    crc = ~crc;
+    while (n--) {
+        crc ^= *p++;
+        for (k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+
+static uint32_t
+rec_crc(const logrec *h, const void *key, const void *val)
+{
+    uint32_t crc = log_crc(0, &h->vlen, sizeof *h - offsetof(logrec, vlen));
+
+    crc = log_crc(crc, key, h->klen);
+    return log_crc(crc, val, h->vlen);
+}
+
+
+static inline size_t
+rec_size(size_t klen, size_t vlen)
+{
+    return sizeof(logrec) + klen + vlen;
+}
+
+
+/*
+ * Byte-wise key order; the same as the btree's default.
+ */
+static int
+keycmp(const void *a, size_t alen, const void *b, size_t blen)
+{
+    int r = memcmp(a, b, alen < blen ? alen : blen);
+
+    if (r != 0) return r;
+    return alen < blen ? -1 : alen > blen;
+}
+
+
+/*
+ * Return the index of the first entry >= 'key'; set '*found' if it
+ * is equal.
+ */
+static size_t
+idx_find(dblog *l, const void *key, size_t klen, int *found)
+{
+    size_t lo = 0,
+           hi = VECT_SIZE(&l->idx);
+
+    *found = 0;
+    while (lo < hi) {
+        size_t  mid = lo + (hi - lo) / 2;
+        logent *e   = &VECT_ELEM(&l->idx, mid);
+        int     r   = keycmp(e->key, e->klen, key, klen);
+
+        if (r == 0) {
+            *found = 1;
+            return mid;
+        }
+
+        if (r < 0) lo = mid + 1;
+        else       hi = mid;
+    }
+    return lo;
+}
+
+
+static void
+idx_del(dblog *l, size_t i)
+{
+    logent *e = &VECT_ELEM(&l->idx, i);
+    size_t  n = VECT_SIZE(&l->idx);
+
+    l->live -= rec_size(e->klen, e->vlen);
+    free(e->key);
+
+    memmove(e, e+1, (n - i - 1) * sizeof *e);
+    l->idx.size--;
+}
+
+
+/*
+ * Make 'key' point to a value of 'vlen' bytes at 'off'.
+ */
+static void
+idx_set(dblog *l, const void *key, size_t klen, size_t vlen, off_t off)
+{
+    int     found;
+    size_t  i = idx_find(l, key, klen, &found);
+    logent *e;
+
+    if (found) {
+        e = &VECT_ELEM(&l->idx, i);
+        l->live -= rec_size(e->klen, e->vlen);
+    } else {
+        size_t n = VECT_SIZE(&l->idx);
+
+        VECT_ENSURE(&l->idx, 1);
+        e = &VECT_ELEM(&l->idx, i);
+        memmove(e+1, e, (n - i) * sizeof *e);
+        l->idx.size++;
+
+        e->key  = malloc(klen ? klen : 1);
+        if (!e->key) error(1, ENOMEM, "can't index log %s", l->fn);
+        e->klen = klen;
+        memcpy(e->key, key, klen);
+    }
+
+    e->vlen  = vlen;
+    e->off   = off;
+    l->live += rec_size(klen, vlen);
+}
+
+
+/*
+ * Write one record to 'fd'.
+ *
+ * Return 0 on success, -1 on failure (with errno set).
+ */
+static int
+rec_write(int fd, const DBT *k, const DBT *v, int flags)
+{
+    struct iovec iov[3];
+    logrec h;
+    size_t vlen = v ? v->size : 0;
+
+    if (k->size > UINT16_MAX || vlen > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    h.magic = LOG_MAGIC;
+    h.vlen  = vlen;
+    h.klen  = k->size;
+    h.flags = flags;
+    h.crc   = rec_crc(&h, k->data, v ? v->data : "");
+
+    iov[0].iov_base = &h;
+    iov[0].iov_len  = sizeof h;
+    iov[1].iov_base = k->data;
+    iov[1].iov_len  = k->size;
+    iov[2].iov_base = v ? v->data : "";
+    iov[2].iov_len  = vlen;
+
+    ssize_t n = writev(fd, iov, 3);
+    if (n < 0) return -1;
+    if ((size_t)n != rec_size(k->size, vlen)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Read 'len' bytes at 'off' of 'fd' into 'b' and point 'v' at them.
+ */
+static int
+rec_read(int fd, fast_buf *b, off_t off, size_t len, DBT *v)
+{
+    fast_buf_reset(b);
+    fast_buf_ensure(b, len ? len : 1);
+
+    ssize_t n = pread(fd, fast_buf_ptr(b), len, off);
+    if (n != (ssize_t)len) {
+        if (n >= 0) errno = EIO;
+        return -1;
+    }
+
+    v->data = fast_buf_ptr(b);
+    v->size = len;
+    return 0;
+}
+
+
+/*
+ * Append a record; return the offset of its value or -1.
+ */
+static off_t
+log_append(dblog *l, const DBT *k, const DBT *v, int flags)
+{
+    if (rec_write(l->fd, k, v, flags) < 0) return -1;
+
+    // We open with O_APPEND; others may have appended too.
+    l->end = lseek(l->fd, 0, SEEK_CUR);
+    return l->end - (v ? v->size : 0);
+}
+
+
+static int
+log_value(dblog *l, const logent *e, DBT *v)
+{
+    return rec_read(l->fd, &l->val, e->off, e->vlen, v);
+}
+
+
+static int
+log_get(const DB *db, const DBT *k, DBT *v, unsigned int flags)
+{
+    dblog *l = db->internal;
+    int found;
+    size_t i = idx_find(l, k->data, k->size, &found);
+
+    (void)flags;
+    if (!found) return 1;
+
+    return log_value(l, &VECT_ELEM(&l->idx, i), v);
+}
+
+
+static int
+log_put(const DB *db, DBT *k, const DBT *v, unsigned int flags)
+{
+    dblog *l = db->internal;
+    int found;
+
+    if (flags & R_NOOVERWRITE) {
+        idx_find(l, k->data, k->size, &found);
+        if (found) return 1;
+    }
+
+    off_t off = log_append(l, k, v, 0);
+    if (off < 0) return -1;
+
+    idx_set(l, k->data, k->size, v->size, off);
+    return 0;
+}
+
+
+static int
+log_del(const DB *db, const DBT *k, unsigned int flags)
+{
+    dblog *l = db->internal;
+    DBT    key = *k;
+    int    found = 1;
+    size_t i;
+
+    if (flags == R_CURSOR) {
+        i = l->cur;
+        if (l->curdel || i >= VECT_SIZE(&l->idx)) return 1;
+
+        logent *e = &VECT_ELEM(&l->idx, i);
+
+        key.data = e->key;
+        key.size = e->klen;
+    } else {
+        i = idx_find(l, k->data, k->size, &found);
+        if (!found) return 1;
+    }
+
+    if (log_append(l, &key, 0, LOG_F_DEL) < 0) return -1;
+
+    idx_del(l, i);
+
+    // R_NEXT must not skip the entry that moved into slot 'i'
+    if (i == l->cur) l->curdel = 1;
+    else if (i < l->cur) l->cur--;
+    return 0;
+}
+
+
+static int
+log_seq(const DB *db, DBT *k, DBT *v, unsigned int flags)
+{
+    dblog *l = db->internal;
+    size_t n = VECT_SIZE(&l->idx);
+    size_t i;
+    int    found;
+
+    switch (flags) {
+        case R_CURSOR:
+            i = idx_find(l, k->data, k->size, &found);
+            break;
+
+        case R_FIRST:
+            i = 0;
+            break;
+
+        case R_LAST:
+            i = n - 1;
+            break;
+
+        case R_NEXT:
+            i = l->curdel ? l->cur : l->cur + 1;
+            break;
+
+        case R_PREV:
+            i = l->cur - 1;
+            break;
+
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    l->curdel = 0;
+    if (i >= n) return 1;     // includes wraparound of 0 - 1
+
+    logent *e = &VECT_ELEM(&l->idx, i);
+
+    l->cur  = i;
+    k->data = e->key;
+    k->size = e->klen;
+    return log_value(l, e, v);
+}
+
+
+static int
+log_sync(const DB *db, unsigned int flags)
+{
+    dblog *l = db->internal;
+
+    (void)flags;
+    return fsync(l->fd);
+}
+
+
+static int
+log_fd(const DB *db)
+{
+    dblog *l = db->internal;
+
+    return l->fd;
+}
+
+
+static void
+idx_clear(dblog *l)
+{
+    logent *e;
+
+    VECT_FOR_EACH(&l->idx, e) {
+        free(e->key);
+    }
+    VECT_RESET(&l->idx);
+    l->live = 0;
+    l->cur  = 0;
+}
+
+
+static int
+log_close(DB *db)
+{
+    dblog *l = db->internal;
+    int r;
+
+    if (l->compactor > 0) {
+        char tmp[PATH_MAX];
+
+        kill(l->compactor, SIGTERM);
+        waitpid(l->compactor, &r, 0);
+
+        snprintf(tmp, sizeof tmp, "%s.compact", l->fn);
+        unlink(tmp);
+    }
+
+    r = fsync(l->fd);
+    close(l->fd);
+
+    idx_clear(l);
+    VECT_FINI(&l->idx);
+    fast_buf_fini(&l->val);
+    free(l);
+    free(db);
+    return r;
+}
+
+
+/*
+ * Rebuild the index from the log.
+ */
+static int
+log_load(dblog *l)
+{
+    fast_buf b;
+    struct stat st;
+    size_t skipped = 0;
+
+    idx_clear(l);
+
+    if (fstat(l->fd, &st) < 0) return -errno;
+
+    fast_buf_init(&b, st.st_size ? st.st_size : 1);
+
+    size_t   sz = st.st_size;
+    uint8_t *p  = fast_buf_ptr(&b);
+    ssize_t  n  = pread(l->fd, p, sz, 0);
+
+    if (n != (ssize_t)sz) {
+        fast_buf_fini(&b);
+        return n < 0 ? -errno : -EIO;
+    }
+
+    size_t off = 0;
+    while (off + sizeof(logrec) <= sz) {
+        logrec h;
+
+        memcpy(&h, p + off, sizeof h);
+
+        size_t  rsz = rec_size(h.klen, h.vlen);
+        uint8_t *k  = p + off + sizeof h;
+
+        if (h.magic != LOG_MAGIC || h.vlen > sz || off + rsz > sz ||
+            h.crc != rec_crc(&h, k, k + h.klen)) {
+            // Torn or corrupt; look for the next record.
+            off++;
+            skipped++;
+            continue;
+        }
+
+        if (h.flags & LOG_F_DEL) {
+            int found;
+            size_t i = idx_find(l, k, h.klen, &found);
+
+            if (found) idx_del(l, i);
+        } else {
+            idx_set(l, k, h.klen, h.vlen, off + sizeof h + h.klen);
+        }
+        off += rsz;
+    }
+
+    if (skipped > 0 || off < sz)
+        printlog(LOG_WARNING, "%s: skipped %zu bytes of damaged records",
+                l->fn, skipped + (sz - off));
+
+    l->end = sz;
+    fast_buf_fini(&b);
+    return 0;
+}
+
+
+/*
+ * Child: write the live records of 'l' into 'tmp'.
+ */
+static void
+compact_child(dblog *l, const char *tmp)
+{
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    logent *e;
+
+    if (fd < 0) _exit(1);
+
+    VECT_FOR_EACH(&l->idx, e) {
+        DBT k = { .data = e->key, .size = e->klen };
+        DBT v;
+
+        if (log_value(l, e, &v) < 0)       _exit(1);
+        if (rec_write(fd, &k, &v, 0) < 0)  _exit(1);
+    }
+
+    _exit(fsync(fd) == 0 ? 0 : 1);
+}
+
+
+/*
+ * Start compacting 'l' in a child process.
+ */
+static void
+compact_start(dblog *l)
+{
+    char tmp[PATH_MAX];
+
+    if (flock(l->fd, LOCK_EX|LOCK_NB) < 0) return;   // not alone
+
+    snprintf(tmp, sizeof tmp, "%s.compact", l->fn);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        printlog(LOG_ERR, "%s: can't fork compactor: %s", l->fn, strerror(errno));
+        flock(l->fd, LOCK_SH);
+        return;
+    }
+
+    if (pid == 0) compact_child(l, tmp);
+
+    debuglog("%s: compacting %lld bytes, %lld live (pid %d)", l->fn,
+            (long long)l->end, (long long)l->live, pid);
+
+    l->compactor = pid;
+    l->mark      = l->end;
+}
+
+
+/*
+ * Copy records appended since the child started into 'tmp' and
+ * make it the log.
+ */
+static int
+compact_finish(dblog *l, const char *tmp)
+{
+    uint8_t buf[8192];
+    off_t   off = l->mark;
+    int     fd  = open(tmp, O_WRONLY|O_APPEND);
+    int     r;
+
+    if (fd < 0) return -errno;
+
+    while (off < l->end) {
+        size_t  want = l->end - off > (off_t)sizeof buf ? sizeof buf : (size_t)(l->end - off);
+        ssize_t n    = pread(l->fd, buf, want, off);
+
+        if (n <= 0 || write(fd, buf, n) != n) goto fail;
+        off += n;
+    }
+
+    if (fsync(fd) < 0)           goto fail;
+    if (rename(tmp, l->fn) < 0)  goto fail;
+
+    // 'fd' is write-only; reopen the new log like log_open() does.
+    close(fd);
+    fd = open(l->fn, O_RDWR|O_APPEND|O_CLOEXEC);
+    if (fd < 0) error(1, errno, "can't reopen compacted %s", l->fn);
+
+    flock(fd, LOCK_SH);
+    close(l->fd);
+    l->fd = fd;
+
+    r = log_load(l);
+    if (r < 0) error(1, -r, "can't load compacted %s", l->fn);
+    return 0;
+
+fail:
+    r = -errno;
+    close(fd);
+    return r ? r : -EIO;
+}
+
+
+/*
+ * Housekeeping for the log store behind 'db': reap a finished
+ * compaction or start one if the log is mostly dead records.
+ */
+void
+dblog_maint(DB *db)
+{
+    dblog *l = db->internal;
+    char tmp[PATH_MAX];
+    int st;
+
+    if (l->compactor == 0) {
+        if (l->end > LOG_COMPACT_MIN && l->live < l->end / 2) compact_start(l);
+        return;
+    }
+
+    if (waitpid(l->compactor, &st, WNOHANG) <= 0) return;
+
+    l->compactor = 0;
+    snprintf(tmp, sizeof tmp, "%s.compact", l->fn);
+
+    if (WIFEXITED(st) && WEXITSTATUS(st) == 0) {
+        off_t before = l->end;
+        int   r      = compact_finish(l, tmp);
+
+        if (r == 0) {
+            printlog(LOG_INFO, "%s: compacted %lld bytes to %lld", l->fn,
+                    (long long)before, (long long)l->end);
+            return;
+        }
+        printlog(LOG_ERR, "%s: can't install compacted log: %s", l->fn, strerror(-r));
+    } else {
+        printlog(LOG_ERR, "%s: compaction failed", l->fn);
+    }
+
+    unlink(tmp);
+    flock(l->fd, LOCK_SH);
+}
+
+
+/*
+ * Open (creating if needed) the log store 'fn' and load its index.
+ * 'flags' and 'mode' are as for open(2); O_SHLOCK is implied.
+ */
+DB *
+dblog_open(const char *fn, int flags, int mode)
+{
+    DB    *db = calloc(1, sizeof *db);
+    dblog *l  = calloc(1, sizeof *l);
+    int    r;
+
+    if (!db || !l) {
+        free(db);
+        free(l);
+        errno = ENOMEM;
+        return 0;
+    }
+
+    flags &= ~(O_SHLOCK|O_EXLOCK);
+    l->fd = open(fn, flags|O_APPEND|O_CLOEXEC, mode);
+    if (l->fd < 0) goto fail;
+
+    if (flock(l->fd, LOCK_SH) < 0) goto fail;
+
+    strlcpy(l->fn, fn, sizeof l->fn);
+    VECT_INIT(&l->idx, 64);
+    fast_buf_init(&l->val, 1024);
+
+    r = log_load(l);
+    if (r < 0) {
+        errno = -r;
+        goto fail;
+    }
+
+    db->type     = DB_BTREE;    // ordered like one
+    db->internal = l;
+    db->close    = log_close;
+    db->del      = log_del;
+    db->get      = log_get;
+    db->put      = log_put;
+    db->seq      = log_seq;
+    db->sync     = log_sync;
+    db->fd       = log_fd;
+    return db;
+
+fail:
+    r = errno;
+    if (l->fd >= 0) close(l->fd);
+    free(l);
+    free(db);
+    errno = r;
+    return 0;
+}
+
+/* EOF */
@@ -0,0 +1,221 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * defer.c - replies that are sent after the command returns
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * A handler that has to wait for the state machine (a scan, a
+ *   join) parks the reply with defer_reply() and returns. The
+ *   event loop carries on; when the awaited thing happens, the
+ *   state machine calls defer_complete() and the handler's
+ *   callback writes the reply. If it doesn't happen in time, the
+ *   callback is invoked with -ETIMEDOUT.
+ *
+ * * Deadlines are on CLOCK_MONOTONIC and are shorter than the
+ *   default timeout of ifscanctl.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+#define DEFER_MAX       16  // max # of parked replies
+
+
+struct pending
+{
+    struct sockaddr_un from;
+    int      framed;
+    uint32_t seq;
+    uint16_t part;
+    int      dropped;
+
+    int      what;          // DEFER_xxx
+    time_t   deadline;      // CLOCK_MONOTONIC seconds
+    char     arg[AP_NAMELEN];
+
+    defer_func *fp;
+};
+typedef struct pending pending;
+
+
+static pending  Pend[DEFER_MAX];
+static uint32_t Npend = 0;
+
+
+static time_t
+mono_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+
+/*
+ * Finish pending reply 'i': run its callback with 'status' and send
+ * the reply.
+ */
+static void
+pend_finish(ifstate *ifs, uint32_t i, int status)
+{
+    pending  p = Pend[i];
+    cmd_state s;
+
+    // Remove it first; the callback may park new replies.
+    Pend[i] = Pend[--Npend];
+
+    memset(&s, 0, sizeof s);
+    s.fd      = ifs->ipcfd;
+    s.from    = p.from;
+    s.framed  = p.framed;
+    s.seq     = p.seq;
+    s.part    = p.part;
+    s.dropped = p.dropped;
+    s.db      = ifs->db;
+    s.ifs     = ifs;
+
+    fast_buf_init(&s.out, IPC_DGRAMSZ);
+
+    (*p.fp)(&s, p.arg, status);
+    ipc_flush(&s, 1);
+
+    fast_buf_fini(&s.out);
+}
+
+
+/*
+ * Park the reply to the request in 's' until defer_complete(what,
+ * arg) or 'timeout' seconds pass. 'fp' writes the reply. Output
+ * already in 's->out' is sent first.
+ *
+ * Return 0 on success, -errno on failure.
+ */
+int
+defer_reply(cmd_state *s, int what, const char *arg, int timeout, defer_func *fp)
+{
+    if (Npend == DEFER_MAX) return -EBUSY;
+
+    // Send what we have so far; the rest comes later.
+    if (fast_buf_size(&s->out) > 0 && s->framed) ipc_flush(s, 0);
+
+    pending *p = &Pend[Npend++];
+
+    memset(p, 0, sizeof *p);
+    p->from     = s->from;
+    p->framed   = s->framed;
+    p->seq      = s->seq;
+    p->part     = s->part;
+    p->dropped  = s->dropped;
+    p->what     = what;
+    p->deadline = mono_now() + timeout;
+    p->fp       = fp;
+    if (arg) strlcpy(p->arg, arg, sizeof p->arg);
+
+    s->noreply = 1;
+    return 0;
+}
+
+
+/*
+ * 'what' happened (for 'arg', if non-null) with result 'status';
+ * send the replies waiting for it.
+ */
+void
+defer_complete(ifstate *ifs, int what, const char *arg, int status)
+{
+    uint32_t i = 0;
+
+    while (i < Npend) {
+        pending *p = &Pend[i];
+
+        if (p->what == what && (!arg || 0 == strcmp(arg, p->arg))) {
+            pend_finish(ifs, i, status);
+            continue;
+        }
+        i++;
+    }
+}
+
+
+/*
+ * Time out overdue replies.
+ *
+ * Return the # of seconds until the next deadline; -1 if nothing
+ * is pending.
+ */
+int
+defer_expire(ifstate *ifs)
+{
+    time_t   now  = mono_now();
+    int      next = -1;
+    uint32_t i    = 0;
+
+    while (i < Npend) {
+        pending *p = &Pend[i];
+
+        if (p->deadline <= now) {
+            pend_finish(ifs, i, -ETIMEDOUT);
+            continue;
+        }
+
+        int d = p->deadline - now;
+        if (next < 0 || d < next) next = d;
+        i++;
+    }
+    return next;
+}
+
+
+/*
+ * Return true if a reply is waiting for 'what'.
+ */
+int
+defer_waiting(int what)
+{
+    uint32_t i;
+
+    for (i = 0; i < Npend; i++) {
+        if (Pend[i].what == what) return 1;
+    }
+    return 0;
+}
+
+/* EOF */
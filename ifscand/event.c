@@ -0,0 +1,421 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * event.c - live event stream for "watch" subscribers
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * A subscriber is the peer that sent "watch". Events are sent to
+ *   it as fragments of the never ending reply to that request; one
+ *   event per fragment, one line per event:
+ *
+ *      TIME TYPE [key=value ...]
+ *
+ * * Delivery never blocks: every send is MSG_DONTWAIT. If the
+ *   subscriber's socket buffer is full, the event is queued; if
+ *   the queue is full, the event is dropped and counted. The next
+ *   event delivered after a drop is preceded by "dropped n=N".
+ *
+ * * Fragment numbers are assigned when a datagram is actually
+ *   sent, so a subscriber never sees a gap in the fragment
+ *   sequence - only "dropped" lines.
+ *
+ * * A subscriber whose socket has gone away is removed on the next
+ *   send. "unwatch" removes it explicitly.
+ *
+ * * When nobody is watching, event_post() returns before formatting
+ *   anything.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+#define EV_MAXSUBS      8       // max # of subscribers
+#define EV_QLEN         32      // max # of queued events per subscriber
+#define EV_MSGSZ        256     // max length of one event line
+
+
+struct evmsg
+{
+    uint16_t len;
+    char     buf[EV_MSGSZ];
+};
+typedef struct evmsg evmsg;
+
+
+struct evsub
+{
+    struct sockaddr_un peer;
+    uint32_t seq;       // seq# of the "watch" request
+    uint16_t part;      // next fragment#
+
+    uint64_t dropped;   // total # of events dropped
+    uint64_t unreported;// # of drops not yet told to the peer
+    uint64_t sent;      // total # of events delivered
+
+    // ring of events waiting for the peer's buffer to drain
+    uint32_t rd, n;
+    evmsg    q[EV_QLEN];
+};
+typedef struct evsub evsub;
+
+
+static evsub   *Subs[EV_MAXSUBS];
+static uint32_t Nsubs   = 0;
+static uint64_t Dropped = 0;    // drops of all subscribers, past and present
+static int      Evfd    = -1;
+
+
+/*
+ * Send one datagram to 'e'.
+ *
+ * Return:
+ *    1  sent
+ *    0  peer is busy; try later
+ *    -errno if the peer is gone
+ */
+static int
+ev_send(evsub *e, const char *buf, size_t n, int end)
+{
+    uint8_t pkt[IPC_DGRAMSZ];
+    ipc_hdr h;
+
+    if (n > IPC_MAXDATA) n = IPC_MAXDATA;
+
+    h.magic = IPC_MAGIC;
+    h.seq   = e->seq;
+    h.part  = e->part;
+    h.flags = end ? IPC_F_END : 0;
+
+    memcpy(pkt, &h, sizeof h);
+    memcpy(pkt + sizeof h, buf, n);
+
+    while (1) {
+        ssize_t m = sendto(Evfd, pkt, n + sizeof h, MSG_DONTWAIT|MSG_NOSIGNAL,
+                           (struct sockaddr *)&e->peer, sizeof e->peer);
+        if (m >= 0) break;
+
+        switch (errno) {
+            case EINTR:
+                continue;
+
+            case EAGAIN:
+            case ENOBUFS:
+                return 0;
+
+            default:
+                return -errno;
+        }
+    }
+
+    e->part++;
+    return 1;
+}
+
+
+static void
+ev_del(uint32_t i)
+{
+    evsub *e = Subs[i];
+
+    debuglog("event: removing subscriber %s (sent %llu, dropped %llu)",
+            e->peer.sun_path, (unsigned long long)e->sent, (unsigned long long)e->dropped);
+
+    free(e);
+    Subs[i] = Subs[--Nsubs];
+    Subs[Nsubs] = 0;
+}
+
+
+static void
+ev_enq(evsub *e, const char *buf, size_t n)
+{
+    evmsg *m = &e->q[(e->rd + e->n) % EV_QLEN];
+
+    memcpy(m->buf, buf, n);
+    m->len = n;
+    e->n++;
+}
+
+
+/*
+ * Send as much of the queue of 'e' as the peer will take.
+ *
+ * Return 0 on success, -errno if the peer is gone.
+ */
+static int
+ev_drain(evsub *e)
+{
+    while (e->n > 0) {
+        evmsg *m = &e->q[e->rd];
+        int    r = ev_send(e, m->buf, m->len, 0);
+
+        if (r <= 0) return r;
+
+        e->sent++;
+        e->rd = (e->rd + 1) % EV_QLEN;
+        e->n--;
+    }
+    return 0;
+}
+
+
+/*
+ * Queue event 'buf' for 'e' and send what we can.
+ */
+static int
+ev_deliver(evsub *e, const char *buf, size_t n)
+{
+    if (e->unreported > 0) {
+        if ((EV_QLEN - e->n) < 2) goto drop;
+
+        char d[64];
+        int  k = snprintf(d, sizeof d, "%lld dropped n=%llu\n",
+                          (long long)time(0), (unsigned long long)e->unreported);
+
+        ev_enq(e, d, k);
+        e->unreported = 0;
+    }
+
+    if (e->n == EV_QLEN) goto drop;
+
+    ev_enq(e, buf, n);
+    return ev_drain(e);
+
+drop:
+    e->dropped++;
+    e->unreported++;
+    Dropped++;
+    return ev_drain(e);
+}
+
+
+void
+event_init(int fd)
+{
+    Evfd = fd;
+}
+
+
+/*
+ * Return true if anyone is watching.
+ */
+int
+event_active(void)
+{
+    return Nsubs > 0;
+}
+
+
+/*
+ * Post an event of 'type'; 'fmt' describes the rest of the line.
+ */
+void
+event_post(const char *type, const char *fmt, ...)
+{
+    char buf[EV_MSGSZ];
+    va_list ap;
+    int n;
+    uint32_t i;
+
+    if (Nsubs == 0) return;
+
+    n = snprintf(buf, sizeof buf, "%lld %s", (long long)time(0), type);
+    if (fmt && n < (int)sizeof buf - 2) {
+        buf[n++] = ' ';
+
+        va_start(ap, fmt);
+        vsnprintf(buf+n, (sizeof buf) - n, fmt, ap);
+        va_end(ap);
+        n = strlen(buf);
+    }
+
+    // Always end with a newline; truncate if needed.
+    if (n > (int)sizeof buf - 2) n = sizeof buf - 2;
+    buf[n++] = '\n';
+    buf[n]   = 0;
+
+    i = 0;
+    while (i < Nsubs) {
+        if (ev_deliver(Subs[i], buf, n) < 0) {
+            ev_del(i);
+            continue;
+        }
+        i++;
+    }
+}
+
+
+/*
+ * Return true if any subscriber has events queued that its peer
+ * hasn't taken yet.
+ */
+int
+event_pending(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < Nsubs; i++) {
+        if (Subs[i]->n > 0) return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Retry queued events of all subscribers. Called from the event
+ * loop; while event_pending() is true, at least every
+ * IPC_RETRY_MS.
+ */
+void
+event_drain(void)
+{
+    uint32_t i = 0;
+
+    while (i < Nsubs) {
+        if (ev_drain(Subs[i]) < 0) {
+            ev_del(i);
+            continue;
+        }
+        i++;
+    }
+}
+
+
+static int
+ev_find(const struct sockaddr_un *peer)
+{
+    uint32_t i;
+
+    for (i = 0; i < Nsubs; i++) {
+        if (0 == strcmp(Subs[i]->peer.sun_path, peer->sun_path)) return i;
+    }
+    return -1;
+}
+
+
+/*
+ * Make the sender of the request in 's' a subscriber. The pending
+ * output in 's->out' is sent as the first fragment of the stream.
+ *
+ * Return 0 on success, -errno on failure.
+ */
+int
+event_subscribe(cmd_state *s)
+{
+    evsub *e;
+    int i;
+
+    if (!s->framed) return -EPROTONOSUPPORT;
+
+    if ((i = ev_find(&s->from)) >= 0) ev_del(i);
+    if (Nsubs == EV_MAXSUBS) return -EBUSY;
+
+    e = calloc(1, sizeof *e);
+    if (!e) return -ENOMEM;
+
+    e->peer = s->from;
+    e->seq  = s->seq;
+
+    Subs[Nsubs++] = e;
+
+    debuglog("event: new subscriber %s", e->peer.sun_path);
+
+    size_t n = fast_buf_size(&s->out);
+    if (n > EV_MSGSZ) n = EV_MSGSZ;
+
+    if (ev_deliver(e, (char *)fast_buf_ptr(&s->out), n) < 0) {
+        ev_del(Nsubs-1);
+    }
+    fast_buf_reset(&s->out);
+    return 0;
+}
+
+
+/*
+ * Remove the sender of 's' from the subscribers.
+ *
+ * Return 1 if it was a subscriber, 0 otherwise.
+ */
+int
+event_unsubscribe(cmd_state *s)
+{
+    int i = ev_find(&s->from);
+
+    if (i < 0) return 0;
+
+    evsub *e = Subs[i];
+
+    ev_send(e, "", 0, 1);
+    ev_del(i);
+    return 1;
+}
+
+
+/*
+ * Return the # of subscribers and the # of events dropped so far.
+ */
+void
+event_stats(uint32_t *nsubs, uint64_t *dropped)
+{
+    *nsubs   = Nsubs;
+    *dropped = Dropped;
+}
+
+
+/*
+ * End every stream; called on shutdown.
+ */
+void
+event_fini(void)
+{
+    char buf[64];
+    int  n = snprintf(buf, sizeof buf, "%lld shutdown\n", (long long)time(0));
+
+    while (Nsubs > 0) {
+        evsub *e = Subs[0];
+
+        ev_drain(e);
+        ev_send(e, buf, n, 1);
+        ev_del(0);
+    }
+}
+
+/* EOF */
@@ -72,8 +72,6 @@ ifstate_init(ifstate *ifs, const char* ifname)
 
     memset(ifs, 0, sizeof *ifs);
 
-    VECT_INIT(&ifs->nv, 16);
-
     strlcpy(ifr->ifr_name, ifname, sizeof ifr->ifr_name);
     strlcpy(ifs->ifname,   ifname, sizeof ifs->ifname);
 
@@ -136,7 +134,7 @@ ifstate_close(ifstate *ifs)
     if (ifs->down) ifstate_set(ifs, 0);
 
     close(ifs->scanfd);
-    VECT_FINI(&ifs->nv);
+    snap_put(ifs->snap);
     memset(ifs, 0, sizeof *ifs);
 }
 
@@ -191,22 +189,23 @@ is11n(const struct ieee80211_nodereq *a)
 
 
 /*
- * Scan the given interface and populate ifs->nv
+ * Read the driver's node cache of the given interface into 'nv',
+ * sorted by RSSI.
+ *
+ * The nodes read are merged with the ones seen in the last
+ * "node-ttl" seconds (see nodetab.c); 'nv' has all of them.
  *
  * Returns:
  *   < 0 -errno on error
- *   >= 0 # of nodes scanned
+ *   >= 0 # of nodes in 'nv'
  */
 int
-ifstate_scan(ifstate *ifs)
+ifstate_nodes(ifstate *ifs, nodevect *nv)
 {
-    int i;
+    size_t n;
     struct ieee80211_nodereq_all na;
     struct ieee80211_nodereq nr[512];
-    nodevect *nv = &ifs->nv;
 
-    VECT_RESET(nv);
-    
     memset(&na, 0, sizeof na);
     memset(nr,  0, sizeof nr);
 
@@ -217,15 +216,35 @@ ifstate_scan(ifstate *ifs)
 
     if (ioctl(ifs->scanfd, SIOCG80211ALLNODES, &na) != 0) return -errno;
 
-    if (na.na_nodes == 0) return 0;
+    n = nodetab_merge(nr, na.na_nodes, db_node_ttl(ifs->db), nv);
+
+    VECT_SORT(nv, rssicmp);
+    return n;
+}
+
 
-    VECT_RESERVE(nv, na.na_nodes);
-    for (i = 0; i < na.na_nodes; i++) {
-        VECT_APPEND(nv, nr[i]);
+/*
+ * Scan the given interface and publish the results as a new
+ * snapshot. Readers of the previous snapshot are unaffected.
+ *
+ * Returns:
+ *   < 0 -errno on error
+ *   >= 0 # of nodes in the snapshot
+ */
+int
+ifstate_scan(ifstate *ifs)
+{
+    scansnap *snap = snap_new();
+    int r;
+
+    if ((r = ifstate_nodes(ifs, &snap->nv)) < 0) {
+        snap_put(snap);
+        return r;
     }
 
-    VECT_SORT(nv, rssicmp);
-    return na.na_nodes;
+    snap->fresh = ascan_fresh();
+    snap_publish(ifs, snap);
+    return r;
 }
 
 
@@ -247,90 +266,6 @@ ifstate_get_rssi(ifstate *ifs, const char* apname, const uint8_t *mac)
 }
 
 
-/*
- * Printable form of scanned result
- */
-ssize_t
-ifstate_sprintf_node(char * buf, size_t  bsiz, struct ieee80211_nodereq *nr)
-{
-    size_t orig = bsiz;
-    int i;
-
-#define PR(a, ...)   do { \
-                        ssize_t m = snprintf(buf, bsiz, a, ##__VA_ARGS__); \
-                        buf  += m; \
-                        bsiz -= m; \
-                    } while (0)
-
-    if (nr->nr_flags & IEEE80211_NODEREQ_AP ||
-        nr->nr_capinfo & IEEE80211_CAPINFO_IBSS) {
-
-        uint8_t *mac = nr->nr_bssid;
-        char zz[IEEE80211_NWID_LEN+1];
-
-        copy_apname(zz, IEEE80211_NWID_LEN, nr);
-
-        PR("nwid \"%s\" chan %u bssid " MACFMT, zz, nr->nr_channel, sMAC(mac));
-    }
-
-    if ((nr->nr_flags & IEEE80211_NODEREQ_AP) == 0) {
-        uint8_t *mac = nr->nr_macaddr;
-        PR(" lladdr " MACFMT, sMAC(mac));
-    }
-
-    if (nr->nr_max_rssi)
-        PR(" %u%% ", IEEE80211_NODEREQ_RSSI(nr));
-    else
-        PR(" %ddBm ", nr->nr_rssi);
-
-    if (nr->nr_pwrsave) PR(" powersave");
-
-    if ((nr->nr_flags & (IEEE80211_NODEREQ_AP)) == 0) {
-        if (nr->nr_flags & IEEE80211_NODEREQ_HT) {
-            PR("HT-MCS%d ", nr->nr_txmcs);
-        } else
-            if (nr->nr_nrates) {
-                PR(" %uM ", (nr->nr_rates[nr->nr_txrate] & IEEE80211_RATE_VAL) / 2);
-            }
-    } else if (nr->nr_max_rxrate) {
-        PR(" %uM HT ", nr->nr_max_rxrate);
-    } else if (nr->nr_rxmcs[0] != 0) {
-        for (i = IEEE80211_HT_NUM_MCS - 1; i >= 0; i--) {
-            if (isset(nr->nr_rxmcs, i))
-                break;
-        }
-        PR(" HT-MCS%d ", i);
-    } else if (nr->nr_nrates) {
-        PR(" %uM ", (nr->nr_rates[nr->nr_nrates - 1] & IEEE80211_RATE_VAL) / 2);
-    }
-
-    /* ESS is the default, skip it */
-    nr->nr_capinfo &= ~IEEE80211_CAPINFO_ESS;
-    if (nr->nr_capinfo) {
-        //printb_status(nr->nr_capinfo, IEEE80211_CAPINFO_BITS);
-        if (nr->nr_capinfo & IEEE80211_CAPINFO_PRIVACY) {
-            if (nr->nr_rsnciphers & IEEE80211_WPA_CIPHER_CCMP)
-                PR(" wpa2");
-            else if (nr->nr_rsnciphers & IEEE80211_WPA_CIPHER_TKIP)
-                PR(" wpa1");
-            else
-                PR(" wep");
-
-            if (nr->nr_rsnakms & IEEE80211_WPA_AKM_8021X ||
-                nr->nr_rsnakms & IEEE80211_WPA_AKM_SHA256_8021X)
-                PR(",802.1x");
-        }
-    }
-#if 0
-    if ((nr->nr_flags & IEEE80211_NODEREQ_AP) == 0)
-        printb_status(IEEE80211_NODEREQ_STATE(nr->nr_state),
-            IEEE80211_NODEREQ_STATE_BITS);
-#endif
-
-    return orig - bsiz;
-}
-
-
 /*
  * Configure the wifi interface:
  *
@@ -664,6 +599,16 @@ wait_config(ifstate *ifs, apdata *z)
 #define BSSID_WAIT_MS   150
 
 
+/*
+ * Return true if the current join attempt has run out of time.
+ */
+static inline int
+join_expired(ifstate *ifs)
+{
+    return ifs->joindeadline > 0 && mono_ms() >= ifs->joindeadline;
+}
+
+
 /*
  * Wait until interface is truly up.
  *
@@ -690,6 +635,8 @@ wait_up(ifstate *ifs)
             return 1;
         }
 
+        if (join_expired(ifs)) return -ETIMEDOUT;
+
         // wait for .5 seconds before trying again
         usleep(IFUP_WAIT_MS * 1000);
     }
@@ -719,6 +666,8 @@ wait_media(ifstate *ifs)
             debuglog("media configured after %u ms", tries * MEDIA_WAIT_MS);
             return 1;
         }
+        if (join_expired(ifs)) return -ETIMEDOUT;
+
         usleep(MEDIA_WAIT_MS * 1000);
     }
     return -ENETDOWN;
@@ -752,6 +701,8 @@ wait_bssid(ifstate *ifs, uint8_t *bssid)
             return 1;
         }
 
+        if (join_expired(ifs)) return -ETIMEDOUT;
+
         // wait for .5 seconds before trying again
         usleep(BSSID_WAIT_MS * 1000);
     }
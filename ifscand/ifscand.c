@@ -33,6 +33,7 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <poll.h>
 #include <syslog.h>
@@ -61,12 +62,10 @@ volatile uint32_t   Sig  = 0;
 int  Debug       = 0;
 int  Foreground  = 0;
 int  Linklayer   = 0;
+int  Backend     = DB_BACKEND_BTREE;
 
 static int opensock(const char *fn);
-static int sockready(int fd, int wr, int delay);
-
-static ssize_t sockread(int fd, fast_buf* b, struct sockaddr_un *);
-static ssize_t sockwrite(int fd, fast_buf* b, struct sockaddr_un *);
+static int sockready(int fd, int xfd, int64_t ms);
 
 /*
  * Long and short options.
@@ -77,9 +76,10 @@ static const struct option Lopt[] = {
     {"debug",       no_argument, 0, 'd'},
     {"foreground",  no_argument, 0, 'f'},
     {"no-network",  no_argument, 0, 'N'},
+    {"backend",     required_argument, 0, 'B'},
     {0, 0, 0, 0}
 };
-static const char Sopt[] = "hvdfN";
+static const char Sopt[] = "hvdfNB:";
 
 static void
 sighandle(int sig)
@@ -105,6 +105,7 @@ usage()
            "  --debug, -d       Run in debug mode (extra logs)\n"
            "  --foreground, -f  Don't daemonize into the background\n"
            "  --no-network, -N  Don't configure any IP address\n"
+           "  --backend=B, -B B Store prefs in a 'btree' or a 'log' [btree]\n"
            "  --version, -v     Show program version and quit\n"
            "  --help, -h        Show this help message and quit\n",
            program_name, program_name);
@@ -152,6 +153,12 @@ main(int argc, char * const* argv)
             case 'N':
                 Linklayer = 1;
                 break;
+
+            case 'B':
+                if      (0 == strcmp(optarg, "btree")) Backend = DB_BACKEND_BTREE;
+                else if (0 == strcmp(optarg, "log"))   Backend = DB_BACKEND_LOG;
+                else error(1, 0, "unknown backend %s; use 'btree' or 'log'", optarg);
+                break;
         }
     }
 
@@ -167,7 +174,8 @@ main(int argc, char * const* argv)
 
     initlog(ifname);
 
-    db_init(&db, ifname);
+    db_init(&db, ifname, Backend);
+    joinhist_init(&db);
 
     int r = ifstate_init(&ifs, ifname);
     if (r < 0) error(1, -r, "can't initialize %s", ifname);
@@ -196,7 +204,7 @@ main(int argc, char * const* argv)
     //if (pledge("stdio rpath ioctl") < 0) error(1, errno, "can't pledge");
 
     printlog(LOG_INFO, "starting daemon for %s..", ifname);
-    printlog(LOG_INFO, "Listening on %s, prefs in %s.db", ifs.sockpath, IFSCAND_PREFS);
+    printlog(LOG_INFO, "Listening on %s, prefs in %s", ifs.sockpath, db.fn);
 
 
     /* Run state machine on startup -- scan and setup before
@@ -205,50 +213,117 @@ main(int argc, char * const* argv)
     wifi_scan(&ifs);
 
     /*
-     * Now, run every scan-interval seconds
+     * Now, run every scan-interval seconds. Commands don't run the
+     * state machine directly; they only ask for an earlier scan
+     * (see 'kick' below). So, no amount of control traffic can make
+     * us scan more than once every IFSCAND_KICK_MS.
      */
-    int delay   = ifs.timeout;
-    int fd      = ifs.ipcfd;
-    int errs    = 0;
+    int     delay     = ifs.timeout;
+    int     fd        = ifs.ipcfd;
+    int     errs      = 0;
+    int64_t lastscan  = mono_ms();
+    int64_t nextscan  = lastscan + delay * 1000;
+    int     i;
     cmd_state s = { .fd = fd, .db  = &db, .ifs = &ifs };
 
-    fast_buf_init(&s.in, 2048);
-    fast_buf_init(&s.out, 65536);
+    fast_buf_init(&s.in,  IPC_DGRAMSZ);
+    fast_buf_init(&s.out, IPC_DGRAMSZ);
+
+    event_init(fd);
 
     printlog(LOG_INFO, "scanning %s every %d seconds ...", ifname, delay);
 
     while (1) {
-        r = sockready(fd, 0, delay);
+        int64_t wait = nextscan - mono_ms();
+
+        // Wake up in time for replies that are due.
+        int due = defer_expire(&ifs);
+        if (due >= 0 && (due * 1000) < wait) wait = due * 1000;
+
+        // ... and in time to sync updates to the DB.
+        int64_t sync = db_sync_due(&db);
+        if (sync >= 0 && sync < wait) wait = sync;
+
+        // ... and in time to give up on an active scan.
+        int64_t ascan = ascan_due();
+        if (ascan >= 0 && ascan < wait) wait = ascan;
+
+        // ... and soon if replies or events are waiting for slow
+        // readers.
+        if ((ipc_pending() || event_pending()) && wait > IPC_RETRY_MS)
+            wait = IPC_RETRY_MS;
+
+        // Don't sleep if requests are waiting for their turn.
+        if (admit_pending() || wait < 0) wait = 0;
+
+        r = sockready(fd, ascan_fd(), wait);
 
         if (Quit) break;
 
-        if (r > 0) { // fd  is valid and we have a new connection.
-            ssize_t m = sockread(fd, &s.in, &s.from);
-            if (m > 0) {
-                debuglog("processing I/O from control program..");
-                cmd_process(&s);
-                if (fast_buf_size(&s.out) > 0) sockwrite(fd, &s.out, &s.from);
+        // The state machine waits for an active scan to finish.
+        if (ascan_finish(&ifs)) nextscan = mono_ms();
 
-                fast_buf_reset(&s.in);
-                fast_buf_reset(&s.out);
-            }
+        // The world may have changed while we were suspended.
+        if (ascan_resumed()) ascan_start(&ifs, "resume");
+
+        // Before serving requests, so they see a new catalog.
+        db_maint(&db);
+
+        /*
+         * Read what is waiting - but only so much that a flood
+         * can't keep us from the requests already queued.
+         */
+        for (i = 0; r > 0 && (r & 1) && i < ADMIT_MAXREAD; i++) {
+            int k = ipc_recv(&s);
+
+            if (k < 0) break;
+            if (k > 0) admit_enqueue(&s);
+        }
+
+        // Serve a bounded number of requests, round robin.
+        for (i = 0; i < ADMIT_BUDGET && admit_next(&s); i++) {
+            debuglog("processing I/O from control program..");
+
+            s.noreply = 0;
+            s.kick    = 0;
+            cmd_process(&s);
+            if (!s.noreply) ipc_flush(&s, 1);
+
+            fast_buf_reset(&s.in);
+            fast_buf_reset(&s.out);
 
             /*
-             * We may have added a new AP. So, scan regardless.
+             * We may have added a new AP. So, scan soon.
              */
-        } 
+            if (s.kick && nextscan > (lastscan + IFSCAND_KICK_MS))
+                nextscan = lastscan + IFSCAND_KICK_MS;
+        }
+
+        if (Quit) break;
 
+        if (mono_ms() >= nextscan) {
 #define MAXERRS 5
-        if (wifi_scan(&ifs) < 0) {
-            if (++errs >= MAXERRS && !Debug) {
-                printlog(LOG_ERR, "Too many consecutive errors; aborting!");
-                break;
+            if (wifi_scan(&ifs) < 0) {
+                if (++errs >= MAXERRS && !Debug) {
+                    printlog(LOG_ERR, "Too many consecutive errors; aborting!");
+                    break;
+                }
+            } else {
+                errs  = 0;
+                delay = ifs.timeout;
             }
-        } else {
-            errs  = 0;
-            delay = ifs.timeout;
+
+            lastscan = mono_ms();
+            nextscan = lastscan + delay * 1000;
         }
 
+        // Retry replies and events that slow peers couldn't take.
+        ipc_drain(fd);
+        event_drain();
+
+        // Sync DB updates as a group; never more often than this.
+        if (db_sync_due(&db) == 0) db_sync(&db);
+
         /*
          * Check after we handle any commands and/or statemachine
          * stuff. e.g., we may have received a "down" command.
@@ -261,9 +336,11 @@ main(int argc, char * const* argv)
     else
         printlog(LOG_INFO, "Ending daemon for %s..", ifname);
 
-    close(fd);
+    ascan_stop();
     ifstate_unconfig(&ifs);
-    disconnect_ap(&ifs, &ifs.curap);
+    disconnect_ap(&ifs, &ifs.curap, "shutdown");
+    event_fini();
+    close(fd);
     ifstate_close(&ifs);
     db_close(&db);
     unlink(ifs.sockpath);
@@ -375,6 +452,12 @@ opensock(const char *fn)
 
     if (listen(fd, 5) < 0) error(1, errno, "can't listen on socket %s", fn);
 
+    // Room for a burst of fragments; slow readers are queued anyway.
+    int sz = IPC_SOCKBUF;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof sz) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sz, sizeof sz) < 0)
+        printlog(LOG_WARNING, "can't size buffers of socket %s: %s", fn, strerror(errno));
+
     /*
      * Make it writable atleast by the group.
      *
@@ -390,102 +473,40 @@ opensock(const char *fn)
 
 
 /*
- * Wait for 'fd' to be I/O ready. If 'wr' is true, then wait for
- * IO-WRITE-READY, else IO-READ_READY. In either case, don't wait
- * for more than 'delay' SECONDS.
+ * Wait for 'fd' or 'xfd' (if it isn't -1) to be read-ready; don't
+ * wait for more than 'ms' milliseconds.
  *
  * Return:
  *   0 on timeout
- *   > 0 on ready
+ *   > 0 on ready: bit 0 for 'fd', bit 1 for 'xfd'
  *   EOF on socket close
  */
 static int
-sockready(int fd, int wr, int delay)
+sockready(int fd, int xfd, int64_t ms)
 {
-    struct pollfd fds[1];
-    struct pollfd *f = &fds[0];
+    struct pollfd fds[2];
+    int n = 1;
     int r;
 
-    f->fd      = fd;
-    f->events  = POLLHUP | (wr ? POLLOUT: POLLIN);
-    f->revents = 0;
+    fds[0].fd      = fd;
+    fds[0].events  = POLLHUP | POLLIN;
+    fds[0].revents = 0;
+
+    if (xfd >= 0) {
+        fds[1].fd      = xfd;
+        fds[1].events  = POLLIN;
+        fds[1].revents = 0;
+        n++;
+    }
 
-    r = poll(fds, 1, delay *1000);
+    r = poll(fds, n, ms > INT_MAX ? INT_MAX : (int)ms);
     if (r == 0) return 0;   // timeout
     if (r < 0)  return -errno;
 
-    if (f->revents & POLLHUP) return EOF;  // socket closed
-
-    return 1;
-}
-
-
-/*
- * Wake up socket with a dummy write.
- */
-void
-sockwake(ifstate *ifs, fast_buf *b)
-{
-    struct sockaddr_un un;
-
-    un.sun_family = AF_UNIX;
-    strlcpy(un.sun_path, ifs->sockpath, sizeof un.sun_path);
-
-    sockwrite(ifs->ipcfd, b, &un);
-}
-
-/*
- * Read from a DGRAM socket into fastbuf 'b'.
- *
- * Will implicitly read from b->ptr.
- *
- * Return:
- *     0 on EOF
- *     > 0  number of bytes read
- *     -errno on error
- */
-static ssize_t
-sockread(int fd, fast_buf *b, struct sockaddr_un *from)
-{
-    uint8_t *p = fast_buf_endptr(b);
-    size_t   n = fast_buf_avail(b) - 1; // null terminate the string
-    socklen_t len = sizeof *from;
-
-    ssize_t m = recvfrom(fd, p, n, MSG_DONTWAIT, (struct sockaddr *)from, &len);
-    if (m == -1) return -errno;
-
-    p[m] = 0;
-    fast_buf_advance(b, m);
-
-    return m;
-}
-
-
-/*
- * Write to a DGRAm socket with data in 'b' to destination 'to'
- *
- * Will implicitly read from b->ptr.
- *
- * Return:
- *     0 on EOF
- *     > 0  number of bytes read
- *     -errno on error
- */
-static ssize_t
-sockwrite(int fd, fast_buf *b, struct sockaddr_un *to)
-{
-    uint8_t *p = fast_buf_ptr(b);
-    size_t   n = fast_buf_size(b);
-
-    while (n > 0) {
-        ssize_t m = sendto(fd, p, n, MSG_NOSIGNAL, (struct sockaddr *)to, sizeof *to);
-        if (m == -1) {
-            if (errno == EINTR || errno == EAGAIN) continue;
-            return -errno;
-        }
-        p += m;
-        n -= m;
-    }
+    if (fds[0].revents & POLLHUP) return EOF;  // socket closed
 
-    return fast_buf_size(b);
+    r = 0;
+    if (fds[0].revents) r |= 1;
+    if (n > 1 && fds[1].revents) r |= 2;
+    return r;
 }
@@ -49,6 +49,7 @@ extern "C" {
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <time.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <db.h>
@@ -59,6 +60,15 @@ extern "C" {
 
 #define IFSCAND_INT_SCAN        60  /* Scan interval between successive scans */
 #define IFSCAND_INT_RSSI_FAST   10  /* Fast Scan interval between successive rssi measurements */
+#define IFSCAND_INT_MAX         (60 * 60) /* Largest configurable interval */
+#define IFSCAND_KICK_MS         1000 /* Min ms between scans asked for by commands */
+#define IFSCAND_SYNC_MS         2000 /* Max ms an update to the DB stays unsynced */
+#define IFSCAND_DB_CACHE        (1024 * 1024) /* Bytes of DB pages kept in memory */
+#define IFSCAND_ASCAN_MS        6000  /* Max ms for an active scan; less than IFSCAND_DEFER_TIMEOUT */
+#define IFSCAND_FRESH_MS        2000  /* Max ms after an active scan that the node cache is fresh */
+#define IFSCAND_NODE_TTL        30    /* Secs a scanned node is remembered after it was last seen */
+#define IFSCAND_JOIN_TRY_MS     11000 /* Max ms for one join attempt; the waits in ifcfg.c give up after ~10.5s */
+#define IFSCAND_JOIN_BUDGET_MS  24000 /* Max ms for all join attempts of one scan; see below */
 
 
 /*
@@ -67,17 +77,184 @@ extern "C" {
 #define IFSCAND_RSSI_LOWEST     8
 
 
-/* Handy formats for printing mac address */
-#define sMAC(x)     x[0],x[1],x[2],x[3],x[4],x[5]
-#define MACFMT      "%02x:%02x:%02x:%02x:%02x:%02x"
+/*
+ * 64-bit FNV-1a hash of 'n' bytes.
+ */
+static inline uint64_t
+fnv64(const void *buf, size_t n)
+{
+    const uint8_t *p = buf;
+    uint64_t h = 14695981039346656037ULL;
+
+    while (n--) {
+        h ^= *p++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+/*
+ * Bloom filter of byte strings; see bloom.c.
+ */
+struct bloom
+{
+    uint64_t *bits;
+    uint32_t  mask;     // # of bits - 1
+    uint32_t  nkeys;
+};
+typedef struct bloom bloom;
+
+void bloom_init(bloom *, size_t nkeys);
+void bloom_fini(bloom *);
+void bloom_add(bloom *, const void *key, size_t n);
+int  bloom_maybe(const bloom *, const void *key, size_t n);
+
+
+/*
+ * ap-order compiled into a table of AP name -> rank; see rankmap.c.
+ */
+struct rankmap
+{
+    char     *names;    // copy of the order; NUL separated
+    uint32_t *off;      // offset in 'names' of the name of each rank
+    uint32_t *slot;     // 1 + rank of the name hashed here; 0 if empty
+    uint32_t  mask;     // # of slots - 1
+    uint32_t  n;        // # of ranked names
+};
+typedef struct rankmap rankmap;
+
+#define RANK_NONE   UINT32_MAX
+
+void     rankmap_init(rankmap *, const char *buf, size_t len);
+void     rankmap_fini(rankmap *);
+uint32_t rankmap_get(const rankmap *, const char *name);
+
+
+/*
+ * Set of SSID glob patterns, compiled for matching; see pattern.c.
+ */
+struct patnode
+{
+    uint32_t child;     // first child; 0 if none
+    uint32_t next;      // next sibling; 0 if none
+    uint32_t pats;      // 1 + index of the first pattern filed here
+    uint8_t  c;
+};
+typedef struct patnode patnode;
+
+struct patent
+{
+    char    *pat;
+    uint32_t lit;       // # of literal chars; more is more specific
+    uint32_t next;      // 1 + index of the next pattern on the chain
+    int      plain;     // matches by reaching its node
+};
+typedef struct patent patent;
+
+VECT_TYPEDEF(patnodevect, patnode);
+VECT_TYPEDEF(patentvect, patent);
+
+struct patset
+{
+    patnodevect nodes;  // [0] is the prefix root, [1] the suffix root
+    patentvect  ents;
+    uint32_t    rest;   // chain of patterns with no literal ends
+};
+typedef struct patset patset;
+
+void patset_init(patset *);
+void patset_fini(patset *);
+void patset_add(patset *, const char *pat);
+const char *patset_match(const patset *, const char *ssid);
 
 
 /*
- * AP and Preferences DB
+ * Read-only, memory mapped catalog of APs; see catalog.c.
  */
+struct catalog
+{
+    const uint8_t     *base;   // mapped file; null if none
+    size_t             size;
+    uint32_t           n;      // # of entries
+    uint32_t           gen;    // from the header
+    uint64_t           hash;
+    const catalog_ent *ent;
+
+    dev_t  dev;         // identity of the mapped file
+    ino_t  ino;
+    time_t mtime;
+
+    char fn[PATH_MAX];
+};
+typedef struct catalog catalog;
+
+int  catalog_open(catalog *, const char *fn);
+void catalog_close(catalog *);
+int  catalog_refresh(catalog *);
+int  catalog_lookup(const catalog *, const char *name, apdata *d);
+int  catalog_get(const catalog *, size_t i, apdata *d);
+size_t catalog_find(const catalog *, const char *name, size_t len, int *found);
+const char *catalog_name(const catalog *, size_t i, size_t *len);
+
+
+#define IFSCAND_SSID_FILTER_AGE 300 /* Max secs before the SSID filter and patterns are rebuilt */
+#define IFSCAND_APORDER_AGE     300 /* Max secs before ap-order is reloaded */
+
+
+/*
+ * AP and Preferences DB; stored in one of these.
+ */
+#define DB_BACKEND_BTREE    0   // dbopen(3) btree: IFSCAND_PREFS.db
+#define DB_BACKEND_LOG      1   // log-structured (db_log.c): IFSCAND_PREFS.log
+
 struct apdb
 {
     DB *db;                // handle to open prefs DB
+    int backend;           // DB_BACKEND_xxx
+    char fn[PATH_MAX];     // file behind 'db'
+
+    uint64_t gen;          // bumped on every change to the DB
+
+    uint32_t dirty;        // # of updates not yet synced to disk
+    int64_t  dirtyat;      // mono_ms() of the oldest of them
+    uint64_t syncs;        // # of syncs to disk
+
+    /*
+     * Filter of remembered AP names; lets db_filter_ap() skip DB
+     * lookups of SSIDs we don't know. Rebuilt when 'gen' moves on,
+     * or after IFSCAND_SSID_FILTER_AGE (other instances may have
+     * changed the shared DB).
+     */
+    bloom    ssids;
+    uint64_t ssidgen;      // 'gen' it was built at; 0 if never
+    time_t   ssidwhen;     // when it was built
+    uint64_t ssid_lookups, // # of SSIDs checked against it
+             ssid_rejects, // # it ruled out
+             ssid_falsepos;// # it let through that weren't in the DB
+
+    // APs from the fleet catalog; entries in 'db' take priority.
+    catalog  cat;
+
+    /*
+     * "aporder" compiled for db_filter_ap(); rebuilt when the order
+     * is set here or after IFSCAND_APORDER_AGE (other instances
+     * may have set it).
+     */
+    rankmap  ranks;
+    time_t   rankwhen;     // when it was built; 0 if it must be
+
+    /*
+     * SSID patterns ("pat." keys) compiled for db_filter_ap();
+     * rebuilt like 'ssids'.
+     */
+    patset   pats;
+    uint64_t patgen;       // 'gen' it was built at; 0 if never
+    time_t   patwhen;
+
+    // "node-ttl"; read again when 'gen' moves on
+    unsigned int nodettl;
+    uint64_t     ttlgen;   // 'gen' it was read at; 0 if never
 
     char ifname[IFNAMSIZ];
 };
@@ -141,6 +318,22 @@ rssi_avg_value(rssi_avg *a)
 
 
 
+/*
+ * Immutable snapshot of a completed scan. Once published, 'nv' is
+ * never modified; readers hold a reference while they use it.
+ */
+struct scansnap
+{
+    uint32_t refs;          // # of readers + 1 if it is the latest
+    uint64_t seq;           // monotonically increasing scan number
+    time_t   when;          // wall clock time of the scan
+    int      fresh;         // set if read right after an active scan
+
+    nodevect nv;            // scanned nodes sorted by preference
+};
+typedef struct scansnap scansnap;
+
+
 // Interface state
 struct ifstate
 {
@@ -165,8 +358,15 @@ struct ifstate
     int down;               // set to true if we need to bring it down after scan
     struct ifreq ifr;       // interface state
 
-    /* Allocate once and reuse everytime. */
-    nodevect      nv;
+    /* AP named by a pending "join" command; empty if none */
+    char joinreq[AP_NAMELEN];
+
+    /* ifstate_config() gives up waiting after this (mono_ms); 0 if never */
+    int64_t joindeadline;
+
+    /* Latest published scan; see snap.c */
+    scansnap     *snap;
+    uint64_t      snapseq;  // seq# of the last published snapshot
 
     char sockpath[PATH_MAX]; // path to listen socket
 };
@@ -195,6 +395,17 @@ struct cmd_state
 
     struct sockaddr_un from;    // peer who sent the command
 
+    /*
+     * Reply framing; see ipc.c
+     */
+    int      framed;    // set if the peer uses framed messages
+    uint32_t seq;       // request# to echo in the reply
+    uint16_t part;      // next reply fragment#
+    int      dropped;   // set if the peer couldn't take part of the reply
+    int      noreply;   // set if the handler took over the reply
+    int      kick;      // set if the command wants a scan soon
+    char    *body;      // lines after the command (import); or null
+
     // Pointer to global AP list and their relative priorities
     struct apdb *db;
 
@@ -205,18 +416,6 @@ typedef struct cmd_state cmd_state;
 
 
 
-static inline char*
-copy_apname(char *dest, size_t n, struct ieee80211_nodereq *nr)
-{
-    size_t m = nr->nr_nwid_len > n ? n : nr->nr_nwid_len;
-
-    memcpy(dest, nr->nr_nwid, m);
-    dest[m] = 0;
-
-    return dest;
-}
-
-
 /*
  * Predicate that returns true if 'exe' is a valid executable file.
  * And returns false otherwise.
@@ -235,10 +434,29 @@ valid_exe_p(const char *exe)
 /*
  * API to manage persistent info
  */
-void db_init(apdb *, const char *iface);
+void db_init(apdb *, const char *iface, int backend);
+
+/*
+ * Periodic housekeeping of the DB backend (e.g., compaction).
+ */
+void db_maint(apdb *);
 
 void db_close(apdb *);
 
+/*
+ * In a forked child: close the DB file. The parent's unsynced
+ * updates and the backend's state are left alone.
+ */
+void db_child_close(apdb *);
+
+/*
+ * Updates are written behind; see db.c. db_sync() writes them to
+ * disk now. db_sync_due() returns the # of ms before they must be
+ * written, or -1 if there are none.
+ */
+void    db_sync(apdb *);
+int64_t db_sync_due(apdb *);
+
 /*
  * Remember our preferred order of APs. These are always preferred
  * over other APs we have remembered.
@@ -260,6 +478,11 @@ void db_set_scanint(apdb *, int val);
  */
 void db_set_apdata(apdb *db, const apdata *d);
 
+/*
+ * Fetch remembered AP 'name' into 'd'. Return 1 if found, 0 otherwise.
+ */
+int db_get_apdata(apdb *db, const char *name, apdata *d);
+
 /*
  * Return the global randmac property.
  */
@@ -271,9 +494,33 @@ int db_get_randmac(apdb *);
 int db_get_scanint(apdb *);
 
 /*
- * Return a list of APs we have remembered.
+ * Visit remembered APs in name order; see db.c.
+ *
+ * 'fp' returns 0 to end the walk.
  */
-int db_get_all_ap(apdb *, apvect *av);
+typedef int db_ap_func(void *ctx, const apdata *d);
+
+/*
+ * Store all of 'av' with a single sync; with 'replace', forget APs
+ * and patterns not in 'av'. Return the # forgotten.
+ */
+int db_import_ap(apdb *, apvect *av, int replace);
+
+/*
+ * Log-structured DB backend (db_log.c). dblog_open() returns a
+ * handle that works like one from dbopen(3); dblog_maint() starts
+ * or finishes a background compaction.
+ */
+DB  *dblog_open(const char *fn, int flags, int mode);
+void dblog_maint(DB *);
+
+int db_walk_ap(apdb *, const char *from, const char *prefix, db_ap_func *fp, void *ctx);
+
+/*
+ * Call 'fp' on each SSID pattern profile ("add pattern ..."); 'from'
+ * and 'prefix' work as for db_walk_ap().
+ */
+int db_walk_pat(apdb *, const char *from, const char *prefix, db_ap_func *fp, void *ctx);
 
 /*
  * Return our preferred AP order.
@@ -286,6 +533,11 @@ strvect db_get_ap_order(apdb *);
  */
 int db_del_ap(apdb *db, const char *ap);
 
+/*
+ * Delete an SSID pattern profile.
+ */
+int db_del_pattern(apdb *db, const char *pat);
+
 
 /*
  * Given a list of scanned AP names, remove ones that we haven't
@@ -309,13 +561,29 @@ int db_get_uint(apdb *db, const char *key, unsigned int *p_res);
  */
 void db_set_uint(apdb *db, const char *key, unsigned int val);
 
+/*
+ * Return "node-ttl" without going to the DB unless it changed.
+ */
+unsigned int db_node_ttl(apdb *db);
+
+
+/*
+ * Get and set an opaque preference 'key' (the join history).
+ *
+ * db_get_blob() copies at most 'bsiz' bytes and returns the size of
+ * the preference; 0 if it doesn't exist. db_set_blob() doesn't
+ * bump the DB generation.
+ */
+size_t db_get_blob(apdb *db, const char *key, void *buf, size_t bsiz);
+void   db_set_blob(apdb *db, const char *key, const void *buf, size_t n);
 
-/* Describe ap info in text form that can be parsed back */
-size_t db_ap_sprintf(char *buf, size_t bsiz, apdata *a);
 
 extern int wifi_scan(ifstate *ifs);
 
-extern int disconnect_ap(ifstate *s, apdata *ap);
+/*
+ * Disconnect from 'ap'; 'why' is reported to event subscribers.
+ */
+extern int disconnect_ap(ifstate *s, apdata *ap, const char *why);
 
 /*
  * Initialize logging to syslog.
@@ -335,7 +603,6 @@ extern int fd_set_cloexec(int fd);
 
 extern int  ifstate_init(ifstate *ifs, const char* ifname);
 extern void ifstate_close(ifstate *ifs);
-ssize_t ifstate_sprintf_node(char * buf, size_t  bsiz, struct ieee80211_nodereq *nr);
 
 /*
  * Set interface state to up/down.
@@ -370,10 +637,30 @@ int  ifstate_get_rssi(ifstate*, const char *ap, const uint8_t *mac);
 //   >= 0 # of nodes visible
 extern int ifstate_scan(ifstate *ifs);
 
+// Like ifstate_scan() - but read into 'nv' without publishing a
+// snapshot (see roam.c).
+extern int ifstate_nodes(ifstate *ifs, nodevect *nv);
+
+
+/*
+ * Scan snapshots.
+ *
+ * ifstate_scan() publishes a new snapshot on every successful scan.
+ * ifstate_snap() returns a reference to the latest one (or NULL);
+ * callers must release it with snap_put().
+ */
+scansnap *ifstate_snap(ifstate *ifs);
+scansnap *snap_new(void);
+void      snap_publish(ifstate *ifs, scansnap *s);
+void      snap_render(scansnap *s, fast_buf *b, int json);
+void      snap_put(scansnap *s);
+uint32_t  snap_live(void);
+
 
 /*
- * parse an IPC command or a disk file - both of which are
- * represented by 'fp'.
+ * Parse and run the IPC request in 's->in'. A text request is one
+ * command line; only "import" may be followed by more lines (the
+ * file being imported).
  *
  * Returns:
  *    0 on EOF
@@ -383,11 +670,215 @@ extern int ifstate_scan(ifstate *ifs);
 extern int cmd_process(cmd_state *s);
 
 
+/*
+ * Binary (TLV) requests; see bcmds.c.
+ *
+ * bcmd_request_p() returns true if 's->in' holds a binary request.
+ * bcmd_process() returns the same values as cmd_process().
+ */
+extern int bcmd_request_p(cmd_state *s);
+extern int bcmd_process(cmd_state *s);
+
+
+/*
+ * Used by admission control (admit.c):
+ *
+ * cmd_expensive_p() returns true if the request in 's->in' makes
+ * the daemon do real work (a fresh scan, a join).
+ *
+ * cmd_reply_error() writes error 'msg' to 's->out' in the format
+ * (text or binary) of the request in 's->in'.
+ */
+extern int  cmd_expensive_p(cmd_state *s);
+extern void cmd_reply_error(cmd_state *s, const char *msg);
+extern int  bcmd_expensive_p(cmd_state *s);
+extern void bcmd_reply_error(cmd_state *s, const char *msg);
+
+
+/*
+ * Admission control and fair queueing of requests; see admit.c.
+ *
+ * admit_enqueue() queues the complete request in 's' or replies
+ * "busy"; admit_next() loads the next request to serve into 's'
+ * and returns 0 if there are none.
+ */
+#define ADMIT_MAXREAD   64  // max datagrams read per loop pass
+#define ADMIT_BUDGET    8   // max requests served per loop pass
+
+extern void    admit_enqueue(cmd_state *s);
+extern int     admit_next(cmd_state *s);
+extern int     admit_pending(void);
+extern void    admit_stats(uint32_t *npeers, uint64_t *busy);
+extern int64_t mono_ms(void);
+
+
+/*
+ * Read the next request from the control socket into 's->in'.
+ *
+ * Returns:
+ *    > 0 if a complete request is available
+ *    0   if the datagram didn't complete a request
+ *    < 0 -errno on error; -EAGAIN if there was nothing to read
+ */
+extern int ipc_recv(cmd_state *s);
+
+
+/*
+ * Send output accumulated in 's->out'. If 'end' is false, only
+ * full fragments are sent; else everything is sent and the reply
+ * is terminated.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+extern int ipc_flush(cmd_state *s, int end);
+
+/*
+ * Reply fragments a slow peer couldn't take are queued; the event
+ * loop calls ipc_drain() to send them and, while ipc_pending() is
+ * true, wakes up every IPC_RETRY_MS to do so. Queued "watch"
+ * events (event_pending()) are retried the same way.
+ */
+#define IPC_RETRY_MS    10
+
+extern void ipc_drain(int fd);
+extern int  ipc_pending(void);
+
+
 /*
  * Wake up the listen socket with a dummy write from buf 'b'.
  */
 extern void sockwake(ifstate *ifs, fast_buf *b);
 
+/*
+ * Cache of rendered command output; see rcache.c.
+ *
+ * Entries are named by 'id' (the command and its format) and are
+ * valid for one generation 'gen' of their source (DB generation or
+ * scan snapshot seq#) and one generation 'aux' of a second,
+ * independent source (0 if there is none). Both must match.
+ *
+ * rcache_get() returns the cached output or NULL.
+ * rcache_fill() returns an empty buffer to render into; it is
+ * cached as the output of (id, gen, aux).
+ */
+extern fast_buf *rcache_get(const char *id, uint64_t gen, uint64_t aux);
+extern fast_buf *rcache_fill(const char *id, uint64_t gen, uint64_t aux);
+extern void      rcache_stats(uint64_t *hits, uint64_t *misses);
+
+/*
+ * Deferred replies; see defer.c.
+ *
+ * defer_reply() parks the reply to 's' until defer_complete() is
+ * called for the same 'what' (and 'arg', if given) or 'timeout'
+ * seconds pass; then 'fp' is called to write the reply with the
+ * status (-ETIMEDOUT on timeout).
+ *
+ * defer_expire() returns the # of seconds until the next deadline
+ * or -1 if nothing is pending.
+ */
+#define DEFER_SCAN      1   // next published scan snapshot
+#define DEFER_JOIN      2   // end of a "join" attempt; arg is the AP
+#define DEFER_FRESH     3   // end of an active scan
+
+#define IFSCAND_DEFER_TIMEOUT   32  /* less than ifscanctl's default timeout */
+
+/*
+ * Joins run on the event loop; a "join" or "scan wait" that is
+ * parked while we scan and fall back through candidates must not
+ * time out - here or in ifscanctl.
+ */
+#if (IFSCAND_ASCAN_MS + IFSCAND_JOIN_BUDGET_MS) >= (IFSCAND_DEFER_TIMEOUT * 1000)
+#error "IFSCAND_ASCAN_MS + IFSCAND_JOIN_BUDGET_MS must be less than IFSCAND_DEFER_TIMEOUT"
+#endif
+#if IFSCAND_DEFER_TIMEOUT >= IPC_TIMEOUT
+#error "IFSCAND_DEFER_TIMEOUT must be less than IPC_TIMEOUT"
+#endif
+
+typedef void defer_func(cmd_state *s, const char *arg, int status);
+
+extern int  defer_reply(cmd_state *s, int what, const char *arg, int timeout, defer_func *fp);
+extern void defer_complete(ifstate *ifs, int what, const char *arg, int status);
+extern int  defer_expire(ifstate *ifs);
+extern int  defer_waiting(int what);
+
+/*
+ * Event stream for "watch" subscribers; see event.c.
+ *
+ * event_post() formats 'fmt' after the timestamp and 'type' and
+ * sends it to every subscriber without blocking; what a peer can't
+ * take yet is queued and retried by event_drain().
+ */
+extern void event_init(int fd);
+extern int  event_active(void);
+extern void event_post(const char *type, const char *fmt, ...);
+extern int  event_pending(void);
+extern void event_drain(void);
+extern int  event_subscribe(cmd_state *s);
+extern int  event_unsubscribe(cmd_state *s);
+extern void event_stats(uint32_t *nsubs, uint64_t *dropped);
+extern void event_fini(void);
+
+/*
+ * Per-BSSID join history and quarantine; see joinhist.c.
+ *
+ * joinhist_record() returns the seconds of quarantine that follow
+ * the attempt; joinhist_quarantined() the seconds left (0 if none).
+ * joinhist_demote() moves quarantined APs to the end of 'av' and
+ * returns the # of APs before them. joinhist_get() fills the record
+ * "scan" sends as T_JOINHIST.
+ */
+extern void     joinhist_init(apdb *db);
+extern int      joinhist_record(apdb *db, const uint8_t *bssid, int ok, uint32_t assoc_ms, uint32_t ip_ms);
+extern int      joinhist_quarantined(const uint8_t *bssid);
+extern int      joinhist_active(void);
+extern uint64_t joinhist_gen(void);
+extern size_t   joinhist_demote(apvect *av);
+extern int      joinhist_get(const uint8_t *bssid, bproto_joinhist *h);
+extern size_t   joinhist_sprintf(char *buf, size_t bsiz, const uint8_t *bssid);
+extern void     joinhist_json(struct jsonw *w, const uint8_t *bssid);
+
+/*
+ * Aged table of scanned nodes; see nodetab.c.
+ *
+ * nodetab_merge() merges a read of 'n' nodes and appends every node
+ * seen in the last 'ttl' seconds to 'nv' with its average RSSI.
+ * nodetab_stats() returns the # of nodes and sets '*stale' to the #
+ * the last read missed. nodetab_stale() returns true if the last
+ * read missed 'bssid'.
+ */
+extern size_t nodetab_merge(const struct ieee80211_nodereq *nr, size_t n, unsigned int ttl, nodevect *nv);
+extern size_t nodetab_stats(size_t *stale);
+extern int    nodetab_stale(const uint8_t *bssid);
+
+/*
+ * Active scans run in the background; see ascan.c.
+ *
+ * ascan_start() returns 1 if a scan is running, -errno on failure.
+ * The event loop polls ascan_fd() and calls ascan_finish() when it
+ * is readable or ascan_due() ms have passed; ascan_finish() returns
+ * 1 if the scan ended.
+ */
+extern int     ascan_start(ifstate *ifs, const char *why);
+extern int     ascan_fd(void);
+extern int64_t ascan_due(void);
+extern int     ascan_finish(ifstate *ifs);
+extern int     ascan_running(void);
+extern int     ascan_fresh(void);
+extern int     ascan_resumed(void);
+extern void    ascan_stop(void);
+
+/*
+ * Roaming candidates tracked while associated; see roam.c.
+ *
+ * roam_track() reads the node cache and scores the remembered APs
+ * in it. roam_targets() puts the candidates of the last (recent)
+ * reading in 'av', best first, except APs named 'cur'; it returns
+ * their #.
+ */
+extern void   roam_track(ifstate *ifs);
+extern size_t roam_targets(apvect *av, const char *cur);
+extern void   roam_reset(void);
+
 /*
  * Global vars
  */
@@ -0,0 +1,515 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * ipc.c - Framed request/response transport on the control socket
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * See common.h for the wire format.
+ *
+ * * Multi-fragment requests are reassembled per (peer, seq). We
+ *   bound the number of requests being reassembled and their
+ *   size; stale ones are dropped after IPC_REASM_TIMEOUT seconds.
+ *
+ * * Responses are streamed: command handlers call ipc_flush()
+ *   as they produce output and every full fragment is sent right
+ *   away. The output buffer never holds more than one fragment
+ *   worth of data for framed clients.
+ *
+ * * We never wait for a peer whose receive buffer is full. Like
+ *   the event stream, fragments it can't take yet are queued
+ *   (the queue is bounded; IPC_OUTQ_MAX datagrams) and sent by
+ *   ipc_drain() on later passes of the event loop; a peer's
+ *   fragments always go out in order. A reply that doesn't fit in
+ *   the queue, or that waited more than IPC_TIMEOUT seconds, is
+ *   dropped; the peer times out.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+#define IPC_MAXPARTIAL      16  // max # of requests being reassembled
+#define IPC_REASM_TIMEOUT   30  // seconds
+#define IPC_OUTQ_MAX        512 // max # of queued reply datagrams (1MB)
+
+
+struct ipc_partial
+{
+    struct sockaddr_un from;
+    uint32_t seq;
+    uint16_t next;      // next expected fragment#
+    time_t   start;
+
+    fast_buf buf;
+};
+typedef struct ipc_partial ipc_partial;
+
+VECT_TYPEDEF(partvect, ipc_partial);
+
+static partvect Partial;
+static int      Pinit = 0;
+
+
+/*
+ * A reply datagram waiting for its peer to drain.
+ */
+struct ipc_out
+{
+    struct sockaddr_un to;
+    time_t   when;
+    size_t   n;
+    uint8_t  pkt[IPC_DGRAMSZ];
+};
+typedef struct ipc_out ipc_out;
+
+VECT_TYPEDEF(outvect, ipc_out *);
+
+static outvect  Outq;
+static int      Oinit = 0;
+
+static ssize_t sockwrite(int fd, const void *buf, size_t n, const struct sockaddr_un *to);
+static int     reply_send(cmd_state *s, const void *buf, size_t n);
+static void    reply_dropped(cmd_state *s, int err);
+
+
+static int
+same_peer(const struct sockaddr_un *a, const struct sockaddr_un *b)
+{
+    return 0 == strcmp(a->sun_path, b->sun_path);
+}
+
+
+/*
+ * Commands are parsed as C strings; NUL terminate 'b' without
+ * counting the NUL as part of the request.
+ */
+static void
+nul_terminate(fast_buf *b)
+{
+    fast_buf_append(b, 0);
+    b->size--;
+}
+
+
+/*
+ * Remove the i'th partial request.
+ */
+static void
+partial_del(size_t i)
+{
+    ipc_partial *p = &VECT_ELEM(&Partial, i);
+
+    fast_buf_fini(&p->buf);
+
+    *p = VECT_LAST_ELEM(&Partial);
+    Partial.size--;
+}
+
+
+/*
+ * Drop partial requests that haven't completed in time.
+ */
+static void
+partial_expire(time_t now)
+{
+    size_t i = 0;
+
+    while (i < VECT_SIZE(&Partial)) {
+        ipc_partial *p = &VECT_ELEM(&Partial, i);
+
+        if ((now - p->start) < IPC_REASM_TIMEOUT) {
+            i++;
+            continue;
+        }
+
+        debuglog("ipc: dropping incomplete request %u from %s", p->seq, p->from.sun_path);
+        partial_del(i);
+    }
+}
+
+
+/*
+ * Find or create reassembly state for (from, seq).
+ */
+static ipc_partial *
+partial_find(const struct sockaddr_un *from, uint32_t seq, int create)
+{
+    ipc_partial *p;
+
+    VECT_FOR_EACH(&Partial, p) {
+        if (p->seq == seq && same_peer(&p->from, from)) return p;
+    }
+
+    if (!create || VECT_SIZE(&Partial) >= IPC_MAXPARTIAL) return 0;
+
+    VECT_ENSURE(&Partial, 1);
+    p = &VECT_GET_NEXT(&Partial);
+
+    memset(p, 0, sizeof *p);
+    p->from  = *from;
+    p->seq   = seq;
+    p->start = time(0);
+    fast_buf_init(&p->buf, IPC_DGRAMSZ);
+    return p;
+}
+
+
+/*
+ * Read one datagram from the control socket.
+ *
+ * If it completes a request, the request text is left in 's->in'
+ * (NUL terminated) and the reply parameters are set up in 's'.
+ *
+ * Return:
+ *    > 0   a complete request is available
+ *    0     the datagram didn't complete a request
+ *    < 0   -errno on error; -EAGAIN if the socket is empty
+ */
+int
+ipc_recv(cmd_state *s)
+{
+    uint8_t   pkt[IPC_DGRAMSZ+1];
+    socklen_t len = sizeof s->from;
+    ipc_hdr   h;
+
+    if (!Pinit) {
+        VECT_INIT(&Partial, IPC_MAXPARTIAL);
+        Pinit = 1;
+    }
+
+    memset(&s->from, 0, sizeof s->from);
+    ssize_t m = recvfrom(s->fd, pkt, IPC_DGRAMSZ, MSG_DONTWAIT, (struct sockaddr *)&s->from, &len);
+    if (m == -1) return -errno;
+
+    partial_expire(time(0));
+
+    fast_buf_reset(&s->in);
+    fast_buf_reset(&s->out);
+
+    memset(&h, 0, sizeof h);
+    if ((size_t)m >= sizeof h) memcpy(&h, pkt, sizeof h);
+
+    if (h.magic != IPC_MAGIC) {
+        // Unframed request from an older client.
+        s->framed  = 0;
+        s->seq     = 0;
+        s->part    = 0;
+        s->dropped = 0;
+
+        fast_buf_push(&s->in, pkt, m);
+        nul_terminate(&s->in);
+        return m > 0 ? 1 : 0;
+    }
+
+    uint8_t *data = pkt + sizeof h;
+    size_t   n    = m - sizeof h;
+
+    // Common case: a request that fits in one datagram.
+    if (h.part == 0 && (h.flags & IPC_F_END)) {
+        fast_buf_push(&s->in, data, n);
+        goto done;
+    }
+
+    ipc_partial *p = partial_find(&s->from, h.seq, h.part == 0);
+    if (!p) {
+        debuglog("ipc: ignoring fragment %u of request %u from %s",
+                h.part, h.seq, s->from.sun_path);
+        return 0;
+    }
+
+    if (h.part != p->next || (fast_buf_size(&p->buf) + n) > IPC_MAXREQ) {
+        printlog(LOG_WARNING, "ipc: malformed request %u from %s; dropping",
+                h.seq, s->from.sun_path);
+        partial_del(p - &VECT_ELEM(&Partial, 0));
+        return 0;
+    }
+
+    fast_buf_push(&p->buf, data, n);
+    p->next++;
+
+    if (!(h.flags & IPC_F_END)) return 0;
+
+    fast_buf_push(&s->in, fast_buf_ptr(&p->buf), fast_buf_size(&p->buf));
+    partial_del(p - &VECT_ELEM(&Partial, 0));
+
+done:
+    s->framed  = 1;
+    s->seq     = h.seq;
+    s->part    = 0;
+    s->dropped = 0;
+
+    nul_terminate(&s->in);
+    return 1;
+}
+
+
+/*
+ * Send pending output in 's->out' to the peer.
+ *
+ * Framed replies are sent as soon as a full fragment is available;
+ * if 'end' is true, the remainder is sent as the last fragment.
+ * Unframed replies are sent as a single datagram when 'end' is
+ * true.
+ *
+ * Return:
+ *    0 on success
+ *    -errno on error
+ */
+int
+ipc_flush(cmd_state *s, int end)
+{
+    uint8_t pkt[IPC_DGRAMSZ];
+    ipc_hdr h;
+    ssize_t r;
+
+    if (!s->framed) {
+        size_t n = fast_buf_size(&s->out);
+
+        if (!end || n == 0) return 0;
+
+        r = reply_send(s, fast_buf_ptr(&s->out), n);
+        fast_buf_reset(&s->out);
+        if (r < 0) reply_dropped(s, -r);
+        return r < 0 ? r : 0;
+    }
+
+    // The peer missed a fragment; the rest is of no use to it.
+    if (s->dropped) {
+        fast_buf_reset(&s->out);
+        return -EAGAIN;
+    }
+
+    uint8_t *p = fast_buf_ptr(&s->out);
+    size_t   n = fast_buf_size(&s->out);
+
+    h.magic = IPC_MAGIC;
+    h.seq   = s->seq;
+
+    while (n >= IPC_MAXDATA || end) {
+        size_t m = n > IPC_MAXDATA ? IPC_MAXDATA : n;
+
+        h.part  = s->part++;
+        h.flags = (m == n && end) ? IPC_F_END : 0;
+
+        memcpy(pkt, &h, sizeof h);
+        memcpy(pkt + sizeof h, p, m);
+
+        r = reply_send(s, pkt, m + sizeof h);
+        if (r < 0) {
+            reply_dropped(s, -r);
+            fast_buf_reset(&s->out);
+            return r;
+        }
+
+        p += m;
+        n -= m;
+
+        if (h.flags & IPC_F_END) break;
+    }
+
+    // Keep the partial fragment for later.
+    if (n > 0) memmove(fast_buf_ptr(&s->out), p, n);
+    s->out.size = n;
+    return 0;
+}
+
+
+/*
+ * Wake up socket with a dummy write.
+ */
+void
+sockwake(ifstate *ifs, fast_buf *b)
+{
+    struct sockaddr_un un;
+
+    un.sun_family = AF_UNIX;
+    strlcpy(un.sun_path, ifs->sockpath, sizeof un.sun_path);
+
+    sockwrite(ifs->ipcfd, fast_buf_ptr(b), fast_buf_size(b), &un);
+}
+
+
+/*
+ * Note that the rest of the reply in 's' won't be sent.
+ */
+static void
+reply_dropped(cmd_state *s, int err)
+{
+    s->dropped = 1;
+    printlog(LOG_WARNING, "dropping reply %u to %s: %s", s->seq,
+             s->from.sun_path, strerror(err));
+}
+
+
+/*
+ * Return true if datagrams to 'to' are queued.
+ */
+static int
+outq_has(const struct sockaddr_un *to)
+{
+    ipc_out **o;
+
+    VECT_FOR_EACH(&Outq, o) {
+        if (same_peer(&(*o)->to, to)) return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Send one datagram of the reply in 's'; queue it if the peer's
+ * buffer is full or earlier fragments are waiting.
+ *
+ * Return 0 on success, -errno on failure.
+ */
+static int
+reply_send(cmd_state *s, const void *buf, size_t n)
+{
+    if (!Oinit) {
+        VECT_INIT(&Outq, 16);
+        Oinit = 1;
+    }
+
+    if (!outq_has(&s->from)) {
+        ssize_t r = sockwrite(s->fd, buf, n, &s->from);
+
+        if (r != -EAGAIN) return r < 0 ? r : 0;
+    }
+
+    if (VECT_SIZE(&Outq) >= IPC_OUTQ_MAX) return -ENOBUFS;
+
+    ipc_out *o = NEWZ(ipc_out);
+    if (!o) return -ENOMEM;
+
+    o->to   = s->from;
+    o->when = time(0);
+    o->n    = n;
+    memcpy(o->pkt, buf, n);
+    VECT_APPEND(&Outq, o);
+    return 0;
+}
+
+
+/*
+ * Send queued reply datagrams to peers that can take them now.
+ * Peers that are gone, or that haven't drained for IPC_TIMEOUT
+ * seconds, lose what is queued for them.
+ */
+void
+ipc_drain(int fd)
+{
+    struct sockaddr_un busy[8];
+    size_t nbusy = 0;
+    time_t now   = time(0);
+    size_t i, j, k;
+
+    if (!Oinit) return;
+
+    for (i = j = 0; i < VECT_SIZE(&Outq); i++) {
+        ipc_out *o = VECT_ELEM(&Outq, i);
+        int keep   = 0;
+
+        for (k = 0; k < nbusy; k++) {
+            if (same_peer(&busy[k], &o->to)) break;
+        }
+
+        if (k < nbusy) {
+            keep = 1;
+        } else if ((now - o->when) > IPC_TIMEOUT) {
+            debuglog("ipc: %s didn't drain; dropping queued reply", o->to.sun_path);
+        } else {
+            ssize_t r = sockwrite(fd, o->pkt, o->n, &o->to);
+
+            // Later fragments to this peer wait their turn.
+            if (r == -EAGAIN) {
+                keep = 1;
+                if (nbusy < ARRAY_SIZE(busy)) busy[nbusy++] = o->to;
+            } else if (r < 0) {
+                debuglog("ipc: can't send queued reply to %s: %s", o->to.sun_path, strerror(-r));
+            }
+        }
+
+        if (keep) VECT_ELEM(&Outq, j++) = o;
+        else      DEL(o);
+    }
+    Outq.size = j;
+}
+
+
+/*
+ * Return true if reply datagrams are queued.
+ */
+int
+ipc_pending(void)
+{
+    return Oinit && VECT_SIZE(&Outq) > 0;
+}
+
+
+/*
+ * Write one datagram to destination 'to'; never wait for a peer
+ * whose receive buffer is full.
+ *
+ * Return:
+ *     > 0  number of bytes written
+ *     -errno on error (-EAGAIN if the peer is full)
+ */
+static ssize_t
+sockwrite(int fd, const void *buf, size_t n, const struct sockaddr_un *to)
+{
+    while (1) {
+        ssize_t m = sendto(fd, buf, n, MSG_NOSIGNAL|MSG_DONTWAIT,
+                           (const struct sockaddr *)to, sizeof *to);
+        if (m >= 0) return m;
+
+        switch (errno) {
+            case EINTR:
+                continue;
+
+            case ENOBUFS:
+                return -EAGAIN;
+
+            default:
+                return -errno;
+        }
+    }
+}
+
+/* EOF */
@@ -0,0 +1,401 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * joinhist.c - per-BSSID join history and quarantine
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * Every join attempt is recorded against the BSSID it was made
+ *   to: attempts, successes, failures and how long association
+ *   (ifstate_config) and IP configuration took. The table is fixed
+ *   size; the entry attempted longest ago is reused when it fills.
+ *
+ * * The 2nd and later consecutive failures put the BSSID in
+ *   quarantine for JH_QUAR_MIN seconds, doubling each time up to
+ *   JH_QUAR_MAX. A success clears it. do_scan() moves quarantined
+ *   APs behind the others and doesn't pick them on its own; an
+ *   explicit "join" still can.
+ *
+ * * Deadlines are wall clock times so that the table means the same
+ *   thing after a restart. With "set join-history persist" the table
+ *   is saved in the prefs DB after each attempt and loaded at start.
+ *   If the clock steps back past an entry's last attempt, its
+ *   quarantine is forgotten; no quarantine ever has more than
+ *   JH_QUAR_MAX left, whatever the clock does.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "utils.h"
+#include "ifscand.h"
+#include "jsonw.h"
+
+#define JH_SLOTS        64
+#define JH_QUAR_MIN     30          // seconds
+#define JH_QUAR_MAX     (30 * 60)   // seconds
+
+#define JH_MAGIC        0x686a      // "jh"
+#define JH_VERSION      1
+#define JH_KEY          "join-hist"
+
+
+struct jhent
+{
+    uint8_t  bssid[6];
+    uint16_t streak;        // consecutive failures
+    uint32_t attempts;
+    uint32_t ok;
+    uint32_t fail;
+    uint32_t assoc_ms;      // average time to associate
+    uint32_t ip_ms;         // average time to configure addresses
+    int64_t  last;          // time of the last attempt
+    int64_t  until;         // end of quarantine; 0 if none
+};
+typedef struct jhent jhent;
+
+
+// Layout of the persisted table
+struct jhdisk
+{
+    uint16_t magic;
+    uint16_t version;
+    uint32_t n;
+    jhent    ent[JH_SLOTS];
+};
+
+
+static jhent    Hist[JH_SLOTS];
+static uint32_t Nhist = 0;
+static uint64_t Gen   = 0;      // bumped on every change
+
+
+static jhent *
+jh_find(const uint8_t *bssid)
+{
+    uint32_t i;
+
+    for (i = 0; i < Nhist; i++) {
+        if (0 == memcmp(Hist[i].bssid, bssid, 6)) return &Hist[i];
+    }
+    return 0;
+}
+
+
+/*
+ * Return the entry for 'bssid'; make one if needed.
+ */
+static jhent *
+jh_get(const uint8_t *bssid)
+{
+    jhent *e = jh_find(bssid);
+    uint32_t i;
+
+    if (e) return e;
+
+    if (Nhist < JH_SLOTS) {
+        e = &Hist[Nhist++];
+    } else {
+        e = &Hist[0];
+        for (i = 1; i < Nhist; i++) {
+            if (Hist[i].last < e->last) e = &Hist[i];
+        }
+    }
+
+    memset(e, 0, sizeof *e);
+    memcpy(e->bssid, bssid, 6);
+    return e;
+}
+
+
+/*
+ * Keep the deadlines of 'e' sane against 'now'.
+ */
+static void
+jh_clamp(jhent *e, int64_t now)
+{
+    if (e->last > now) {
+        e->last  = now;
+        e->until = 0;
+        Gen++;
+    } else if (e->until > now + JH_QUAR_MAX) {
+        e->until = now + JH_QUAR_MAX;
+        Gen++;
+    }
+}
+
+
+// Running average that weighs the latest sample 1/4.
+static inline uint32_t
+jh_avg(uint32_t avg, uint32_t v, uint32_t n)
+{
+    return n <= 1 ? v : avg - (avg / 4) + (v / 4);
+}
+
+
+static int
+jh_persist_p(apdb *db)
+{
+    unsigned int v = 0;
+
+    db_get_uint(db, "join-history", &v);
+    return v != 0;
+}
+
+
+/*
+ * Load the saved history if "join-history" is set to persist.
+ */
+void
+joinhist_init(apdb *db)
+{
+    struct jhdisk d;
+
+    Nhist = 0;
+    if (!jh_persist_p(db)) return;
+
+    size_t n = db_get_blob(db, JH_KEY, &d, sizeof d);
+    if (n < offsetof(struct jhdisk, ent)) return;
+
+    if (d.magic != JH_MAGIC || d.version != JH_VERSION || d.n > JH_SLOTS ||
+        n != offsetof(struct jhdisk, ent) + d.n * sizeof(jhent)) {
+        printlog(LOG_WARNING, "ignoring damaged join history");
+        return;
+    }
+
+    int64_t  now = time(0);
+    uint32_t i;
+
+    memcpy(Hist, d.ent, d.n * sizeof(jhent));
+    Nhist = d.n;
+    for (i = 0; i < Nhist; i++) jh_clamp(&Hist[i], now);
+    Gen++;
+}
+
+
+static void
+jh_save(apdb *db)
+{
+    struct jhdisk d;
+
+    d.magic   = JH_MAGIC;
+    d.version = JH_VERSION;
+    d.n       = Nhist;
+    memcpy(d.ent, Hist, Nhist * sizeof(jhent));
+
+    db_set_blob(db, JH_KEY, &d, offsetof(struct jhdisk, ent) + Nhist * sizeof(jhent));
+}
+
+
+/*
+ * Record a join attempt to 'bssid'. 'assoc_ms' and 'ip_ms' are the
+ * time taken by each phase of a successful attempt.
+ *
+ * Return the seconds of quarantine that follow; 0 if none.
+ */
+int
+joinhist_record(apdb *db, const uint8_t *bssid, int ok, uint32_t assoc_ms, uint32_t ip_ms)
+{
+    jhent  *e   = jh_get(bssid);
+    int64_t now = time(0);
+    int     q   = 0;
+
+    jh_clamp(e, now);
+    e->attempts++;
+    e->last = now;
+
+    if (ok) {
+        e->ok++;
+        e->streak   = 0;
+        e->until    = 0;
+        e->assoc_ms = jh_avg(e->assoc_ms, assoc_ms, e->ok);
+        e->ip_ms    = jh_avg(e->ip_ms, ip_ms, e->ok);
+    } else {
+        e->fail++;
+        if (e->streak < 0xffff) e->streak++;
+
+        if (e->streak > 1) {
+            int shift = e->streak - 2;
+
+            q = shift > 10 ? JH_QUAR_MAX : JH_QUAR_MIN << shift;
+            if (q > JH_QUAR_MAX) q = JH_QUAR_MAX;
+
+            e->until = now + q;
+        }
+    }
+
+    Gen++;
+    if (jh_persist_p(db)) jh_save(db);
+    return q;
+}
+
+
+/*
+ * Return the seconds of quarantine left for 'bssid'; 0 if none.
+ */
+int
+joinhist_quarantined(const uint8_t *bssid)
+{
+    jhent  *e = jh_find(bssid);
+    int64_t now;
+
+    if (!e || e->until == 0) return 0;
+
+    now = time(0);
+    jh_clamp(e, now);
+    return e->until > now ? (int)(e->until - now) : 0;
+}
+
+
+/*
+ * Return true if some BSSID is in quarantine; such output changes
+ * with time alone.
+ */
+int
+joinhist_active(void)
+{
+    int64_t now = time(0);
+    uint32_t i;
+
+    for (i = 0; i < Nhist; i++) {
+        jh_clamp(&Hist[i], now);
+        if (Hist[i].until > now) return 1;
+    }
+    return 0;
+}
+
+
+uint64_t
+joinhist_gen(void)
+{
+    return Gen;
+}
+
+
+/*
+ * Move quarantined APs in 'av' behind the rest; the order is
+ * otherwise kept.
+ *
+ * Return the # of APs that are not in quarantine.
+ */
+size_t
+joinhist_demote(apvect *av)
+{
+    size_t i, k, n = VECT_SIZE(av);
+
+    if (Nhist == 0) return n;
+
+    apvect q;
+
+    VECT_INIT(&q, 4);
+    for (i = k = 0; i < n; i++) {
+        apdata *d = &VECT_ELEM(av, i);
+
+        if (!joinhist_quarantined(d->nr_bssid)) {
+            if (k != i) VECT_ELEM(av, k) = *d;
+            k++;
+            continue;
+        }
+
+        debuglog("AP %s [" MACFMT "]: in quarantine", d->apname, sMAC(d->nr_bssid));
+        VECT_PUSH_BACK(&q, *d);
+    }
+
+    for (i = 0; i < VECT_SIZE(&q); i++) VECT_ELEM(av, k + i) = VECT_ELEM(&q, i);
+
+    VECT_FINI(&q);
+    return k;
+}
+
+
+/*
+ * Fill 'h' with the history of 'bssid'.
+ *
+ * Return 1 if there is one, 0 otherwise.
+ */
+int
+joinhist_get(const uint8_t *bssid, bproto_joinhist *h)
+{
+    const jhent *e = jh_find(bssid);
+
+    if (!e) return 0;
+
+    h->attempts   = e->attempts;
+    h->ok         = e->ok;
+    h->fail       = e->fail;
+    h->streak     = e->streak;
+    h->assoc_ms   = e->assoc_ms;
+    h->ip_ms      = e->ip_ms;
+    h->quarantine = joinhist_quarantined(bssid);
+    return 1;
+}
+
+
+/*
+ * Describe the history of 'bssid' for "scan"; returns the # of
+ * bytes written (0 if there is none).
+ */
+size_t
+joinhist_sprintf(char *buf, size_t bsiz, const uint8_t *bssid)
+{
+    bproto_joinhist h;
+
+    if (!joinhist_get(bssid, &h)) return 0;
+
+    return bproto_joinhist_sprintf(buf, bsiz, &h);
+}
+
+
+void
+joinhist_json(jsonw *w, const uint8_t *bssid)
+{
+    bproto_joinhist h;
+
+    if (!joinhist_get(bssid, &h)) return;
+
+    jsonw_key(w, "joins");
+    jsonw_obj_open(w);
+    jsonw_kv_uint(w, "attempts",   h.attempts);
+    jsonw_kv_uint(w, "ok",         h.ok);
+    jsonw_kv_uint(w, "failed",     h.fail);
+    jsonw_kv_uint(w, "streak",     h.streak);
+    jsonw_kv_uint(w, "assoc-ms",   h.assoc_ms);
+    jsonw_kv_uint(w, "ip-ms",      h.ip_ms);
+    jsonw_kv_uint(w, "quarantine", h.quarantine);
+    jsonw_obj_close(w);
+}
+
+/* EOF */
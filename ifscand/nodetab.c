@@ -0,0 +1,188 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * nodetab.c - aged table of scanned nodes
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * The driver's node list is a point in time: a BSSID that misses
+ *   one read is gone from it. Each read is merged into a table of
+ *   per-BSSID entries that remember when the BSSID was last seen,
+ *   a running average of its RSSI and how many reads in a row
+ *   missed it.
+ *
+ * * Entries not seen for "node-ttl" seconds are dropped. Snapshots
+ *   are built from the table with the average in place of the
+ *   instantaneous RSSI. Entries the last read missed are shown by
+ *   "scan" but db_filter_ap() doesn't offer them to join.
+ *
+ * * The table is kept sorted by BSSID; a read is merged with a
+ *   binary search per node and one sort of the result.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+#define NODETAB_MAX     512     // same as the most nodes we read
+
+
+struct nodeent
+{
+    struct ieee80211_nodereq nr;    // latest from the driver
+
+    int      avg;       // 16 x average RSSI
+    uint32_t miss;      // # of reads in a row without it
+    int64_t  seen;      // mono_ms of the last read that had it
+    uint64_t gen;       // read# that last had it
+};
+typedef struct nodeent nodeent;
+
+
+static nodeent  Tab[NODETAB_MAX];
+static size_t   Ntab = 0;
+static uint64_t Gen  = 0;
+
+
+static int
+bssid_cmp(const void *x, const void *y)
+{
+    const nodeent *a = x;
+    const nodeent *b = y;
+
+    return memcmp(a->nr.nr_bssid, b->nr.nr_bssid, 6);
+}
+
+
+/*
+ * Merge the 'n' nodes of a read into the table and append the live
+ * entries to 'nv', each with its average RSSI. Entries not seen for
+ * 'ttl' seconds are dropped.
+ *
+ * Return the # of nodes appended.
+ */
+size_t
+nodetab_merge(const struct ieee80211_nodereq *nr, size_t n, unsigned int ttl, nodevect *nv)
+{
+    int64_t now = mono_ms();
+    size_t  old = Ntab;
+    size_t  i, j;
+    nodeent key;
+
+    Gen++;
+    for (i = 0; i < n; i++) {
+        const struct ieee80211_nodereq *x = &nr[i];
+        nodeent *e;
+
+        memcpy(key.nr.nr_bssid, x->nr_bssid, 6);
+        e = old > 0 ? bsearch(&key, Tab, old, sizeof Tab[0], bssid_cmp) : 0;
+
+        if (e) {
+            e->avg += (x->nr_rssi * 16 - e->avg) / 4;
+        } else if (Ntab < NODETAB_MAX) {
+            e = &Tab[Ntab++];
+            e->avg = x->nr_rssi * 16;
+        } else {
+            continue;
+        }
+
+        e->nr   = *x;
+        e->miss = 0;
+        e->seen = now;
+        e->gen  = Gen;
+    }
+
+    for (i = j = 0; i < Ntab; i++) {
+        nodeent *e = &Tab[i];
+
+        if (e->gen != Gen) {
+            e->miss++;
+            if ((now - e->seen) >= (int64_t)ttl * 1000) continue;
+        }
+
+        if (i != j) Tab[j] = *e;
+        j++;
+    }
+
+    if (j < Ntab) debuglog("nodes: %zu aged out", Ntab - j);
+    Ntab = j;
+
+    qsort(Tab, Ntab, sizeof Tab[0], bssid_cmp);
+
+    VECT_RESERVE(nv, VECT_SIZE(nv) + Ntab);
+    for (i = 0; i < Ntab; i++) {
+        struct ieee80211_nodereq *y = &VECT_GET_NEXT(nv);
+
+        *y = Tab[i].nr;
+        y->nr_rssi = Tab[i].avg / 16;
+    }
+    return Ntab;
+}
+
+
+/*
+ * Return true if 'bssid' is in the table but the last read missed
+ * it.
+ */
+int
+nodetab_stale(const uint8_t *bssid)
+{
+    nodeent key, *e;
+
+    memcpy(key.nr.nr_bssid, bssid, 6);
+    e = Ntab > 0 ? bsearch(&key, Tab, Ntab, sizeof Tab[0], bssid_cmp) : 0;
+    return e && e->miss > 0;
+}
+
+
+/*
+ * Return the # of nodes in the table and how many of them the last
+ * read missed.
+ */
+size_t
+nodetab_stats(size_t *stale)
+{
+    size_t i, k = 0;
+
+    for (i = 0; i < Ntab; i++) {
+        if (Tab[i].miss > 0) k++;
+    }
+
+    *stale = k;
+    return Ntab;
+}
+
+/* EOF */
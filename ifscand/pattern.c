@@ -0,0 +1,217 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * pattern.c - match SSIDs against many glob patterns at once
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * Each pattern is filed under its literal prefix (the characters
+ *   before the first of "*?[\") in a trie. Patterns that start with
+ *   a wildcard are filed under their literal suffix, reversed, in a
+ *   second trie. The few that have neither are kept in a list.
+ *
+ * * Matching walks the SSID down the first trie and, reversed, down
+ *   the second; every pattern filed at a node on the way is a
+ *   candidate. "prefix*" and "*suffix" match by getting there;
+ *   anything else is confirmed with fnmatch(3).
+ *
+ * * Of several matching patterns, the one with the most literal
+ *   characters wins; a tie goes to the smaller pattern (strcmp).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fnmatch.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+#define PAT_SPECIAL     "*?[\\"
+
+
+/*
+ * Return the index of the child of 'n' for byte 'c', or 0 if there
+ * is none. (The roots are never anyone's child.)
+ */
+static uint32_t
+child(const patset *ps, uint32_t n, uint8_t c)
+{
+    uint32_t i;
+
+    for (i = VECT_ELEM(&ps->nodes, n).child; i; i = VECT_ELEM(&ps->nodes, i).next) {
+        if (VECT_ELEM(&ps->nodes, i).c == c) return i;
+    }
+    return 0;
+}
+
+
+static uint32_t
+add_child(patset *ps, uint32_t n, uint8_t c)
+{
+    uint32_t i = child(ps, n, c);
+    patnode  x;
+
+    if (i) return i;
+
+    memset(&x, 0, sizeof x);
+    x.c    = c;
+    x.next = VECT_ELEM(&ps->nodes, n).child;
+    i      = VECT_SIZE(&ps->nodes);
+    VECT_PUSH_BACK(&ps->nodes, x);
+
+    VECT_ELEM(&ps->nodes, n).child = i;
+    return i;
+}
+
+
+void
+patset_init(patset *ps)
+{
+    patnode root;
+
+    memset(ps, 0, sizeof *ps);
+    memset(&root, 0, sizeof root);
+
+    VECT_INIT(&ps->nodes, 64);
+    VECT_INIT(&ps->ents, 16);
+
+    // Two roots: 0 for prefixes, 1 for reversed suffixes.
+    VECT_PUSH_BACK(&ps->nodes, root);
+    VECT_PUSH_BACK(&ps->nodes, root);
+}
+
+
+void
+patset_fini(patset *ps)
+{
+    patent *e;
+
+    VECT_FOR_EACH(&ps->ents, e) {
+        free(e->pat);
+    }
+    VECT_FINI(&ps->ents);
+    VECT_FINI(&ps->nodes);
+    memset(ps, 0, sizeof *ps);
+}
+
+
+/*
+ * Add pattern 'pat' (a glob, as for fnmatch(3)) to 'ps'.
+ */
+void
+patset_add(patset *ps, const char *pat)
+{
+    size_t   len  = strlen(pat);
+    size_t   pre  = strcspn(pat, PAT_SPECIAL);
+    size_t   suf  = 0;
+    uint32_t n, *head;
+    patent   e;
+    size_t   i;
+
+    while (suf < len && !strchr(PAT_SPECIAL, pat[len - 1 - suf])) suf++;
+
+    memset(&e, 0, sizeof e);
+    if (!(e.pat = strdup(pat))) error(1, ENOMEM, "can't add pattern %s", pat);
+
+    for (i = 0; i < len; i++) {
+        if (!strchr(PAT_SPECIAL, pat[i])) e.lit++;
+    }
+
+    if (pre > 0) {
+        // "prefix*" needs no more checks once the prefix matched.
+        e.plain = 0 == strcmp(pat + pre, "*");
+        for (n = 0, i = 0; i < pre; i++) n = add_child(ps, n, pat[i]);
+        head = &VECT_ELEM(&ps->nodes, n).pats;
+    } else if (suf > 0) {
+        e.plain = len == suf + 1 && pat[0] == '*';
+        for (n = 1, i = 0; i < suf; i++) n = add_child(ps, n, pat[len - 1 - i]);
+        head = &VECT_ELEM(&ps->nodes, n).pats;
+    } else {
+        e.plain = 0 == strcmp(pat, "*");
+        head = &ps->rest;
+    }
+
+    e.next = *head;
+    *head  = VECT_SIZE(&ps->ents) + 1;
+    VECT_PUSH_BACK(&ps->ents, e);
+}
+
+
+/*
+ * Consider every pattern on the chain starting at 'i' for 'ssid';
+ * keep the best in '*best'.
+ */
+static void
+try_chain(const patset *ps, uint32_t i, const char *ssid, const patent **best)
+{
+    for (; i; i = VECT_ELEM(&ps->ents, i-1).next) {
+        const patent *e = &VECT_ELEM(&ps->ents, i-1);
+        const patent *b = *best;
+
+        if (b && (e->lit < b->lit || (e->lit == b->lit && strcmp(e->pat, b->pat) > 0))) continue;
+        if (!e->plain && 0 != fnmatch(e->pat, ssid, 0)) continue;
+
+        *best = e;
+    }
+}
+
+
+/*
+ * Return the best pattern in 'ps' that matches 'ssid', or null if
+ * none do.
+ */
+const char *
+patset_match(const patset *ps, const char *ssid)
+{
+    const patent *best = 0;
+    size_t   len = strlen(ssid);
+    uint32_t n;
+    size_t   i;
+
+    if (VECT_SIZE(&ps->ents) == 0) return 0;
+
+    for (n = 0, i = 0; i < len && (n = child(ps, n, ssid[i])); i++) {
+        try_chain(ps, VECT_ELEM(&ps->nodes, n).pats, ssid, &best);
+    }
+
+    for (n = 1, i = 0; i < len && (n = child(ps, n, ssid[len - 1 - i])); i++) {
+        try_chain(ps, VECT_ELEM(&ps->nodes, n).pats, ssid, &best);
+    }
+
+    try_chain(ps, ps->rest, ssid, &best);
+    return best ? best->pat : 0;
+}
+
+/* EOF */
@@ -0,0 +1,131 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * rankmap.c - compiled ap-order: AP name to rank
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * The table is open addressed with linear probing and at most
+ *   half full; a lookup is one hash and (usually) one strcmp.
+ *
+ * * The names are copied; what db_get() returns is only good until
+ *   the next DB call.
+ *
+ * * If a name appears more than once in the order, the first one
+ *   counts.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+#define RANKMAP_MINSLOTS    16
+
+
+/*
+ * Build 'rm' from 'len' bytes of NUL separated names in 'buf' (as
+ * stored under "aporder"); the first name has rank 0.
+ */
+void
+rankmap_init(rankmap *rm, const char *buf, size_t len)
+{
+    size_t nslots = RANKMAP_MINSLOTS;
+    size_t n = 0, i;
+    char  *p;
+
+    memset(rm, 0, sizeof *rm);
+    if (len == 0) return;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] == 0) n++;
+    }
+    if (buf[len-1] != 0) n++;   // unterminated last name
+
+    while (nslots < 2*n) nslots <<= 1;
+
+    rm->names = malloc(len + 1);
+    rm->off   = calloc(n, sizeof rm->off[0]);
+    rm->slot  = calloc(nslots, sizeof rm->slot[0]);
+    if (!rm->names || !rm->off || !rm->slot) error(1, ENOMEM, "can't allocate ap-order of %zu names", n);
+
+    memcpy(rm->names, buf, len);
+    rm->names[len] = 0;
+    rm->mask = nslots - 1;
+
+    for (p = rm->names; p < rm->names + len; p += strlen(p) + 1) {
+        uint32_t j = fnv64(p, strlen(p)) & rm->mask;
+
+        for (; rm->slot[j]; j = (j + 1) & rm->mask) {
+            if (0 == strcmp(rm->names + rm->off[rm->slot[j] - 1], p)) break;
+        }
+        if (rm->slot[j]) continue;      // seen before
+
+        rm->off[rm->n] = p - rm->names;
+        rm->slot[j]    = ++rm->n;
+    }
+}
+
+
+void
+rankmap_fini(rankmap *rm)
+{
+    free(rm->names);
+    free(rm->off);
+    free(rm->slot);
+    memset(rm, 0, sizeof *rm);
+}
+
+
+/*
+ * Return the rank of 'name', or RANK_NONE if it isn't ordered.
+ */
+uint32_t
+rankmap_get(const rankmap *rm, const char *name)
+{
+    uint32_t j;
+
+    if (rm->n == 0) return RANK_NONE;
+
+    for (j = fnv64(name, strlen(name)) & rm->mask; rm->slot[j]; j = (j + 1) & rm->mask) {
+        uint32_t r = rm->slot[j] - 1;
+
+        if (0 == strcmp(rm->names + rm->off[r], name)) return r;
+    }
+    return RANK_NONE;
+}
+
+/* EOF */
@@ -0,0 +1,134 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * rcache.c - cache of rendered command output
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * "list", "get" and "scan" produce the same bytes until the DB or
+ *   the scan snapshot changes. We keep the rendered output of the
+ *   last few (command, format) pairs along with the generation of
+ *   their source; a hit is sent without any formatting.
+ *
+ * * There is no explicit invalidation: every mutation bumps the
+ *   generation, so a stale entry simply misses and is re-rendered
+ *   in place.
+ *
+ * * Entries are replaced round robin; the set of distinct commands
+ *   is small.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+#define RC_SLOTS        8
+#define RC_IDLEN        48
+
+
+struct rcslot
+{
+    char     id[RC_IDLEN];
+    uint64_t gen;
+    uint64_t aux;
+    fast_buf buf;
+};
+typedef struct rcslot rcslot;
+
+
+static rcslot   Slots[RC_SLOTS];
+static uint32_t Next   = 0;     // next slot to replace
+static uint64_t Hits   = 0,
+                Misses = 0;
+
+
+static rcslot *
+rc_find(const char *id)
+{
+    rcslot *r;
+
+    for (r = &Slots[0]; r < &Slots[RC_SLOTS]; r++) {
+        if (r->id[0] && 0 == strcmp(r->id, id)) return r;
+    }
+    return 0;
+}
+
+
+fast_buf *
+rcache_get(const char *id, uint64_t gen, uint64_t aux)
+{
+    rcslot *r = rc_find(id);
+
+    if (r && r->gen == gen && r->aux == aux) {
+        Hits++;
+        return &r->buf;
+    }
+
+    Misses++;
+    return 0;
+}
+
+
+fast_buf *
+rcache_fill(const char *id, uint64_t gen, uint64_t aux)
+{
+    rcslot *r = rc_find(id);
+
+    if (!r) {
+        r = &Slots[Next];
+        Next = (Next + 1) % RC_SLOTS;
+
+        if (r->id[0]) fast_buf_fini(&r->buf);
+
+        fast_buf_init(&r->buf, IPC_DGRAMSZ);
+        strlcpy(r->id, id, sizeof r->id);
+    }
+
+    r->gen = gen;
+    r->aux = aux;
+    fast_buf_reset(&r->buf);
+    return &r->buf;
+}
+
+
+void
+rcache_stats(uint64_t *hits, uint64_t *misses)
+{
+    *hits   = Hits;
+    *misses = Misses;
+}
+
+/* EOF */
@@ -0,0 +1,246 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * roam.c - track roaming candidates while associated
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * While associated, every RSSI measurement also reads the
+ *   driver's node cache (SIOCG80211ALLNODES via ifstate_nodes(); no
+ *   new scan is started) and scores the remembered APs in it. The
+ *   score of a BSSID is a running average of its RSSI; the average
+ *   weighs the latest sample 1/4.
+ *
+ * * What we read isn't published as a scan snapshot: "scan wait"
+ *   and watchers only see scans done by the state machine.
+ *
+ * * Candidates are ordered the way db_filter_ap() orders them: by
+ *   ap-order rank, then by score. APs with the name of the current
+ *   AP and quarantined BSSIDs (joinhist.c) are left out.
+ *
+ * * When the current AP gets weak, roam_targets() hands out the
+ *   candidates seen by the last reading, if it is recent; the state
+ *   machine joins them without scanning first.
+ *
+ * * The table is small and fixed; BSSIDs not seen for a while are
+ *   dropped and the weakest one makes room for a new one.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "utils.h"
+#include "ifscand.h"
+
+#define ROAM_SLOTS      16
+#define ROAM_MAXAGE_MS  60000   // drop BSSIDs not seen for this long
+#define ROAM_FRESH_MS   30000   // max age of the last reading for roam_targets()
+
+
+struct roament
+{
+    apdata   d;         // as returned by db_filter_ap(); nr_xxx are the latest
+    int      score;     // average RSSI
+    uint32_t rank;      // ap-order rank; RANK_NONE if unranked
+    int64_t  seen;      // mono_ms of the last reading that had it
+};
+typedef struct roament roament;
+
+
+static roament  Cand[ROAM_SLOTS];
+static uint32_t Ncand = 0;
+static int64_t  Last  = 0;      // mono_ms of the last reading
+
+
+static roament *
+roam_find(const uint8_t *bssid)
+{
+    uint32_t i;
+
+    for (i = 0; i < Ncand; i++) {
+        if (0 == memcmp(Cand[i].d.nr_bssid, bssid, 6)) return &Cand[i];
+    }
+    return 0;
+}
+
+
+/*
+ * Return a slot for a new BSSID with RSSI 'rssi'; null if every
+ * tracked BSSID is stronger.
+ */
+static roament *
+roam_slot(int rssi)
+{
+    roament *e;
+    uint32_t i;
+
+    if (Ncand < ROAM_SLOTS) return &Cand[Ncand++];
+
+    for (e = &Cand[0], i = 1; i < Ncand; i++) {
+        if (Cand[i].score < e->score) e = &Cand[i];
+    }
+    return e->score < rssi ? e : 0;
+}
+
+
+static void
+roam_prune(int64_t now)
+{
+    uint32_t i, j;
+
+    for (i = j = 0; i < Ncand; i++) {
+        if ((now - Cand[i].seen) > ROAM_MAXAGE_MS) continue;
+        if (i != j) Cand[j] = Cand[i];
+        j++;
+    }
+    Ncand = j;
+}
+
+
+/*
+ * Read the node cache and update the scores of the remembered APs
+ * in it, except those named like the current AP.
+ */
+void
+roam_track(ifstate *ifs)
+{
+    int64_t  now = mono_ms();
+    nodevect nv;
+    apvect   av;
+    apdata  *d;
+
+    VECT_INIT(&nv, 64);
+
+    int r = ifstate_nodes(ifs, &nv);
+    if (r < 0) {
+        debuglog("roam: can't read node cache: %s", strerror(-r));
+        VECT_FINI(&nv);
+        return;
+    }
+
+    VECT_INIT(&av, 8);
+    db_filter_ap(ifs->db, &av, &nv);
+
+    VECT_FOR_EACH(&av, d) {
+        int      rssi = RSSI(d);
+        roament *e;
+
+        if (0 == strcmp(d->apname, ifs->curap.apname)) continue;
+
+        if ((e = roam_find(d->nr_bssid))) {
+            e->score = e->score - (e->score / 4) + (rssi / 4);
+        } else if ((e = roam_slot(rssi))) {
+            e->score = rssi;
+        } else {
+            continue;
+        }
+
+        e->d    = *d;
+        e->rank = rankmap_get(&ifs->db->ranks, d->apname);
+        e->seen = now;
+    }
+
+    VECT_FINI(&av);
+    VECT_FINI(&nv);
+
+    roam_prune(now);
+    Last = now;
+
+    if (Ncand > 0) {
+        const roament *b = &Cand[0];
+        uint32_t i;
+
+        for (i = 1; i < Ncand; i++) {
+            if (Cand[i].seen == now && Cand[i].score > b->score) b = &Cand[i];
+        }
+        debuglog("roam: %u candidates; strongest %s [" MACFMT "] score %d",
+                 Ncand, b->d.apname, sMAC(b->d.nr_bssid), b->score);
+    }
+}
+
+
+static int
+roament_cmp(const void *x, const void *y)
+{
+    const roament *a = *(roament * const *)x;
+    const roament *b = *(roament * const *)y;
+
+    if (a->rank  != b->rank)  return a->rank < b->rank ? -1 : 1;
+    if (a->score != b->score) return a->score > b->score ? -1 : 1;
+    return 0;
+}
+
+
+/*
+ * Put the candidates of the last reading in 'av', best first;
+ * nothing if the reading is too old. APs named 'cur' are left out.
+ *
+ * Return the # of candidates.
+ */
+size_t
+roam_targets(apvect *av, const char *cur)
+{
+    roament *v[ROAM_SLOTS];
+    size_t   i, n = 0;
+
+    VECT_RESET(av);
+    if (Last == 0 || (mono_ms() - Last) > ROAM_FRESH_MS) return 0;
+
+    for (i = 0; i < Ncand; i++) {
+        roament *e = &Cand[i];
+
+        if (e->seen != Last)                        continue;
+        if (0 == strcmp(e->d.apname, cur))          continue;
+        if (joinhist_quarantined(e->d.nr_bssid))    continue;
+        v[n++] = e;
+    }
+
+    qsort(v, n, sizeof v[0], roament_cmp);
+    for (i = 0; i < n; i++) VECT_PUSH_BACK(av, v[i]->d);
+
+    return n;
+}
+
+
+/*
+ * Forget all candidates.
+ */
+void
+roam_reset(void)
+{
+    Ncand = 0;
+    Last  = 0;
+}
+
+/* EOF */
@@ -51,6 +51,10 @@ static void check_dhcp(ifstate *);
 static void cleanup_state(ifstate *ifs);
 static void reopen_std_fds(void);
 static int connect_ap(ifstate *s, const apdata *ap);
+static int join_ranked(ifstate *ifs, apvect *av, size_t nav, apdata **pd, const char *skip);
+static void join_result(ifstate *ifs, const apdata *d, int r);
+static int roam(ifstate *ifs);
+static void post_candidates(apvect *av);
 
 /*
  * Measure RSSI and compare against previous values to determine if
@@ -79,6 +83,64 @@ same_ap(const apdata *a, const apdata *b)
 }
 
 
+/*
+ * Finish a pending "join" with 'status'.
+ */
+static void
+join_done(ifstate *ifs, int status)
+{
+    defer_complete(ifs, DEFER_JOIN, ifs->joinreq, status);
+    ifs->joinreq[0] = 0;
+}
+
+
+/*
+ * Milliseconds since 't0' (CLOCK_MONOTONIC).
+ */
+static long long
+elapsed_ms(const struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1000LL + (t1.tv_nsec - t0->tv_nsec) / 1000000;
+}
+
+
+/*
+ * Tell subscribers if the set of visible remembered APs changed
+ * since the last scan.
+ */
+static void
+post_candidates(apvect *av)
+{
+    static uint32_t last = 0;
+    uint32_t h = 2166136261u;   // FNV-1a over the names
+    apdata *d;
+
+    VECT_FOR_EACH(av, d) {
+        const uint8_t *p = (const uint8_t *)d->apname;
+
+        for (; *p; p++) h = (h ^ *p) * 16777619u;
+        h = (h ^ 0xff) * 16777619u;
+    }
+
+    if (h == last) return;
+    last = h;
+
+    char buf[200];
+    size_t n = 0;
+
+    buf[0] = 0;
+    VECT_FOR_EACH(av, d) {
+        if (n >= sizeof buf) break;
+        n += snprintf(buf+n, (sizeof buf) - n, " \"%s\"", d->apname);
+    }
+
+    event_post("candidates", "n=%zu%s", VECT_SIZE(av), buf);
+}
+
+
 /*
  * Scan for WiFi or measure RSSI.
  *
@@ -92,6 +154,9 @@ wifi_scan(ifstate *ifs)
     int r;
     int low_rssi = 0;
 
+    // The event loop calls us again when the active scan is done.
+    if (ascan_running()) return 0;
+
     if (ifs->associated) {
         apdata *ap = &ifs->curap;
 
@@ -101,10 +166,23 @@ wifi_scan(ifstate *ifs)
         }
 
         r = check_rssi(ifs);
-        if (r < 0 || r > 0) return r;
+        if (r < 0) return r;
+
+        // A pending "join" needs a scan regardless of RSSI.
+        if (r > 0 && !ifs->joinreq[0]) {
+            roam_track(ifs);
+            return r;
+        }
 
-        // RSSI is at critical point. Scan.
-        low_rssi = 1;
+        // RSSI is at critical point. Roam to the best candidate we
+        // know of; scan if there is none (or none joins).
+        low_rssi = r == 0;
+        if (low_rssi && !ifs->joinreq[0] && roam(ifs)) return 0;
+        if (!ifs->associated) {
+            // Dropped by a failed roam; the node cache is stale.
+            if (ascan_start(ifs, "disassociated") > 0) return 0;
+            low_rssi = 0;
+        }
     } 
 
     do_scan(ifs, low_rssi);
@@ -116,63 +194,214 @@ wifi_scan(ifstate *ifs)
 static void
 do_scan(ifstate *ifs, int low_rssi)
 {
-    int r = ifstate_scan(ifs);
+    int was = ifs->associated;
+    int r   = ifstate_scan(ifs);
     if (r < 0) {
         printlog(LOG_ERR, "can't scan: %s", strerror(-r));
         error(1, -r, "can't scan %s", ifs->ifname);
     }
 
     apvect av;
+    scansnap *snap = ifstate_snap(ifs);
 
     VECT_INIT(&av, 8);
 
     // Filter out the nodes we don't want.
-    db_filter_ap(ifs->db, &av, &ifs->nv);
+    db_filter_ap(ifs->db, &av, &snap->nv);
 
-    if (VECT_SIZE(&av) == 0) {
-        if (ifs->associated) disconnect_ap(ifs, &ifs->curap);
+    if (event_active()) post_candidates(&av);
 
-        db_get_uint(ifs->db, "scan-int", &ifs->timeout);
-        ifs->associated = 0;
-        goto end;
+    // APs that keep failing to join are tried last - if at all.
+    size_t      nav = joinhist_demote(&av);
+    apdata     *d   = 0;
+    const char *why = low_rssi ? "low-rssi" : "better-ap";
+
+    // An explicit "join" overrides our own choice.
+    if (ifs->joinreq[0]) {
+        apdata *x;
+
+        VECT_FOR_EACH(&av, x) {
+            if (0 == strcmp(x->apname, ifs->joinreq)) {
+                d = x;
+                break;
+            }
+        }
+
+        if (!d) {
+            join_done(ifs, -ENOENT);
+        } else if (ifs->associated && same_ap(&ifs->curap, d)) {
+            join_done(ifs, 0);
+            goto end;
+        } else {
+            why = "join";
+        }
     }
 
+    if (!d) {
+        if (nav == 0) {
+            if (ifs->associated) disconnect_ap(ifs, &ifs->curap,
+                                               VECT_SIZE(&av) ? "quarantined" : "not-visible");
 
-    /* Pick the first node in the list.
-     * However, this might be the same one we are currently
-     * associated with _and_ in LOW_RSSI situation..
-     */
-    apdata *d = &VECT_ELEM(&av, 0);
+            db_get_uint(ifs->db, "scan-int", &ifs->timeout);
+            ifs->associated = 0;
+            goto end;
+        }
 
-    if (ifs->associated) {
-        apdata *ap = &ifs->curap;
+        /* Pick the first node in the list.
+         * However, this might be the same one we are currently
+         * associated with _and_ in LOW_RSSI situation..
+         */
+        d = &VECT_ELEM(&av, 0);
+
+        if (ifs->associated) {
+            apdata *ap = &ifs->curap;
 
-        if (same_ap(ap, d)) {
-            if (!low_rssi)           goto end;
-            if (VECT_SIZE(&av) == 1) goto end;
+            if (same_ap(ap, d)) {
+                if (!low_rssi) goto end;
+                if (nav == 1)  goto end;
 
-            d = &VECT_ELEM(&av, 1);
-            debuglog("Cur AP %s: Low RSSI; picking next AP %s", ap->apname, d->apname);
+                d = &VECT_ELEM(&av, 1);
+                debuglog("Cur AP %s: Low RSSI; picking next AP %s", ap->apname, d->apname);
+            }
         }
-        disconnect_ap(ifs, ap);
     }
 
-    r = connect_ap(ifs, d);
+    // The weak AP we are leaving is not a fallback.
+    char weak[AP_NAMELEN];
+
+    weak[0] = 0;
+    if (ifs->associated && low_rssi) strlcpy(weak, ifs->curap.apname, sizeof weak);
+
+    if (ifs->associated) disconnect_ap(ifs, &ifs->curap, why);
+
+    // An explicit "join" is for that AP alone.
+    r = join_ranked(ifs, &av, ifs->joinreq[0] ? 0 : nav, &d, weak);
+    join_result(ifs, d, r);
+
+    if (ifs->joinreq[0]) join_done(ifs, r > 0 ? 0 : -EIO);
+
+end:
+    // Look around properly before the next attempt.
+    if (was && !ifs->associated) ascan_start(ifs, "disassociated");
+
+    VECT_FINI(&av);
+    snap_put(snap);
+}
+
+
+/*
+ * Update the state machine after join_ranked() returned 'r' for
+ * the AP 'd'.
+ */
+static void
+join_result(ifstate *ifs, const apdata *d, int r)
+{
     if (r > 0) {
         ifs->associated = 1;
 
         db_get_uint(ifs->db, "rssi-scan-int", &ifs->timeout);
         rssi_avg_init(&ifs->avg);
         rssi_avg_add_sample(&ifs->avg, RSSI(&ifs->curap));
+
+        // Candidates are relative to where we are now.
+        roam_reset();
     } else {
-        printlog(LOG_ERR, "can't connect to AP '%s': %s", d->apname, strerror(-r));
+        printlog(LOG_ERR, "can't connect to AP '%s'", d->apname);
 
         ifs->associated = 0;
         db_get_uint(ifs->db, "scan-int", &ifs->timeout);
     }
+}
+
+
+/*
+ * Leave the current (weak) AP for the best candidate found by
+ * roam_track(); no scan is done.
+ *
+ * Return true if we joined one; false if there were no candidates
+ * (still associated) or none joined (not associated).
+ */
+static int
+roam(ifstate *ifs)
+{
+    char    weak[AP_NAMELEN];
+    apvect  av;
+    apdata *d;
+    size_t  n;
+    int     r;
+
+    VECT_INIT(&av, 8);
+
+    if ((n = roam_targets(&av, ifs->curap.apname)) == 0) {
+        VECT_FINI(&av);
+        return 0;
+    }
+
+    d = &VECT_ELEM(&av, 0);
+    strlcpy(weak, ifs->curap.apname, sizeof weak);
+    printlog(LOG_INFO, "AP %s: low RSSI; roaming to %s [" MACFMT "]",
+             weak, d->apname, sMAC(d->nr_bssid));
+
+    disconnect_ap(ifs, &ifs->curap, "low-rssi");
+
+    r = join_ranked(ifs, &av, n, &d, weak);
+    join_result(ifs, d, r);
 
-end:
     VECT_FINI(&av);
+    return r > 0;
+}
+
+
+/*
+ * Join '*pd'. If that fails, try the other candidates among the
+ * first 'nav' of 'av', in order, until one joins or
+ * IFSCAND_JOIN_BUDGET_MS is spent; no attempt takes longer than
+ * IFSCAND_JOIN_TRY_MS. An attempt the budget cuts short isn't held
+ * against the AP (see connect_ap()). APs named 'skip' are not
+ * tried.
+ *
+ * '*pd' is set to the last AP tried. Returns the result of
+ * connect_ap() for it.
+ */
+static int
+join_ranked(ifstate *ifs, apvect *av, size_t nav, apdata **pd, const char *skip)
+{
+    int64_t end = mono_ms() + IFSCAND_JOIN_BUDGET_MS;
+    apdata *d   = *pd;
+    size_t  i   = 0;
+    int     r;
+
+    while (1) {
+        int64_t now = mono_ms();
+
+        ifs->joindeadline = now + IFSCAND_JOIN_TRY_MS;
+        if (ifs->joindeadline > end) ifs->joindeadline = end;
+
+        r = connect_ap(ifs, d);
+        if (r > 0) break;
+
+        // Next candidate that isn't the one we just tried.
+        for (; i < nav; i++) {
+            apdata *x = &VECT_ELEM(av, i);
+
+            if (x == *pd) continue;
+            if (skip[0] && 0 == strcmp(x->apname, skip)) continue;
+            break;
+        }
+
+        if (i == nav) break;
+        if (mono_ms() >= end) {
+            printlog(LOG_INFO, "join budget of %d ms spent; giving up", IFSCAND_JOIN_BUDGET_MS);
+            break;
+        }
+
+        printlog(LOG_INFO, "can't connect to AP '%s'; trying '%s'", d->apname, VECT_ELEM(av, i).apname);
+        d = &VECT_ELEM(av, i++);
+    }
+
+    ifs->joindeadline = 0;
+    *pd = d;
+    return r;
 }
 
 
@@ -193,6 +422,7 @@ check_rssi(ifstate *ifs)
     int avg = rssi_avg_value(&ifs->avg);
 
     debuglog("AP %s: RSSI %d, AVG %d", cur->apname, r, avg);
+    event_post("rssi", "nwid=\"%s\" rssi=%d avg=%d", cur->apname, r, avg);
     return avg >= 0 && avg < IFSCAND_RSSI_LOWEST ? 0 : 1;
 }
 
@@ -345,34 +575,53 @@ ifconfig_up(ifstate *s, const apdata *ap)
 static int
 connect_ap(ifstate *s, const apdata *ap)
 {
+    struct timespec t0;
     int r;
+
     printlog(LOG_INFO, "connecting to AP \"%s\"", ap->apname);
+    event_post("join-start", "nwid=\"%s\"", ap->apname);
 
+    clock_gettime(CLOCK_MONOTONIC, &t0);
     r = ifstate_config(s, ap, &s->curap);
     if (r < 0) {
         printlog(LOG_INFO, "can't configure interface for AP '%s': %s",
                     ap->apname, strerror(-r));
+        event_post("join-done", "nwid=\"%s\" ms=%lld error=\"%s\"",
+                   ap->apname, elapsed_ms(&t0), strerror(-r));
+
+        // We ran out of time (join_ranked()); that says nothing
+        // about the AP.
+        if (r == -ETIMEDOUT) return 0;
+
+        int q = joinhist_record(s->db, ap->nr_bssid, 0, 0, 0);
+        if (q > 0) {
+            const uint8_t *b = ap->nr_bssid;
+            printlog(LOG_INFO, "AP '%s' [" MACFMT "]: quarantined for %d seconds",
+                     ap->apname, sMAC(b), q);
+        }
         return 0;
     }
 
+    long long assoc = elapsed_ms(&t0);
+
+    const uint8_t *m = s->curap.nr_bssid;
+    event_post("join-done", "nwid=\"%s\" bssid=" MACFMT " ms=%lld",
+               ap->apname, sMAC(m), assoc);
+
     /*
      * If we are asked to only configure link layer, we forego
-     * configuring IP Addresses
+     * configuring IP Addresses. dhclient runs on its own; its time
+     * isn't counted.
      */
     if (Linklayer) {
         printlog(LOG_INFO, "skipping IP address configuration for %s..", ap->apname);
-        return 1;
-    }
-
-    if (ap->flags & AP_IN4DHCP) {
+    } else if (ap->flags & AP_IN4DHCP) {
         start_dhcp(s);
-        return 1;
-    }
-
-    if ((ap->flags & (AP_IN4|AP_IN6))) {
+    } else if ((ap->flags & (AP_IN4|AP_IN6))) {
         ifconfig_up(s, ap);
     }
 
+    joinhist_record(s->db, ap->nr_bssid, 1, assoc, elapsed_ms(&t0) - assoc);
     return 1;
 }
 
@@ -381,11 +630,12 @@ connect_ap(ifstate *s, const apdata *ap)
  * Disconnect from 'ap'.
  */
 int
-disconnect_ap(ifstate *s, apdata *ap)
+disconnect_ap(ifstate *s, apdata *ap, const char *why)
 {
     if (0 == strlen(ap->apname)) return 1;
 
     printlog(LOG_INFO, "disconnecting from AP \"%s\"", ap->apname);
+    event_post("disconnect", "nwid=\"%s\" reason=%s", ap->apname, why);
 
     ifstate_unconfig(s);
 
@@ -441,6 +691,7 @@ start_dhcp(ifstate *ifs)
     }
 
     debuglog("Started dhclient %s: PID %d", ifs->ifname, pid);
+    event_post("dhcp", "state=started pid=%d", pid);
 
     // Parent
     Dhpid = pid;
@@ -457,6 +708,7 @@ stop_dhcp()
 
         waitpid(Dhpid, &r, 0);
         debuglog("Stopped dhclient pid %d", Dhpid);
+        event_post("dhcp", "state=stopped pid=%d", Dhpid);
 
         Dhpid = -1;
     }
@@ -486,9 +738,11 @@ check_dhcp(ifstate *s)
         if (x != 0) {
             printlog(LOG_ERR, "dhclient exited abnormally with %d", x);
         }
+        event_post("dhcp", "state=exited code=%d", x);
     } else if (WIFSIGNALED(r)) {
         int sig = WTERMSIG(r);
         printlog(LOG_ERR, "dhclient caught signal %d and aborted", sig);
+        event_post("dhcp", "state=killed signal=%d", sig);
     }
 }
 
@@ -499,7 +753,7 @@ cleanup_state(ifstate *ifs)
 {
     closelog(); // syslog
     close(ifs->scanfd);
-    db_close(ifs->db);
+    db_child_close(ifs->db);
 }
 
 // redirect 0,1,2 to /dev/null
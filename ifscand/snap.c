@@ -0,0 +1,207 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * snap.c - Immutable, reference counted scan snapshots
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * Every completed scan is published as a new snapshot; the
+ *   previous one is never modified after it is published.
+ *
+ * * Readers (state machine, IPC commands) take a reference with
+ *   ifstate_snap() and drop it with snap_put(). A snapshot is
+ *   reclaimed when the last reference goes away.
+ *
+ * * The daemon is single threaded; so reference counts don't need
+ *   atomics. Holding a reference merely guarantees that a later
+ *   scan won't pull the nodes out from under a reader.
+ *
+ * * Reclaimed snapshots are kept on a short freelist so that we
+ *   don't malloc a new node vector on every scan.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include "utils.h"
+#include "jsonw.h"
+#include "ifscand.h"
+
+#define SNAP_FREELIST   2
+
+static scansnap *Free[SNAP_FREELIST];
+static int       Nfree = 0;
+static uint32_t  Nlive = 0;
+
+
+/*
+ * Return an empty, unpublished snapshot with one reference.
+ */
+scansnap *
+snap_new(void)
+{
+    scansnap *s;
+
+    if (Nfree > 0) {
+        s = Free[--Nfree];
+        VECT_RESET(&s->nv);
+    } else {
+        s = NEWZ(scansnap);
+        if (!s) error(1, ENOMEM, "can't allocate scan snapshot");
+
+        VECT_INIT(&s->nv, 16);
+    }
+
+    s->refs = 1;
+    s->seq   = 0;
+    s->when  = 0;
+    s->fresh = 0;
+    Nlive++;
+    return s;
+}
+
+
+/*
+ * Drop a reference to 's'; reclaim it if this was the last one.
+ */
+void
+snap_put(scansnap *s)
+{
+    if (!s) return;
+
+    assert(s->refs > 0);
+    if (--s->refs > 0) return;
+
+    Nlive--;
+    if (Nfree < SNAP_FREELIST) {
+        Free[Nfree++] = s;
+        return;
+    }
+
+    VECT_FINI(&s->nv);
+    DEL(s);
+}
+
+
+/*
+ * Publish 's' as the latest snapshot of 'ifs'. The caller's
+ * reference is transferred to 'ifs'.
+ */
+void
+snap_publish(ifstate *ifs, scansnap *s)
+{
+    scansnap *old = ifs->snap;
+
+    s->seq   = ++ifs->snapseq;
+    s->when  = time(0);
+    ifs->snap = s;
+
+    snap_put(old);
+
+    event_post("scan", "seq=%llu nodes=%zu fresh=%d", (unsigned long long)s->seq,
+               VECT_SIZE(&s->nv), s->fresh);
+    defer_complete(ifs, DEFER_SCAN, 0, 0);
+}
+
+
+/*
+ * Return a reference to the latest snapshot of 'ifs' or NULL if
+ * we haven't scanned yet. Caller must snap_put() it when done.
+ */
+scansnap *
+ifstate_snap(ifstate *ifs)
+{
+    scansnap *s = ifs->snap;
+
+    if (s) s->refs++;
+    return s;
+}
+
+
+/*
+ * Return number of snapshots that are still referenced.
+ */
+uint32_t
+snap_live(void)
+{
+    return Nlive;
+}
+
+
+/*
+ * Render the nodes of 'snap' into 'b' as text or json; the output
+ * of "scan".
+ */
+void
+snap_render(scansnap *snap, fast_buf *b, int json)
+{
+    nodevect *apv = &snap->nv;
+    struct ieee80211_nodereq *nr;
+    char buf[1024];
+
+    if (json) {
+        jsonw jw;
+
+        jsonw_init(&jw, b);
+        jsonw_arr_open(&jw);
+        VECT_FOR_EACH(apv, nr) {
+            jsonw_obj_open(&jw);
+            nodereq_json_fields(&jw, nr);
+            joinhist_json(&jw, nr->nr_bssid);
+            jsonw_obj_close(&jw);
+        }
+        jsonw_arr_close(&jw);
+        return;
+    }
+
+    if (VECT_SIZE(apv) == 0) {
+        snprintf(buf, sizeof buf, "ERROR: no access points visible");
+        fast_buf_push(b, buf, strlen(buf));
+        return;
+    }
+
+    VECT_FOR_EACH(apv, nr) {
+        ssize_t n = nodereq_sprintf(buf, (sizeof buf)-2, nr);
+
+        n += joinhist_sprintf(buf+n, (sizeof buf)-2-n, nr->nr_bssid);
+        buf[n++] = '\n';
+        buf[n]   = 0;
+
+        fast_buf_push(b, buf, n);
+    }
+}
+
+/* EOF */
@@ -0,0 +1,1011 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * apdata.c - Parse and format access point and scan records.
+ *
+ * Shared by ifscand and ifscanctl.
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/param.h>  // isset()
+
+#include "utils.h"
+#include "common.h"
+#include "jsonw.h"
+
+// "add" keyword parser
+typedef int kwparser(apdata *d, char* val);
+
+struct kwpair
+{
+    const char *name;
+    kwparser *fp;
+};
+typedef struct kwpair kwpair;
+
+
+/*
+ * "add" keyword parsers.
+ */
+static int parse_apmac(apdata *d, char *val);
+static int parse_mymac(apdata *d, char *val);
+static int parse_in4mask(apdata *d, char *val);
+static int parse_in6mask(apdata *d, char *val);
+static int parse_gw4(apdata *d, char *val);
+static int parse_gw6(apdata *d, char *val);
+
+static int parse_wpakey(apdata *d, char *val);
+static int parse_wepkey(apdata *d, char *val);
+static int parse_nwid(apdata *d, char *val);
+static int parse_pattern(apdata *d, char *val);
+
+
+static const kwpair Add_kw[] = {
+      {"nwid",      parse_nwid}
+    , {"pattern",   parse_pattern}
+    , {"lladdr",    parse_mymac}
+    , {"wpakey",    parse_wpakey}
+    , {"nwkey",     parse_wepkey}
+    , {"bssid",     parse_apmac}
+    , {"inet",      parse_in4mask}
+    , {"inet6",     parse_in6mask}
+    , {"gw",        parse_gw4}
+    , {"gw6",       parse_gw6}
+    , {0, 0}
+};
+
+
+/*
+ * Parse 'n' colon separated hex octets.
+ */
+static int
+parse_octets(unsigned char *dest, int n, char *s)
+{
+    int i;
+    char *p;
+
+    for (i = 0; i < n; i++) {
+        int v = strtol(s, &p, 16);
+        if (p == s || v > 0xff || v < 0) return 0;
+        switch (*p) {
+            case ':':
+                if (i == n-1) return 0;
+                break;
+            case 0:
+                if (i != n-1) return 0;
+                break;
+            default:
+                return 0;
+        }
+
+        *dest++ = 0xff & v;
+        s = p + 1;
+    }
+
+    return 1;
+}
+
+
+static int
+parse_mac(unsigned char *dest, char *s)
+{
+    return parse_octets(dest, 6, s);
+}
+
+
+static int
+parse_in4mask(apdata *d, char *s)
+{
+    if (0 == strcmp(s, "dhcp")) {
+        d->flags |= AP_IN4DHCP;
+        return 1;
+    }
+
+    char *mask = strchr(s, '/');
+    if (mask) {
+        *mask = 0;
+
+        // see if it looks like an IP address.
+        if (1 != inet_pton(AF_INET, mask+1, &d->mask4)) {
+            const char *err;
+            int v = strtonum(mask+1, 0, 32, &err);
+            if (err)     return 0;
+
+            d->mask4.s_addr = htonl(~((1 << (32 -v))-1));
+        }
+
+    } else {
+        d->mask4.s_addr = 0xffffffff;
+    }
+
+    if (1 != inet_pton(AF_INET, s, &d->in4)) return 0;
+
+    d->flags |= AP_IN4;
+    return 1;
+}
+
+static int
+parse_gw4(apdata *d, char *s)
+{
+    if (1 == inet_pton(AF_INET, s, &d->gw4)) {
+        d->flags |= AP_GW4;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static int
+parse_in6mask(apdata *d, char *s)
+{
+    char *mask = strchr(s, '/');
+    if (mask) {
+        *mask = 0;
+        if (1 != inet_pton(AF_INET6, mask+1, &d->mask6)) {
+            const char *err;
+            int v = strtonum(mask+1, 0, 128, &err);
+            if (err)    return 0;
+            if (v == 0 || v == 128) {
+                memset(&d->mask6.s6_addr, 0xff, sizeof d->mask6.s6_addr);
+            } else {
+                uint8_t *p;
+                memset(&d->mask6.s6_addr, 0x00, sizeof d->mask6.s6_addr);
+                for (p = (uint8_t*)&d->mask6.s6_addr; v > 7; v -= 8) {
+                    *p++ = 0xff;
+                }
+                if (v)    *p = (0xff << (8-v));
+            }
+        }
+    } else {
+        memset(&d->mask6.s6_addr, 0xff, sizeof d->mask6.s6_addr);
+    }
+
+    if (1 != inet_pton(AF_INET6, s, &d->in6)) return 0;
+
+    d->flags |= AP_IN6;
+    return 1;
+}
+
+
+static int
+parse_gw6(apdata *d, char *s)
+{
+    if (1 == inet_pton(AF_INET6, s, &d->gw6)) {
+        d->flags |= AP_GW6;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static int
+cmp_bss(const void *a, const void *b)
+{
+    return memcmp(a, b, 6);
+}
+
+
+static int
+cmp_oui(const void *a, const void *b)
+{
+    return memcmp(a, b, 3);
+}
+
+
+/*
+ * Sort and de-duplicate 'n' entries of 'sz' bytes in 'v'.
+ *
+ * Return the new count.
+ */
+static uint32_t
+sort_uniq(uint8_t *v, uint32_t n, size_t sz, int (*cmp)(const void *, const void *))
+{
+    uint32_t i, j;
+
+    if (n == 0) return 0;
+
+    qsort(v, n, sz, cmp);
+    for (i = j = 1; i < n; i++) {
+        if (0 == (*cmp)(v + (i * sz), v + ((j-1) * sz))) continue;
+        memmove(v + (j * sz), v + (i * sz), sz);
+        j++;
+    }
+    return j;
+}
+
+
+/*
+ * BSSID[,BSSID|OUI...]; an OUI is the first three octets of a
+ * BSSID, optionally followed by ":*".
+ */
+static int
+parse_apmac(apdata *d, char *s)
+{
+    char *p;
+
+    d->nbss = 0;
+    d->noui = 0;
+
+    for (p = strsep(&s, ","); p; p = strsep(&s, ",")) {
+        size_t n = strlen(p);
+
+        if (n > 2 && 0 == strcmp(p + n - 2, ":*")) p[n-2] = 0;
+
+        if (d->nbss < AP_MAXBSS && parse_mac(d->bss[d->nbss], p)) {
+            d->nbss++;
+        } else if (d->noui < AP_MAXOUI && parse_octets(d->oui[d->noui], 3, p)) {
+            d->noui++;
+        } else {
+            return 0;
+        }
+    }
+
+    d->nbss = sort_uniq(&d->bss[0][0], d->nbss, 6, cmp_bss);
+    d->noui = sort_uniq(&d->oui[0][0], d->noui, 3, cmp_oui);
+
+    // 'apmac' stays meaningful for records that have one BSSID.
+    if (d->nbss > 0) memcpy(d->apmac, d->bss[0], 6);
+
+    d->flags |= AP_BSSID;
+    if (d->nbss > 1 || d->noui > 0) d->flags |= AP_BSSIDSET;
+    else                            d->flags &= ~AP_BSSIDSET;
+    return 1;
+}
+
+
+int
+apdata_bssid_ok(const apdata *d, const uint8_t *bssid)
+{
+    if (!(d->flags & AP_BSSID)) return 1;
+
+    if (d->nbss > 0 && bsearch(bssid, d->bss, d->nbss, 6, cmp_bss)) return 1;
+    if (d->noui > 0 && bsearch(bssid, d->oui, d->noui, 3, cmp_oui)) return 1;
+    return 0;
+}
+
+
+static int
+parse_mymac(apdata *d, char *s)
+{
+    if (0 == strcmp("random", s)) {
+        d->flags |= AP_RANDMAC|AP_MYMAC;
+        return 1;
+    }
+
+    if (parse_mac(d->mymac, s)) {
+        d->flags |= AP_MYMAC;
+        return 1;
+    }
+    return 0;
+}
+
+
+static int
+parse_wpakey(apdata *d, char *s)
+{
+    strlcpy(d->key, s, sizeof d->key);
+    d->flags |= AP_WPAKEY;
+    return 1;
+}
+
+static int
+parse_wepkey(apdata *d, char *s)
+{
+    strlcpy(d->key, s, sizeof d->key);
+    d->flags |= AP_WEPKEY;
+    return 1;
+}
+
+
+static int
+parse_nwid(apdata *d, char *s)
+{
+    if (d->flags & AP_PATTERN) return 0;
+
+    strlcpy(d->apname, s, sizeof d->apname);
+    d->flags |= AP_NWID;
+    return 1;
+}
+
+
+static int
+parse_pattern(apdata *d, char *s)
+{
+    if ((d->flags & AP_NWID) || *s == 0) return 0;
+
+    strlcpy(d->apname, s, sizeof d->apname);
+    d->flags |= AP_NWID|AP_PATTERN;
+    return 1;
+}
+
+
+static kwparser *
+find_parser(const char *kw)
+{
+    const kwpair *a = Add_kw;
+
+    for (; a->name; a++) {
+        if (0 == strcmp(kw, a->name)) return a->fp;
+    }
+    return 0;
+}
+
+
+/*
+ * Parse the "add" keywords in 'args' into 'd' and validate the
+ * result.
+ *
+ * Return:
+ *    0 on success
+ *    -EINVAL on failure with a description in 'err'
+ */
+int
+apdata_parse(apdata *d, char **args, int argc, char *err, size_t errsz)
+{
+    int i;
+
+#define ERR(fmt, ...)   do { \
+                            snprintf(err, errsz, fmt, ##__VA_ARGS__); \
+                            return -EINVAL; \
+                        } while (0)
+
+    if (argc < 1)  ERR("insufficient arguments to 'add'");
+    if (argc > 12) ERR("too many arguments to 'add'");
+    if (0 != (argc % 2)) ERR("incomplete arguments to 'add'");
+
+    memset(d, 0, sizeof *d);
+    for (i = 0; i < argc; i += 2) {
+        char *kw  = args[i];
+        char *val = args[i+1];
+
+        kwparser *fp = find_parser(kw);
+        if (!fp) ERR("unknown keyword %s in 'add'", kw);
+
+        if (!(*fp)(d, val)) ERR("malformed value %s for %s in 'add'", val, kw);
+    }
+
+    return apdata_validate(d, err, errsz);
+}
+
+
+/*
+ * Verify that the combination of keywords in 'd' makes sense.
+ *
+ * Return:
+ *    0 on success
+ *    -EINVAL on failure with a description in 'err'
+ */
+int
+apdata_validate(const apdata *d, char *err, size_t errsz)
+{
+    uint32_t flags = d->flags;
+
+    if (! (flags & AP_NWID)) ERR("missing AP name");
+
+    if ( (flags & (AP_WPAKEY|AP_WEPKEY)) == (AP_WPAKEY|AP_WEPKEY))
+        ERR("only one of WPA or WEP is needed");
+
+    if ((flags & AP_GW4) && !(flags & AP_IN4))
+        ERR("default-gateway needs an IPv4 address/mask");
+
+    if ((flags & AP_GW6) && !(flags & AP_IN6))
+        ERR("default-gateway needs IPv6 address/mask");
+
+    if (d->nbss > AP_MAXBSS || d->noui > AP_MAXOUI)
+        ERR("too many pinned BSSIDs");
+
+    return 0;
+#undef ERR
+}
+
+
+
+static ssize_t
+fmt_ipmask(char *buf, size_t bsiz, char *fmt, int af, const void *addr, const void *mask)
+{
+    char a[128];
+    char m[128];
+
+    inet_ntop(af, addr, a, sizeof a);
+    inet_ntop(af, mask, m, sizeof m);
+
+    snprintf(buf, bsiz, fmt, a, m);
+    return strlen(buf);
+}
+
+static ssize_t
+fmt_ip(char *buf, size_t bsiz, char *fmt, int af, const void *addr)
+{
+    char a[128];
+
+    inet_ntop(af, addr, a, sizeof a);
+
+    snprintf(buf, bsiz, fmt, a);
+    return strlen(buf);
+}
+
+
+/*
+ * Describe ap info in text form that can be parsed back by
+ * apdata_parse().
+ */
+size_t
+apdata_sprintf(char *buf, size_t bsiz, const apdata *a)
+{
+    size_t orig = bsiz;
+    snprintf(buf, bsiz, "%s \"%s\"", a->flags & AP_PATTERN ? "pattern" : "nwid", a->apname);
+
+    ssize_t n = strlen(buf);
+    buf  += n;
+    bsiz -= n;
+
+    if (a->flags & AP_MYMAC) {
+        if (a->flags & AP_RANDMAC) {
+            snprintf(buf, bsiz, " lladdr random");
+        } else {
+            const uint8_t *m = &a->mymac[0];
+            snprintf(buf, bsiz, " lladdr " MACFMT, sMAC(m));
+        }
+        n = strlen(buf);
+        buf  += n;
+        bsiz -= n;
+    }
+
+
+    if (a->flags & AP_BSSID) {
+        const char *sep = " bssid ";
+        uint32_t i;
+
+        for (i = 0; i < a->nbss; i++, sep = ",") {
+            const uint8_t *m = a->bss[i];
+            snprintf(buf, bsiz, "%s" MACFMT, sep, sMAC(m));
+            n = strlen(buf);
+            buf  += n;
+            bsiz -= n;
+        }
+        for (i = 0; i < a->noui; i++, sep = ",") {
+            const uint8_t *m = a->oui[i];
+            snprintf(buf, bsiz, "%s%02x:%02x:%02x:*", sep, m[0], m[1], m[2]);
+            n = strlen(buf);
+            buf  += n;
+            bsiz -= n;
+        }
+    }
+
+    // XXX Do we show the key or not?
+    if (a->flags & AP_WPAKEY) {
+        snprintf(buf, bsiz, " using \"%s\"", a->key);
+        n = strlen(buf);
+        buf  += n;
+        bsiz -= n;
+    } else if (a->flags & AP_WEPKEY) {
+        snprintf(buf, bsiz, " nwkey \"%s\"", a->key);
+        n = strlen(buf);
+        buf  += n;
+        bsiz -= n;
+    }
+
+    if (a->flags & (AP_IN4|AP_IN4DHCP)) {
+        if (a->flags & AP_IN4DHCP) {
+            snprintf(buf, bsiz, " inet dhcp");
+            n = strlen(buf);
+            buf  += n;
+            bsiz -= n;
+        } else {
+            n = fmt_ipmask(buf, bsiz, " inet %s/%s", AF_INET, &a->in4, &a->mask4);
+            buf  += n;
+            bsiz -= n;
+
+            if (a->flags & AP_GW4) {
+                n = fmt_ip(buf, bsiz, " gw %s", AF_INET, &a->gw4);
+                buf  += n;
+                bsiz -= n;
+            }
+        }
+    }
+
+    if (a->flags & AP_IN6) {
+        n = fmt_ipmask(buf, bsiz, " inet6 %s/%s", AF_INET6, &a->in6, &a->mask6);
+        buf  += n;
+        bsiz -= n;
+    }
+
+    if (a->flags & AP_GW6) {
+        n = fmt_ip(buf, bsiz, " gw6 %s", AF_INET6, &a->gw6);
+        buf  += n;
+        bsiz -= n;
+    }
+
+    return orig - bsiz;
+}
+
+
+/*
+ * Printable form of scanned result
+ */
+ssize_t
+nodereq_sprintf(char * buf, size_t  bsiz, const struct ieee80211_nodereq *nr)
+{
+    size_t orig = bsiz;
+    uint16_t capinfo;
+    int i;
+
+#define PR(a, ...)   do { \
+                        ssize_t m = snprintf(buf, bsiz, a, ##__VA_ARGS__); \
+                        buf  += m; \
+                        bsiz -= m; \
+                    } while (0)
+
+    if (nr->nr_flags & IEEE80211_NODEREQ_AP ||
+        nr->nr_capinfo & IEEE80211_CAPINFO_IBSS) {
+
+        const uint8_t *mac = nr->nr_bssid;
+        char zz[IEEE80211_NWID_LEN+1];
+
+        copy_apname(zz, IEEE80211_NWID_LEN, nr);
+
+        PR("nwid \"%s\" chan %u bssid " MACFMT, zz, nr->nr_channel, sMAC(mac));
+    }
+
+    if ((nr->nr_flags & IEEE80211_NODEREQ_AP) == 0) {
+        const uint8_t *mac = nr->nr_macaddr;
+        PR(" lladdr " MACFMT, sMAC(mac));
+    }
+
+    if (nr->nr_max_rssi)
+        PR(" %u%% ", IEEE80211_NODEREQ_RSSI(nr));
+    else
+        PR(" %ddBm ", nr->nr_rssi);
+
+    if (nr->nr_pwrsave) PR(" powersave");
+
+    if ((nr->nr_flags & (IEEE80211_NODEREQ_AP)) == 0) {
+        if (nr->nr_flags & IEEE80211_NODEREQ_HT) {
+            PR("HT-MCS%d ", nr->nr_txmcs);
+        } else
+            if (nr->nr_nrates) {
+                PR(" %uM ", (nr->nr_rates[nr->nr_txrate] & IEEE80211_RATE_VAL) / 2);
+            }
+    } else if (nr->nr_max_rxrate) {
+        PR(" %uM HT ", nr->nr_max_rxrate);
+    } else if (nr->nr_rxmcs[0] != 0) {
+        for (i = IEEE80211_HT_NUM_MCS - 1; i >= 0; i--) {
+            if (isset(nr->nr_rxmcs, i))
+                break;
+        }
+        PR(" HT-MCS%d ", i);
+    } else if (nr->nr_nrates) {
+        PR(" %uM ", (nr->nr_rates[nr->nr_nrates - 1] & IEEE80211_RATE_VAL) / 2);
+    }
+
+    /* ESS is the default, skip it; 'nr' belongs to a published
+     * snapshot, so don't modify it in place. */
+    capinfo = nr->nr_capinfo & ~IEEE80211_CAPINFO_ESS;
+    if (capinfo) {
+        //printb_status(capinfo, IEEE80211_CAPINFO_BITS);
+        if (capinfo & IEEE80211_CAPINFO_PRIVACY) {
+            if (nr->nr_rsnciphers & IEEE80211_WPA_CIPHER_CCMP)
+                PR(" wpa2");
+            else if (nr->nr_rsnciphers & IEEE80211_WPA_CIPHER_TKIP)
+                PR(" wpa1");
+            else
+                PR(" wep");
+
+            if (nr->nr_rsnakms & IEEE80211_WPA_AKM_8021X ||
+                nr->nr_rsnakms & IEEE80211_WPA_AKM_SHA256_8021X)
+                PR(",802.1x");
+        }
+    }
+#if 0
+    if ((nr->nr_flags & IEEE80211_NODEREQ_AP) == 0)
+        printb_status(IEEE80211_NODEREQ_STATE(nr->nr_state),
+            IEEE80211_NODEREQ_STATE_BITS);
+#endif
+
+    return orig - bsiz;
+}
+
+
+/*
+ * Printable form of a join history; returns the # of bytes written.
+ */
+size_t
+bproto_joinhist_sprintf(char *buf, size_t bsiz, const bproto_joinhist *h)
+{
+    int n;
+
+    if (bsiz == 0) return 0;
+
+    n = snprintf(buf, bsiz, " joins %u/%u assoc-ms %u ip-ms %u",
+                 h->ok, h->attempts, h->assoc_ms, h->ip_ms);
+
+    if (h->quarantine > 0 && n > 0 && (size_t)n < bsiz)
+        n += snprintf(buf + n, bsiz - n, " quarantine %us", h->quarantine);
+
+    return n < 0 ? 0 : (size_t)n >= bsiz ? bsiz - 1 : (size_t)n;
+}
+
+
+static void
+json_ip(jsonw *w, const char *key, int af, const void *addr, const void *mask)
+{
+    char a[128];
+    char m[128];
+    size_t n;
+
+    inet_ntop(af, addr, a, sizeof a);
+    if (mask) {
+        n = strlen(a);
+        a[n++] = '/';
+        inet_ntop(af, mask, m, sizeof m);
+        strlcpy(a+n, m, (sizeof a) - n);
+    }
+
+    jsonw_kv_str(w, key, a);
+}
+
+
+/*
+ * Describe ap info as a JSON object with the same keywords as
+ * apdata_sprintf(). Keys are not shown; "auth" says which kind is
+ * set.
+ */
+void
+apdata_json(jsonw *w, const apdata *a)
+{
+    jsonw_obj_open(w);
+    jsonw_kv_str(w, a->flags & AP_PATTERN ? "pattern" : "nwid", a->apname);
+
+    if (a->flags & AP_MYMAC) {
+        if (a->flags & AP_RANDMAC)
+            jsonw_kv_str(w, "lladdr", "random");
+        else
+            jsonw_kv_mac(w, "lladdr", a->mymac);
+    }
+
+    if (a->flags & AP_BSSID) {
+        if (a->nbss > 0) jsonw_kv_mac(w, "bssid", a->apmac);
+        if (a->flags & AP_BSSIDSET) {
+            char oui[12];
+            uint32_t i;
+
+            jsonw_key(w, "bssids");
+            jsonw_arr_open(w);
+            for (i = 0; i < a->nbss; i++) jsonw_mac(w, a->bss[i]);
+            for (i = 0; i < a->noui; i++) {
+                const uint8_t *m = a->oui[i];
+                snprintf(oui, sizeof oui, "%02x:%02x:%02x:*", m[0], m[1], m[2]);
+                jsonw_str(w, oui);
+            }
+            jsonw_arr_close(w);
+        }
+    }
+
+    jsonw_kv_str(w, "auth", a->flags & AP_WPAKEY ? "wpa" :
+                            a->flags & AP_WEPKEY ? "wep" : "none");
+
+    if (a->flags & AP_IN4DHCP) {
+        jsonw_kv_str(w, "inet", "dhcp");
+    } else if (a->flags & AP_IN4) {
+        json_ip(w, "inet", AF_INET, &a->in4, &a->mask4);
+        if (a->flags & AP_GW4) json_ip(w, "gw", AF_INET, &a->gw4, 0);
+    }
+
+    if (a->flags & AP_IN6) json_ip(w, "inet6", AF_INET6, &a->in6, &a->mask6);
+    if (a->flags & AP_GW6) json_ip(w, "gw6", AF_INET6, &a->gw6, 0);
+
+    jsonw_obj_close(w);
+}
+
+
+/*
+ * Describe a scanned node as the members of a JSON object; mirrors
+ * nodereq_sprintf().
+ */
+void
+nodereq_json_fields(jsonw *w, const struct ieee80211_nodereq *nr)
+{
+    uint16_t capinfo;
+    int i;
+
+    if (nr->nr_flags & IEEE80211_NODEREQ_AP ||
+        nr->nr_capinfo & IEEE80211_CAPINFO_IBSS) {
+        size_t n = nr->nr_nwid_len > IEEE80211_NWID_LEN ? IEEE80211_NWID_LEN : nr->nr_nwid_len;
+
+        jsonw_key(w, "nwid");
+        jsonw_strn(w, (const char *)nr->nr_nwid, n);
+        jsonw_kv_uint(w, "chan", nr->nr_channel);
+        jsonw_kv_mac(w, "bssid", nr->nr_bssid);
+    }
+
+    if ((nr->nr_flags & IEEE80211_NODEREQ_AP) == 0)
+        jsonw_kv_mac(w, "lladdr", nr->nr_macaddr);
+
+    if (nr->nr_max_rssi)
+        jsonw_kv_uint(w, "rssi-pct", IEEE80211_NODEREQ_RSSI(nr));
+    else
+        jsonw_kv_int(w, "rssi-dbm", nr->nr_rssi);
+
+    if (nr->nr_pwrsave) jsonw_kv_bool(w, "powersave", 1);
+
+    if ((nr->nr_flags & (IEEE80211_NODEREQ_AP)) == 0) {
+        if (nr->nr_flags & IEEE80211_NODEREQ_HT)
+            jsonw_kv_uint(w, "ht-mcs", nr->nr_txmcs);
+        else if (nr->nr_nrates)
+            jsonw_kv_uint(w, "rate", (nr->nr_rates[nr->nr_txrate] & IEEE80211_RATE_VAL) / 2);
+    } else if (nr->nr_max_rxrate) {
+        jsonw_kv_uint(w, "ht-rate", nr->nr_max_rxrate);
+    } else if (nr->nr_rxmcs[0] != 0) {
+        for (i = IEEE80211_HT_NUM_MCS - 1; i >= 0; i--) {
+            if (isset(nr->nr_rxmcs, i))
+                break;
+        }
+        jsonw_kv_int(w, "ht-mcs", i);
+    } else if (nr->nr_nrates) {
+        jsonw_kv_uint(w, "rate", (nr->nr_rates[nr->nr_nrates - 1] & IEEE80211_RATE_VAL) / 2);
+    }
+
+    capinfo = nr->nr_capinfo & ~IEEE80211_CAPINFO_ESS;
+    if (capinfo & IEEE80211_CAPINFO_PRIVACY) {
+        if (nr->nr_rsnciphers & IEEE80211_WPA_CIPHER_CCMP)
+            jsonw_kv_str(w, "security", "wpa2");
+        else if (nr->nr_rsnciphers & IEEE80211_WPA_CIPHER_TKIP)
+            jsonw_kv_str(w, "security", "wpa1");
+        else
+            jsonw_kv_str(w, "security", "wep");
+
+        if (nr->nr_rsnakms & IEEE80211_WPA_AKM_8021X ||
+            nr->nr_rsnakms & IEEE80211_WPA_AKM_SHA256_8021X)
+            jsonw_kv_bool(w, "802.1x", 1);
+    } else {
+        jsonw_kv_str(w, "security", "none");
+    }
+
+}
+
+
+void
+nodereq_json(jsonw *w, const struct ieee80211_nodereq *nr)
+{
+    jsonw_obj_open(w);
+    nodereq_json_fields(w, nr);
+    jsonw_obj_close(w);
+}
+
+
+/*
+ * Compact, versioned encoding of apdata for the prefs DB:
+ *
+ *    u8  APDATA_ENC_MAGIC
+ *    u8  version (APDATA_ENC_V1)
+ *    u32 flags (AP_xxx), little endian
+ *    u8  len, apname
+ *    u8  len, key                   if AP_WPAKEY or AP_WEPKEY
+ *    6   apmac                      if AP_BSSID
+ *    6   mymac                      if AP_MYMAC
+ *    4+4 in4, mask4                 if AP_IN4
+ *    4   gw4                        if AP_GW4
+ *    16+16 in6, mask6               if AP_IN6
+ *    16  gw6                        if AP_GW6
+ *    u8 n, n*6 bss                  if AP_BSSIDSET
+ *    u8 n, n*3 oui                  if AP_BSSIDSET
+ *
+ * The BSSID set is last so that a reader that predates it still
+ * finds everything else in its place. Without AP_BSSIDSET, 'apmac'
+ * is the only pinned BSSID. The nr_xxx members are runtime state
+ * and are not stored.
+ */
+
+static inline uint8_t *
+enc_bytes(uint8_t *p, const void *v, size_t n)
+{
+    memcpy(p, v, n);
+    return p + n;
+}
+
+
+static inline uint8_t *
+enc_str(uint8_t *p, const char *s, size_t max)
+{
+    size_t n = strnlen(s, max - 1);
+
+    *p++ = n;
+    return enc_bytes(p, s, n);
+}
+
+
+ssize_t
+apdata_encode(uint8_t *buf, size_t bsiz, const apdata *d)
+{
+    uint8_t *p = buf;
+    uint32_t f = d->flags;
+
+    if (bsiz < APDATA_ENC_MAX) return -ENOSPC;
+
+    *p++ = APDATA_ENC_MAGIC;
+    *p++ = APDATA_ENC_V1;
+    *p++ = f & 0xff;
+    *p++ = (f >> 8)  & 0xff;
+    *p++ = (f >> 16) & 0xff;
+    *p++ = (f >> 24) & 0xff;
+
+    p = enc_str(p, d->apname, sizeof d->apname);
+
+    if (f & (AP_WPAKEY|AP_WEPKEY)) p = enc_str(p, d->key, sizeof d->key);
+    if (f & AP_BSSID) p = enc_bytes(p, d->apmac, 6);
+    if (f & AP_MYMAC) p = enc_bytes(p, d->mymac, 6);
+    if (f & AP_IN4) {
+        p = enc_bytes(p, &d->in4,   4);
+        p = enc_bytes(p, &d->mask4, 4);
+    }
+    if (f & AP_GW4) p = enc_bytes(p, &d->gw4, 4);
+    if (f & AP_IN6) {
+        p = enc_bytes(p, &d->in6,   16);
+        p = enc_bytes(p, &d->mask6, 16);
+    }
+    if (f & AP_GW6) p = enc_bytes(p, &d->gw6, 16);
+    if (f & AP_BSSIDSET) {
+        *p++ = d->nbss;
+        p = enc_bytes(p, d->bss, 6 * d->nbss);
+        *p++ = d->noui;
+        p = enc_bytes(p, d->oui, 3 * d->noui);
+    }
+
+    return p - buf;
+}
+
+
+/*
+ * Cursor over an encoded record; 'p' becomes null on overrun.
+ */
+struct dec
+{
+    const uint8_t *p;
+    const uint8_t *end;
+};
+
+
+static void
+dec_bytes(struct dec *c, void *v, size_t n)
+{
+    if (!c->p || (size_t)(c->end - c->p) < n) {
+        c->p = 0;
+        return;
+    }
+
+    memcpy(v, c->p, n);
+    c->p += n;
+}
+
+
+static void
+dec_str(struct dec *c, char *s, size_t max)
+{
+    uint8_t n = 0;
+
+    dec_bytes(c, &n, 1);
+    if (n >= max) {
+        c->p = 0;
+        return;
+    }
+
+    dec_bytes(c, s, n);
+    s[n] = 0;
+}
+
+
+/*
+ * A record pinned to just 'apmac' has it as the only member of the
+ * BSSID set.
+ */
+static void
+bssid_single(apdata *d)
+{
+    if ((d->flags & (AP_BSSID|AP_BSSIDSET)) != AP_BSSID) return;
+
+    memcpy(d->bss[0], d->apmac, 6);
+    d->nbss = 1;
+    d->noui = 0;
+}
+
+
+int
+apdata_decode(apdata *d, const uint8_t *buf, size_t n)
+{
+    struct dec c = { .p = buf, .end = buf + n };
+    uint8_t hdr[6];
+
+    memset(d, 0, sizeof *d);
+
+    if (n >= 2 && buf[0] == APDATA_ENC_MAGIC) {
+        if (buf[1] != APDATA_ENC_V1) return -EPROTONOSUPPORT;
+
+        dec_bytes(&c, hdr, sizeof hdr);
+
+        uint32_t f = hdr[2] | (hdr[3] << 8) | (hdr[4] << 16) | ((uint32_t)hdr[5] << 24);
+
+        d->flags = f;
+        dec_str(&c, d->apname, sizeof d->apname);
+
+        if (f & (AP_WPAKEY|AP_WEPKEY)) dec_str(&c, d->key, sizeof d->key);
+        if (f & AP_BSSID) dec_bytes(&c, d->apmac, 6);
+        if (f & AP_MYMAC) dec_bytes(&c, d->mymac, 6);
+        if (f & AP_IN4) {
+            dec_bytes(&c, &d->in4,   4);
+            dec_bytes(&c, &d->mask4, 4);
+        }
+        if (f & AP_GW4) dec_bytes(&c, &d->gw4, 4);
+        if (f & AP_IN6) {
+            dec_bytes(&c, &d->in6,   16);
+            dec_bytes(&c, &d->mask6, 16);
+        }
+        if (f & AP_GW6) dec_bytes(&c, &d->gw6, 16);
+        if (f & AP_BSSIDSET) {
+            uint8_t nb = 0, no = 0;
+
+            dec_bytes(&c, &nb, 1);
+            if (nb > AP_MAXBSS) return -EINVAL;
+            dec_bytes(&c, d->bss, 6 * nb);
+            dec_bytes(&c, &no, 1);
+            if (no > AP_MAXOUI) return -EINVAL;
+            dec_bytes(&c, d->oui, 3 * no);
+
+            d->nbss = nb;
+            d->noui = no;
+        }
+
+        if (!c.p) return -EINVAL;
+
+        bssid_single(d);
+        return 0;
+    }
+
+    // Records written before the compact encoding: a copy of the struct
+    // as it was then.
+    if (n == APDATA_V0_SIZE) {
+        memcpy(d, buf, APDATA_V0_SIZE);
+        d->apname[sizeof d->apname - 1] = 0;
+        d->key[sizeof d->key - 1] = 0;
+        d->flags &= ~AP_BSSIDSET;
+        bssid_single(d);
+        return 1;
+    }
+
+    return -EINVAL;
+}
+
+/* EOF */
@@ -0,0 +1,275 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * jsonw.h - Streaming JSON writer
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ * Notes
+ * =====
+ *
+ * * Output goes straight into a caller supplied fast_buf; the
+ *   writer keeps no other state than the nesting depth and a bit
+ *   per level that says if a separator is needed. Numbers and MAC
+ *   addresses are formatted without stdio.
+ *
+ * * The caller is responsible for emitting a well formed document:
+ *   keys only inside objects, balanced open/close.
+ *
+ * * Strings are escaped per RFC 8259; bytes >= 0x80 are copied as
+ *   is (SSIDs are usually UTF-8).
+ */
+
+#ifndef ___JSONW_H_7712093_1483501120__
+#define ___JSONW_H_7712093_1483501120__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "fastbuf.h"
+
+#define JSONW_MAXDEPTH      63
+
+struct jsonw
+{
+    fast_buf *b;
+    uint32_t  depth;
+    uint32_t  key;      // set if a key was just written
+    uint64_t  more;     // bit 'n': level 'n' has an element
+};
+typedef struct jsonw jsonw;
+
+
+static inline void
+jsonw_init(jsonw *w, fast_buf *b)
+{
+    w->b     = b;
+    w->depth = 0;
+    w->key   = 0;
+    w->more  = 0;
+}
+
+
+// Emit a ',' if this isn't the first element at this level.
+static inline void
+_jsonw_sep(jsonw *w)
+{
+    uint64_t bit = 1ULL << w->depth;
+
+    if (w->key) {
+        w->key = 0;
+        return;
+    }
+
+    if (w->more & bit) fast_buf_append(w->b, ',');
+    w->more |= bit;
+}
+
+
+static inline void
+_jsonw_open(jsonw *w, int c)
+{
+    _jsonw_sep(w);
+    fast_buf_append(w->b, c);
+
+    assert(w->depth < JSONW_MAXDEPTH);
+    w->depth++;
+    w->more &= ~(1ULL << w->depth);
+}
+
+
+static inline void
+_jsonw_close(jsonw *w, int c)
+{
+    assert(w->depth > 0);
+    w->depth--;
+    fast_buf_append(w->b, c);
+}
+
+#define jsonw_obj_open(w)   _jsonw_open(w, '{')
+#define jsonw_obj_close(w)  _jsonw_close(w, '}')
+#define jsonw_arr_open(w)   _jsonw_open(w, '[')
+#define jsonw_arr_close(w)  _jsonw_close(w, ']')
+
+
+// Write 'n' bytes of 's' as a quoted, escaped string.
+static inline void
+_jsonw_quote(fast_buf *b, const char *s, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run = s;
+    const char *end = s + n;
+
+    fast_buf_append(b, '"');
+    for (; s < end; s++) {
+        uint8_t c = *s;
+        char    e[6];
+        size_t  m = 2;
+
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        fast_buf_push(b, run, s - run);
+        run = s + 1;
+
+        e[0] = '\\';
+        switch (c) {
+            case '"':  e[1] = '"';  break;
+            case '\\': e[1] = '\\'; break;
+            case '\n': e[1] = 'n';  break;
+            case '\r': e[1] = 'r';  break;
+            case '\t': e[1] = 't';  break;
+            default:
+                e[1] = 'u';
+                e[2] = '0';
+                e[3] = '0';
+                e[4] = hex[c >> 4];
+                e[5] = hex[c & 0xf];
+                m    = 6;
+                break;
+        }
+        fast_buf_push(b, e, m);
+    }
+    fast_buf_push(b, run, end - run);
+    fast_buf_append(b, '"');
+}
+
+
+static inline void
+jsonw_key(jsonw *w, const char *k)
+{
+    _jsonw_sep(w);
+    _jsonw_quote(w->b, k, strlen(k));
+    fast_buf_append(w->b, ':');
+    w->key = 1;
+}
+
+
+static inline void
+jsonw_strn(jsonw *w, const char *s, size_t n)
+{
+    _jsonw_sep(w);
+    _jsonw_quote(w->b, s, n);
+}
+
+
+static inline void
+jsonw_str(jsonw *w, const char *s)
+{
+    jsonw_strn(w, s, strlen(s));
+}
+
+
+static inline void
+_jsonw_lit(jsonw *w, const char *s, size_t n)
+{
+    _jsonw_sep(w);
+    fast_buf_push(w->b, s, n);
+}
+
+#define jsonw_bool(w, v)    ((v) ? _jsonw_lit(w, "true", 4) : _jsonw_lit(w, "false", 5))
+#define jsonw_null(w)       _jsonw_lit(w, "null", 4)
+
+
+static inline void
+jsonw_uint(jsonw *w, uint64_t v)
+{
+    char  buf[24];
+    char *p = buf + sizeof buf;
+
+    do {
+        *--p = '0' + (v % 10);
+        v   /= 10;
+    } while (v > 0);
+
+    _jsonw_lit(w, p, (buf + sizeof buf) - p);
+}
+
+
+static inline void
+jsonw_int(jsonw *w, int64_t v)
+{
+    char  buf[24];
+    char *p = buf + sizeof buf;
+    uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+
+    do {
+        *--p = '0' + (u % 10);
+        u   /= 10;
+    } while (u > 0);
+
+    if (v < 0) *--p = '-';
+
+    _jsonw_lit(w, p, (buf + sizeof buf) - p);
+}
+
+
+// Write a 6 byte MAC address as "xx:xx:xx:xx:xx:xx"
+static inline void
+jsonw_mac(jsonw *w, const uint8_t *m)
+{
+    static const char hex[] = "0123456789abcdef";
+    char buf[19];
+    char *p = buf;
+    int i;
+
+    *p++ = '"';
+    for (i = 0; i < 6; i++) {
+        if (i > 0) *p++ = ':';
+        *p++ = hex[m[i] >> 4];
+        *p++ = hex[m[i] & 0xf];
+    }
+    *p++ = '"';
+
+    _jsonw_lit(w, buf, p - buf);
+}
+
+
+/*
+ * key:value shorthands for objects.
+ */
+#define jsonw_kv_str(w, k, v)   do { jsonw_key(w, k); jsonw_str(w, v);  } while (0)
+#define jsonw_kv_uint(w, k, v)  do { jsonw_key(w, k); jsonw_uint(w, v); } while (0)
+#define jsonw_kv_int(w, k, v)   do { jsonw_key(w, k); jsonw_int(w, v);  } while (0)
+#define jsonw_kv_bool(w, k, v)  do { jsonw_key(w, k); jsonw_bool(w, v); } while (0)
+#define jsonw_kv_mac(w, k, v)   do { jsonw_key(w, k); jsonw_mac(w, v);  } while (0)
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___JSONW_H_7712093_1483501120__ */
+
+/* EOF */
@@ -0,0 +1,153 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * tlv.h - Encode and decode type-length-value records in a fast_buf
+ *
+ * Author Sudhi Herle <sudhi-at-herle.net>
+ *
+ * Copyright (c) 2016, 2017
+ *  The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef ___TLV_H_4418902_1483412511__
+#define ___TLV_H_4418902_1483412511__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "fastbuf.h"
+
+/*
+ * Each record is a 16-bit type, a 16-bit length and 'length' bytes
+ * of value. Everything is in host byte order.
+ */
+struct tlv
+{
+    uint16_t type;
+    uint16_t len;
+    const uint8_t *val;
+};
+typedef struct tlv tlv;
+
+#define TLV_HDRSZ       4
+#define TLV_MAXLEN      0xffff
+
+
+/*
+ * Append a record of type 'ty' and value 'v' of 'n' bytes to 'b'.
+ */
+static inline void
+tlv_put(fast_buf *b, uint16_t ty, const void *v, size_t n)
+{
+    uint16_t h[2] = { ty, (uint16_t)n };
+
+    assert(n <= TLV_MAXLEN);
+    fast_buf_push(b, h, sizeof h);
+    if (n > 0) fast_buf_push(b, v, n);
+}
+
+static inline void
+tlv_put_u32(fast_buf *b, uint16_t ty, uint32_t v)
+{
+    tlv_put(b, ty, &v, sizeof v);
+}
+
+/* Strings are sent without the trailing NUL */
+static inline void
+tlv_put_str(fast_buf *b, uint16_t ty, const char *s)
+{
+    size_t n = strlen(s);
+
+    tlv_put(b, ty, s, n > TLV_MAXLEN ? TLV_MAXLEN : n);
+}
+
+
+/*
+ * Decode the next record from the 'n' bytes at 'p'. On success,
+ * advance 'p' and 'n' past the record.
+ *
+ * Return:
+ *    1 if a complete record was decoded into 't'
+ *    0 if more bytes are needed
+ */
+static inline int
+tlv_get(const uint8_t **p, size_t *n, tlv *t)
+{
+    uint16_t h[2];
+
+    if (*n < TLV_HDRSZ) return 0;
+
+    memcpy(h, *p, sizeof h);
+    if (*n < (TLV_HDRSZ + (size_t)h[1])) return 0;
+
+    t->type = h[0];
+    t->len  = h[1];
+    t->val  = *p + TLV_HDRSZ;
+
+    *p += TLV_HDRSZ + t->len;
+    *n -= TLV_HDRSZ + t->len;
+    return 1;
+}
+
+
+/*
+ * Return the value of 't' as a uint32_t; 0 if it is malformed.
+ */
+static inline uint32_t
+tlv_u32(const tlv *t)
+{
+    uint32_t v = 0;
+
+    if (t->len == sizeof v) memcpy(&v, t->val, sizeof v);
+    return v;
+}
+
+
+/*
+ * Copy the value of 't' as a NUL terminated string into 'buf'.
+ */
+static inline char *
+tlv_str(const tlv *t, char *buf, size_t bsiz)
+{
+    size_t n = t->len >= bsiz ? bsiz-1 : t->len;
+
+    memcpy(buf, t->val, n);
+    buf[n] = 0;
+    return buf;
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___TLV_H_4418902_1483412511__ */
+
+/* EOF */